@@ -0,0 +1,10 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// Host stand in for avr-libc's io.h: just what lib/util/io.h's bit macros need.
+#ifndef BENCH_AVR_IO_H
+#define BENCH_AVR_IO_H
+
+#define _BV(bit) (1 << (bit))
+
+#endif
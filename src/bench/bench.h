@@ -0,0 +1,29 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// Helpers for host native benchmarks.
+#ifndef BENCH_H
+#define BENCH_H
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycles"
+//! return timestamp counter
+static inline uint64_t bench_now()
+{
+    return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+//! no cycle counter: return monotonic time in ns
+static inline uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+#endif
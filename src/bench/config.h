@@ -0,0 +1,15 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// Configuration used when building library code natively on the host for benchmarks, see Makefile bench target.
+#ifndef BENCH_CONFIG_H
+#define BENCH_CONFIG_H
+
+#define MMP_DEFS
+#define MMP_TIMER_TIMEOUT 2
+#define MMP_NO_REBOOT
+
+#define MMP_CMD_DEFS
+#undef MMP_CMD_LOGGING
+
+#endif
@@ -0,0 +1,108 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// Compare MMP receivers: the old per-char state function parser, mmp_rx_ch() and mmp_rx_buf().
+// Reports cycles (or ns, if there's no cycle counter) per byte of a stream of command messages.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "lib/mmp/mmp.h"
+
+// from mmp_legacy.c
+typedef struct {
+    void *(*state_fn)(mmp_msg_ctrl_t *msg, uint8_t byte);
+    mmp_msg_ctrl_t ctrl;
+} legacy_ctrl_t;
+void legacy_init(legacy_ctrl_t *c, uint8_t *buf, uint8_t buf_size, void (*handler)(void *user_data, mmp_msg_t *msg), void *user_data);
+void legacy_rx_ch(legacy_ctrl_t *c, uint8_t byte);
+
+// size of the test stream
+#define STREAM_SIZE 65536
+// times that the stream is parsed
+#define REPEAT 50
+// chars passed to mmp_rx_buf() at a time, as main.c does with uart_read()
+#define CHUNK 16
+
+static uint8_t stream[STREAM_SIZE];
+static uint32_t stream_len;
+static uint32_t stream_frames;
+static uint32_t received;
+
+void wdt_reset_mcu(){}
+
+static void handler(void *user_data, mmp_msg_t *msg)
+{
+    received++;
+}
+
+// fill stream with command messages with data lengths 1 to 64
+static void make_stream()
+{
+    uint32_t i=0;
+    uint8_t len=1;
+    srand(1);
+    while(i + 64 + 6 < STREAM_SIZE){
+	uint8_t cs = len + 2;
+	stream[i++] = MSG_SOM;
+	stream[i++] = len;
+	stream[i++] = 2;
+	stream[i++] = MSG_STX;
+	for(uint8_t j=0; j<len; j++){
+	    uint8_t b = rand();
+	    stream[i++] = b;
+	    cs += b;
+	}
+	stream[i++] = MSG_ETX;
+	stream[i++] = cs;
+	stream_frames++;
+	len = len % 64 + 1;
+    }
+    stream_len = i;
+}
+
+static void report(const char *name, uint64_t t)
+{
+    double per_byte = (double)t / ((double)stream_len * REPEAT);
+    printf("%-24s %8.2f %s/byte  %u/%u frames\n", name, per_byte, BENCH_UNIT, received, stream_frames * REPEAT);
+    received = 0;
+}
+
+int main()
+{
+    static uint8_t buf[128];
+    uint64_t t;
+    make_stream();
+    printf("%u bytes, %u frames, x%u\n", stream_len, stream_frames, REPEAT);
+
+    legacy_ctrl_t legacy;
+    legacy_init(&legacy, buf, sizeof(buf), handler, NULL);
+    t = bench_now();
+    for(int r=0; r<REPEAT; r++){
+	for(uint32_t i=0; i<stream_len; i++){
+	    legacy_rx_ch(&legacy, stream[i]);
+	}
+    }
+    report("state_fn (old)", bench_now() - t);
+
+    mmp_ctrl_t mmp;
+    mmp_init(&mmp, buf, sizeof(buf), handler, NULL);
+    t = bench_now();
+    for(int r=0; r<REPEAT; r++){
+	for(uint32_t i=0; i<stream_len; i++){
+	    mmp_rx_ch(&mmp, stream[i]);
+	}
+    }
+    report("mmp_rx_ch", bench_now() - t);
+
+    mmp_init(&mmp, buf, sizeof(buf), handler, NULL);
+    t = bench_now();
+    for(int r=0; r<REPEAT; r++){
+	for(uint32_t i=0; i<stream_len; i+=CHUNK){
+	    uint32_t n = stream_len - i < CHUNK ? stream_len - i : CHUNK;
+	    mmp_rx_buf(&mmp, stream+i, n);
+	}
+    }
+    report("mmp_rx_buf", bench_now() - t);
+    return 0;
+}
@@ -0,0 +1,89 @@
+#!/usr/bin/python3
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+# Compare the host's mmp parsers, see telecnatron/mmp/parser.py: frames/s parsed from a stream of the chars
+# that the MCU sends, read a char at a time, as the reader used to, and in chunks. The stream is made up of
+# v1, v2 and COBS framed messages and log strings, or is read from the file named on the command line, eg
+# chars captured from the MCU's uart. Build the native parser first with 'make host', see 'make bench_host'.
+import os, sys, time, random, binascii
+from struct import pack
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from telecnatron.mmp.MMP import MMP
+from telecnatron.mmp.parser import PyParser, NativeParser, REC_MSG
+
+# size of the made up stream
+STREAM_SIZE = 1 << 20
+# chars returned by each read
+CHUNKS = (1, 64, 4096)
+# minimum time that each parser is run for, seconds
+MIN_TIME = 1.0
+
+# -------------------------------
+def make_stream():
+    """ return made up stream, and the number of messages in it """
+    random.seed(1)
+    out = bytearray()
+    frames = 0
+    length = 1
+    while len(out) < STREAM_SIZE:
+        data = bytes(random.getrandbits(8) for i in range(length))
+        kind = frames % 4
+        if kind == 0:
+            # v1, with the checksum that MCU sends
+            flags = 0x02
+            out += pack('<BBBB', 1, length, flags, 2) + data + pack('<BB', 3, (256 - (length + flags + sum(data))) % 256)
+        elif kind == 1:
+            # v2
+            flags = 0x02 | MMP.FLAGS_CRC
+            crc = binascii.crc_hqx(bytes((length, flags)) + data, MMP.CRC_INIT)
+            out += pack('<BBBB', 1, length, flags, 2) + data + pack('<BH', 3, crc)
+        elif kind == 2:
+            # COBS
+            flags = 0x02 | MMP.FLAGS_COBS
+            crc = binascii.crc_hqx(bytes((length, flags)) + data, MMP.CRC_INIT)
+            out += b'\0' + MMP.cobsEncode(bytes((flags,)) + data + pack('<H', crc)) + b'\0'
+        else:
+            # a log string between messages
+            out += b'\tLOG:INFO:' + b'x' * length + b'\n'
+            out += pack('<BBBB', 1, 1, 0x02, 2) + b'\x55' + pack('<BB', 3, (256 - (1 + 2 + 0x55)) % 256)
+        frames += 1
+        length = length % 64 + 1
+    return bytes(out), frames
+
+# -------------------------------
+def run(parser, stream, chunk):
+    """ return frames/s, chars/s and number of messages that parser parses from stream read chunk chars at a time """
+    msgs = 0
+    passes = 0
+    t = time.perf_counter()
+    elapsed = 0
+    while elapsed < MIN_TIME:
+        for i in range(0, len(stream), chunk):
+            for rec in parser.feed(stream[i:i+chunk]):
+                msgs += rec[0] == REC_MSG
+        passes += 1
+        elapsed = time.perf_counter() - t
+        if chunk == 1:
+            # a char at a time is slow, one pass is plenty
+            break
+    return msgs / elapsed, passes * len(stream) / elapsed, msgs // passes
+
+# -------------------------------
+if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        with open(sys.argv[1], 'rb') as f:
+            stream = f.read()
+        print(f"{sys.argv[1]}: {len(stream)} chars")
+    else:
+        stream, frames = make_stream()
+        print(f"{len(stream)} chars, {frames} messages and {frames//4} log strings")
+    native = NativeParser.load()
+    if native is None:
+        print("native parser not loaded, build it with: make host")
+    parsers = [('python', PyParser)] + ([('native', NativeParser.load)] if native else [])
+    for name, make in parsers:
+        for chunk in CHUNKS:
+            fps, cps, msgs = run(make(), stream, chunk)
+            print(f"{name:8} chunk {chunk:5}: {fps:12.0f} frames/s {cps/1e6:8.2f} Mchars/s  {msgs} messages")
@@ -0,0 +1,106 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// The MMP receiver as it was before mmp_rx_buf(): one state function call per char, via a pointer.
+// Kept for comparison by mmp_bench.c only.
+#include "lib/mmp/mmp.h"
+
+typedef struct {
+    void *(*state_fn)(mmp_msg_ctrl_t *msg, uint8_t byte);
+    mmp_msg_ctrl_t ctrl;
+} legacy_ctrl_t;
+
+static void *legacy_SOM(mmp_msg_ctrl_t *msg,  uint8_t byte);
+static void *legacy_LEN(mmp_msg_ctrl_t *msg,  uint8_t byte);
+static void *legacy_FLAGS(mmp_msg_ctrl_t *msg,  uint8_t byte);
+static void *legacy_STX(mmp_msg_ctrl_t *msg,  uint8_t byte);
+static void *legacy_DATA(mmp_msg_ctrl_t *msg, uint8_t byte);
+static void *legacy_EOT(mmp_msg_ctrl_t *msg,  uint8_t byte);
+static void *legacy_CS(mmp_msg_ctrl_t *msg,  uint8_t byte);
+
+#define MMP_TIMER_START() msg->timer=MMP_TIMER_TIMEOUT
+#define MMP_TIMER_STOP() msg->timer=0
+
+void legacy_init(legacy_ctrl_t *c, uint8_t *buf, uint8_t buf_size, void (*handler)(void *user_data, mmp_msg_t *msg), void *user_data)
+{
+    c->ctrl.msg.data=buf;
+    c->ctrl.data_max_len=buf_size;
+    c->state_fn = legacy_SOM;
+    c->ctrl.handler = handler;
+    c->ctrl.user_data = user_data;
+}
+
+void legacy_rx_ch(legacy_ctrl_t *c, uint8_t byte)
+{
+    c->state_fn = (void *) c->state_fn(&(c->ctrl), byte);
+}
+
+static void *legacy_SOM(mmp_msg_ctrl_t *msg,  uint8_t byte)
+{
+    if( byte == MSG_SOM ){
+	MMP_TIMER_START();
+	return legacy_LEN;
+    }
+    return legacy_SOM;
+}
+
+static void *legacy_LEN(mmp_msg_ctrl_t *msg,  uint8_t byte)
+{
+    msg->msg.len=byte;
+    MMP_TIMER_START();
+    msg->cs = byte;
+    return legacy_FLAGS;
+}
+
+static void *legacy_FLAGS(mmp_msg_ctrl_t *msg,  uint8_t byte)
+{
+    msg->msg.flags=byte;
+    MMP_TIMER_START();
+    msg->cs  += byte;
+    return legacy_STX;
+}
+
+static void *legacy_STX(mmp_msg_ctrl_t *msg, uint8_t byte)
+{
+    if( byte == MSG_STX){
+	MMP_TIMER_START();
+	msg->count=0;
+	return legacy_DATA;
+    }
+    MMP_TIMER_STOP();
+    return legacy_SOM;
+}
+
+static void *legacy_DATA(mmp_msg_ctrl_t *msg, uint8_t byte)
+{
+    if(msg->count  <  msg->data_max_len){
+	msg->msg.data[msg->count]=byte;
+	msg->cs  += byte;
+	MMP_TIMER_START();
+	if( ++msg->count == msg->msg.len ){
+	    return legacy_EOT;
+	}
+	return legacy_DATA;
+    }
+    MMP_TIMER_STOP();
+    return legacy_SOM;
+}
+
+static void *legacy_EOT(mmp_msg_ctrl_t *msg,  uint8_t byte)
+{
+    if( byte == MSG_ETX ){
+	MMP_TIMER_START();
+	return legacy_CS;
+    }
+    MMP_TIMER_STOP();
+    return legacy_SOM;
+}
+
+static void *legacy_CS(mmp_msg_ctrl_t *msg,  uint8_t byte)
+{
+    if( byte == msg->cs){
+	msg->handler(msg->user_data, &(msg->msg));
+    }
+    MMP_TIMER_STOP();
+    return legacy_SOM;
+}
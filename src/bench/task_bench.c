@@ -0,0 +1,55 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// Cost of the task system's tick alarms: TASK_NUM_TASKS tasks that each sleep for their own number of
+// ticks every time they run, as task_ina219, task_led etc do. Reports cycles (or ns, if there's no cycle
+// counter) per tick spent in task_tick() and task_run(), including the tasks re-arming their alarms.
+// Built once for each number of tasks, with lib/task.c or with bench/task_legacy.c, see Makefile bench_task target.
+#include <stdio.h>
+#include <stdint.h>
+#include "bench.h"
+#include "lib/task.h"
+
+#ifndef TASK_BENCH_NAME
+#define TASK_BENCH_NAME "wheel"
+#endif
+
+// ticks that are run in each round
+#define TICKS 1000000
+// rounds that are run, the fastest is reported
+#define ROUNDS 5
+
+// ticks that each task sleeps for
+static uint16_t period[TASK_NUM_TASKS];
+// number of times tasks were run, should be the same whichever alarms are used
+static uint32_t runs;
+
+static void task_sleeper(void *data)
+{
+    runs++;
+    task_set_tick_timer(*(uint16_t *)data);
+}
+
+int main()
+{
+    uint64_t best = UINT64_MAX, t;
+    for(uint8_t i=0; i < TASK_NUM_TASKS; i++){
+	// 2 to 300 ticks, spread so that alarms don't all fall together
+	period[i] = 2 + (i * 97u) % 299;
+	task_init(i, task_sleeper, &period[i], 1);
+    }
+    task_run();
+    for(uint8_t r=0; r < ROUNDS; r++){
+	t = bench_now();
+	for(uint32_t i=0; i < TICKS; i++){
+	    task_tick();
+	    task_run();
+	}
+	t = bench_now() - t;
+	if(t < best){
+	    best = t;
+	}
+    }
+    printf("%-8s %3u tasks: %8.1f %s/tick  %u runs\n", TASK_BENCH_NAME, TASK_NUM_TASKS, (double)best / TICKS, BENCH_UNIT, runs);
+    return 0;
+}
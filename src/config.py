@@ -1,5 +1,5 @@
 # -----------------------------------------------------------------------------
-# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# Automatically generated from config.def by configure.py, don't edit.
 # -----------------------------------------------------------------------------
 
 import logging
@@ -13,4 +13,16 @@ class MMPCmd():
     CMD_LOAD_SWITCH      =4
     CMD_SHTDWN           =5
     CMD_MEASUREMENTS     =6
+    CMD_BAUD             =7
+    CMD_UART_STATS       =8
+    CMD_CAPS             =9
+    CMD_BATCH            =10
+    CMD_BULK             =11
+    CMD_SUBSCRIBE        =12
+    CMD_LINK_TEST        =13
+    CMD_TASK_STATS       =14
 
+# -----------------------------------
+class Tasks():
+    # task names, in order of task number: configure.py numbers the tasks in config.def highest priority first
+    NAMES = ('ina219', 'clock', 'load_switch', 'energy', 'telemetry', 'baud', 'bulk', 'txq', 'led', 'lcd_init', 'lcd_run')
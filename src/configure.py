@@ -1,8 +1,9 @@
 #!/usr/bin/python3
 # -----------------------------------------------------------------------------
-import sys, os
+import sys, os, re, json
 from datetime import datetime
 from pathlib import Path
+from telecnatron.mmp.logtok import arg_types, arg_types_word, c_unescape, DICT_FILE
 
 # ---------------------------------------
 # globals:
@@ -11,13 +12,17 @@ lnum=0
 
 # task number of next to be created task
 tnum=0
-#
+# (name, priority, run) of each task, in config.def order
 tasks=[]
+# task priorities, highest first. Tasks are numbered in this order, then in config.def order.
+task_prios=('high', 'normal', 'low')
 #
 versions=[]
 version_str=""
 #
 cmds=[]
+# log format strings, in order of their token ids: (C literal, text)
+log_formats=[]
 # ---------------------------------------
 def handle_pindef(params):
     (name, port, pin) = params
@@ -85,10 +90,23 @@ def handle_task(param):
     name=param[0]
     #sys.stderr.write(f"task parm: {param},j len: {len(param)}\n")
     run=1
-    if len(param)== 2:
-        # second param  was specified, this indicates that task should be initialised as not runnable
-        run=0
-    tasks.append( (name,len(tasks), run) )
+    prio='normal'
+    for p in param[1:]:
+        if p.startswith('prio='):
+            # eg .task(ina219, prio=high)
+            prio=p[len('prio='):]
+            if prio not in task_prios:
+                raise Exception(f"task priority must be one of {', '.join(task_prios)} at input file line {lnum}: {p}")
+        else:
+            # second param  was specified, this indicates that task should be initialised as not runnable
+            run=0
+    tasks.append( (name, prio, run) )
+
+# ---------------------------------------
+def numbered_tasks():
+    """return list of (name, number, run, prio) of tasks, numbered highest priority first"""
+    ordered=sorted(tasks, key=lambda t: task_prios.index(t[1]))
+    return [(t, n, r, p) for (n, (t, p, r)) in enumerate(ordered)]
 
 # ---------------------------------------
 def handle_mmp_cmd(param):
@@ -104,7 +122,7 @@ def write_task_init():
         return
     print('// initialise the tasks')
     print('void init_tasks()\n{')
-    for (t, n, r ) in tasks:
+    for (t, n, r, p) in numbered_tasks():
         print(f'    task_init(TASK_{t.upper()}, task_{t}, NULL, {r});') 
     print('}\n')
     
@@ -116,16 +134,16 @@ def write_task_defines():
         # no tasks were defined
         return
     
-    print(f"// task definitions")
-    for (t,n,r) in tasks:
+    print(f"// task definitions, numbered in order of priority")
+    for (t,n,r,p) in numbered_tasks():
         # eg: #define TASK_BLINK 0
-        print(f"#define TASK_{t.upper()} {n}")
+        print(f"#define TASK_{t.upper():<20} {n:<3} // prio {p}")
     # eg: #define TASK_NUM_TASKS 2
     print(f"#define TASK_NUM_TASKS {len(tasks)}\n")
 
     # task function forward declarations
     print(f'// task function forward declarations') 
-    for (t,n,r)  in tasks:
+    for (t,n,r,p)  in numbered_tasks():
         print(f'void task_{t}();')
     print()
 # ---------------------------------------
@@ -141,17 +159,43 @@ mmp_cmd_handler_t cmd_msg_tab[]={
 
     print("""
 // initialise the mmp messaging system:
-// max message lentgh
+#ifdef MMP_RX_IN_PLACE
+// max command message length: commands are parsed in place in the uart rx buffer,
+// those that wrap around its end are copied to msg_buf, unless they are queued.
+#define MSG_MAX_LEN 64
+#else
+// max command message length
 #define MSG_MAX_LEN 128
-// buffer for messages
+#endif
+// max reply message length
+#define REPLY_MAX_LEN 64
+#if !defined(MMP_RX_IN_PLACE) || !defined(MMP_CMD_QUEUED)
+// buffer for received command messages
 static uint8_t msg_buf[MSG_MAX_LEN];
+#endif
+// buffer in which reply messages are built, so that a command can be received while the prior reply is sent
+static uint8_t reply_buf[REPLY_MAX_LEN];
 // mmp_cmd control structure
 mmp_cmd_ctrl_t mmp_cmd_ctrl;
+#ifdef MMP_CMD_QUEUED
+// received commands waiting for mmp_cmd_run()
+static uint8_t cmd_queue[MMP_CMD_QUEUE_LEN * MMP_CMD_QUEUE_SLOT_SIZE];
+#endif
 
 // call the init function
 void init_mmp_cmd()
 {
-    mmp_cmd_init(&mmp_cmd_ctrl, msg_buf, MSG_MAX_LEN, cmd_msg_tab, CMD_TAB_NUM_ENTRIES(cmd_msg_tab), uart_putc);
+#if defined(MMP_RX_IN_PLACE) && defined(MMP_CMD_QUEUED)
+    // commands are copied to the queue, msg_buf isn't needed
+    mmp_cmd_init_ring(&mmp_cmd_ctrl, (uint8_t *)UART.rxbuf, UART_RX_SIZE(), NULL, 0, reply_buf, REPLY_MAX_LEN, cmd_msg_tab, CMD_TAB_NUM_ENTRIES(cmd_msg_tab), uart_putc);
+#elif defined(MMP_RX_IN_PLACE)
+    mmp_cmd_init_ring(&mmp_cmd_ctrl, (uint8_t *)UART.rxbuf, UART_RX_SIZE(), msg_buf, MSG_MAX_LEN, reply_buf, REPLY_MAX_LEN, cmd_msg_tab, CMD_TAB_NUM_ENTRIES(cmd_msg_tab), uart_putc);
+#else
+    mmp_cmd_init(&mmp_cmd_ctrl, msg_buf, MSG_MAX_LEN, reply_buf, REPLY_MAX_LEN, cmd_msg_tab, CMD_TAB_NUM_ENTRIES(cmd_msg_tab), uart_putc);
+#endif
+#ifdef MMP_CMD_QUEUED
+    mmp_cmd_init_queue(&mmp_cmd_ctrl, cmd_queue, MMP_CMD_QUEUE_SLOT_SIZE, MMP_CMD_QUEUE_LEN);
+#endif
 }
 """.lstrip())    
 
@@ -186,6 +230,93 @@ def write_mmp_cmds():
     for (t,n) in cmds:
         # forward declarations
         print(f'void cmd_{t}(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_len, uint8_t *data, uint8_t *reply_data);')
+# ---------------------------------------
+# a call of a LOG_xxx_FP() macro, or of one of the XXX_LOG_xxx() macros that wrap them, with a literal format string.
+# LOG_xxx(msg) and LOG_xxx_P(msg) don't take a format and aren't matched.
+RE_LOG_CALL=re.compile(r'\b(\w*LOG\w*)\s*\(\s*((?:"(?:[^"\\\n]|\\.)*"\s*)+)[,)]')
+RE_LOG_NOT_FMT=re.compile(r'^LOG(_DEBUG|_INFO|_WARN|_ERROR)?$|_P$')
+RE_STR_LIT=re.compile(r'"((?:[^"\\\n]|\\.)*)"')
+# a comment, or a string or char literal, which is matched so that comment markers inside it are left alone
+RE_COMMENT=re.compile(r'//[^\n]*|/\*.*?\*/|"(?:[^"\\\n]|\\.)*"|\'(?:[^\'\\\n]|\\.)*\'', re.S)
+
+def strip_comments(src):
+    """return C source with its comments blanked out, so that commented out log calls aren't given tokens"""
+    return RE_COMMENT.sub(lambda m: ' ' if m.group(0)[0]=='/' else m.group(0), src)
+
+def scan_log_formats():
+    """find the log format strings in the C sources, so that they can be given token ids"""
+    global log_formats
+    seen=set()
+    for path in sorted(Path('.').rglob('*.[ch]')):
+        if path.parts[0] in ('build', 'bench') or path.name in ('config.h', 'config.c'):
+            continue
+        for m in RE_LOG_CALL.finditer(strip_comments(path.read_text(errors='replace'))):
+            if RE_LOG_NOT_FMT.search(m.group(1)):
+                continue
+            # adjacent literals are concatenated
+            lit=''.join(RE_STR_LIT.findall(m.group(2)))
+            if lit in seen:
+                continue
+            seen.add(lit)
+            text=c_unescape(lit)
+            if arg_types(text) is not None:
+                log_formats.append((lit, text))
+
+# ---------------------------------------
+def write_log_tokens():
+    """LOG_TOKEN(fmt) macro that gives a format string's token id. The compiler evaluates it, so only ids
+    end up in flash. Format strings that aren't in the table give LOG_TOKEN_NONE and are logged as text."""
+    global log_formats
+    print('// log format string token ids, see lib/log.h')
+    print(f'#define LOG_TOKEN_NUM {len(log_formats)}')
+    print('#define LOG_TOKEN(fmt) ( \\')
+    for (n, (lit, text)) in enumerate(log_formats):
+        print(f'    __builtin_strcmp(fmt, "{lit}")==0 ? {n} : \\')
+    print('    LOG_TOKEN_NONE )\n')
+
+# ---------------------------------------
+def write_log_token_args():
+    """argument types of each log token, for config.c"""
+    global log_formats
+    print('#ifdef LOG_TOKENS')
+    print('// argument types of each log token, see LOG_ARG_xxx in lib/log.h')
+    print('const uint32_t log_token_args[LOG_TOKEN_NUM ? LOG_TOKEN_NUM : 1] PROGMEM ={')
+    for (n, (lit, text)) in enumerate(log_formats):
+        print(f'    0x{arg_types_word(arg_types(text)):08x}, // {n}: "{lit}"')
+    print('};\n#endif\n')
+
+# ---------------------------------------
+def write_log_dict():
+    """dictionary used by host to turn tokens back into text, see telecnatron/mmp/logtok.py"""
+    global log_formats
+    with open(DICT_FILE, 'w') as f:
+        json.dump({'formats': [text for (lit, text) in log_formats]}, f, indent=1)
+        f.write('\n')
+
+# ---------------------------------------
+def write_config_py():
+    """command numbers and task names for the host's scripts, eg tester.py. There's no timestamp, so
+    the file only changes when config.def does."""
+    with open('config.py', 'w') as f:
+        f.write(f"""# -----------------------------------------------------------------------------
+# Automatically generated from config.def by {os.path.basename(sys.argv[0])}, don't edit.
+# -----------------------------------------------------------------------------
+
+import logging
+# -----------------------------------
+class MMPCmd():
+    # mmp command numbers
+""")
+        for (t,n) in cmds:
+            f.write(f"    {'CMD_'+t.upper():<21}={n}\n")
+        names=', '.join(f"'{t}'" for (t,n,r,p) in numbered_tasks())
+        f.write(f"""
+# -----------------------------------
+class Tasks():
+    # task names, in order of task number: configure.py numbers the tasks in config.def highest priority first
+    NAMES = ({names})
+""")
+
 # ---------------------------------------
 def write_version():
     """version infomation string variable for config.c"""
@@ -240,6 +371,16 @@ def file_marker(fname="", end=False):
 
 if __name__ == '__main__':
 
+    if sys.argv[1:2] == ['--formats']:
+        # list the log format strings in the passed file, which is only rewritten if they have changed, so
+        # that Makefile can have config.h depend on it rather than on every source file.
+        scan_log_formats()
+        text=''.join(f'{lit}\n' for (lit, text) in log_formats)
+        path=Path(sys.argv[2])
+        if not path.exists() or path.read_text() != text:
+            path.write_text(text)
+        sys.exit(0)
+
     # write config.h
     with open('config.h', 'w') as out:
         # stdout redirected to config.h
@@ -267,6 +408,8 @@ if __name__ == '__main__':
                     print(line)
             write_task_defines()
             write_mmp_cmds()
+            scan_log_formats()
+            write_log_tokens()
             file_marker('config.h',end=True)
             
         # write config.c    
@@ -278,4 +421,7 @@ if __name__ == '__main__':
             write_version()
             write_task_init()
             write_mmp_cmds_init()
+            write_log_token_args()
             file_marker('config.c',end=True)
+        write_log_dict()
+        write_config_py()
@@ -2,7 +2,8 @@
 # Copyright Stephen Stebbing 2023. http://telecnatron.com/
 # -----------------------------------------------------------------------------
 import logging
-from struct import pack,unpack
+from collections import namedtuple
+from struct import pack,unpack,Struct
 from telecnatron.mmp.MMP import MMP
 from telecnatron.avr.cmd.Handler import Handler
 from telecnatron.avr.cmd.Handler import ENoResponse, EStatus
@@ -23,7 +24,10 @@ class Fan(Handler):
 class Load(Handler):
     """ read setting of load switch """
     def read(self):
-        rmsg=self.command()
+        return self.decode(self.command())
+
+    def decode(self, rmsg):
+        """ return load switch setting from read reply """
         adcval=unpack('<B' ,rmsg.data)
         print(f"load switch: 0x{adcval[0]:02x}")
         return adcval[0]
@@ -47,23 +51,74 @@ class Shutdown(Handler):
 
     def read(self):
         # subcommand 2
-        rmsg=self.sub_command(self.SC_READ)
+        return self.decode(self.sub_command(self.SC_READ))
+
+    def decode(self, rmsg):
+        """ return shutdown status from read reply """
         s=unpack('<B',rmsg.data)
         s=s[0]
         logging.info(f"shutdown status: {s}")
         return(s)
     
+# -----------------------------------
+# measurements streamed by the MCU, see Measurements.subscribe(). lost is number of messages lost before this one.
+Telemetry = namedtuple('Telemetry', ('seq', 'volts', 'amps', 'watts', 'joules', 'lost'))
+
 # -----------------------------------
 class Measurements(Handler):
     """ obtain voltage, current, power, energy measurements from the MCU """
 
     # subcommands
-    SC_READ   = 0
-    SC_RESET  = 1
+    SC_READ      = 0
+    SC_RESET     = 1
+    SC_SUBSCRIBE = 2
+    SC_KEEPALIVE = 3
+
+    SC_READ_COMPACT = 4
+
+    # first byte of async telemetry messages
+    ASYNC_TELEMETRY = 6
+    ASYNC_TELEMETRY_COMPACT = 8
+
+    # compact record format byte
+    REC_VERSION = 1
+    REC_RAW     = 0x10
+    REC_DELTA   = 0x20
+    REC_ESCAPE  = -128
+    # compact record field mask bits, field names, and scale of each field's value
+    REC_VOLTS   = 0x01
+    REC_AMPS    = 0x02
+    REC_WATTS   = 0x04
+    REC_JOULES  = 0x08
+    REC_ALL     = 0x0f
+    REC_FIELDS  = ('volts', 'amps', 'watts', 'joules')
+    REC_SCALE   = (0.001, 0.0001, 0.002, 0.01)
+    # raw bus voltage register: 16V FSR, and shunt voltage register: 160mV FSR across 0.1 ohm (x2), as the MCU calculates them
+    REC_RAW_SCALE = (16.0/32768, 0.16/32768/0.1*2)
+
+    # precompiled structs for decoding
+    S_TELEMETRY = Struct('<Hffff')
+    S_SEQ       = Struct('<H')
+    S_HDR       = Struct('<BB')
+    S_I8        = Struct('<b')
+    S_I16       = Struct('<h')
+    S_U32       = Struct('<I')
+
+    def __init__(self, mmp, cmd_num):
+        Handler.__init__(self, mmp, cmd_num)
+        # sequence number of next expected telemetry message
+        self.seq = None
+        self.lost = 0
+        # field values of previous compact record, for decoding delta records: for polling and for telemetry
+        self.prev_read = None
+        self.prev_telemetry = None
     
     def read(self):
         """ Get the current measurement values fromt he MCU, returns a dict like: {'volts': 10.7900390625, 'amps': 0.11220702528953552, 'watts': 1.2107181549072266, 'joules': 306.39349365234375}"""
-        rmsg=self.sub_command(self.SC_READ)
+        return self.decode(self.sub_command(self.SC_READ))
+
+    def decode(self, rmsg):
+        """ return dict of measurements from read reply """
         fields=('volts', 'amps', 'watts', 'joules')
         m=self.rmsg_to_dict("<ffff",fields, rmsg)
         #logging.info(f"m: {m}: ")
@@ -73,4 +128,93 @@ class Measurements(Handler):
     def reset(self):
         """ reset the MCU's number of joules counter """
         rmsg=self.sub_command(self.SC_RESET)
+
+    def read_compact(self, mask=REC_ALL, raw=False, delta=False):
+        """ Read measurements as a compact record, mask selects the fields. Returns dict with the selected fields,
+        or None if a delta record could not be decoded, in which case the next full record will be. """
+        fmt = (self.REC_RAW if raw else 0) | (self.REC_DELTA if delta else 0)
+        rmsg=self.sub_command(self.SC_READ_COMPACT, pack('<BB', fmt, mask))
+        (m, self.prev_read) = self.decode_record(rmsg.data, self.prev_read)
+        return m
+
+    def subscribe(self, period_ms, keepalive_ms=5000, mask=None, raw=False, delta=False):
+        """ Have MCU send measurements every period_ms, they are put in mmp.asyncq as Telemetry tuples.
+        If mask is given, MCU sends compact records containing those fields, unselected fields are None.
+        keepalive() must be called more often than every keepalive_ms, or MCU stops sending. Returns period MCU is using."""
+        self.seq = None
+        self.prev_telemetry = None
+        if mask is None:
+            self.mmp.setAsyncDecoder(self.ASYNC_TELEMETRY, self.decode_telemetry)
+            rmsg=self.sub_command(self.SC_SUBSCRIBE, pack('<HH', period_ms, keepalive_ms))
+        else:
+            self.mmp.setAsyncDecoder(self.ASYNC_TELEMETRY_COMPACT, self.decode_telemetry_compact)
+            fmt = (self.REC_RAW if raw else 0) | (self.REC_DELTA if delta else 0)
+            rmsg=self.sub_command(self.SC_SUBSCRIBE, pack('<HHBB', period_ms, keepalive_ms, fmt, mask))
+        return self.S_SEQ.unpack(rmsg.data)[0]
+
+    def keepalive(self):
+        """ keep subscription going. Raises EStatus if MCU has already stopped it """
+        self.sub_command(self.SC_KEEPALIVE)
+
+    def unsubscribe(self):
+        self.sub_command(self.SC_SUBSCRIBE, pack('<HH', 0, 0))
+        self.mmp.setAsyncDecoder(self.ASYNC_TELEMETRY, None)
+        self.mmp.setAsyncDecoder(self.ASYNC_TELEMETRY_COMPACT, None)
+
+    def count_lost(self, seq):
+        """ return number of telemetry messages lost before the one numbered seq """
+        lost = 0
+        if self.seq is not None:
+            lost = (seq - self.seq) & 0xffff
+            self.lost += lost
+        self.seq = (seq+1) & 0xffff
+        return lost
+
+    def decode_telemetry(self, msg):
+        """ decode async telemetry message into Telemetry tuple, counting messages lost since the prior one """
+        (seq, volts, amps, watts, joules) = self.S_TELEMETRY.unpack_from(msg.data, 1)
+        return Telemetry(seq, volts, amps, watts, joules, self.count_lost(seq))
+
+    def decode_telemetry_compact(self, msg):
+        """ decode async compact telemetry message into Telemetry tuple. Delta records that follow a lost
+        message can't be decoded: they're counted as lost too, until the next full record. """
+        (seq,) = self.S_SEQ.unpack_from(msg.data, 1)
+        lost = self.count_lost(seq)
+        if lost:
+            self.prev_telemetry = None
+        (m, self.prev_telemetry) = self.decode_record(msg.data[3:], self.prev_telemetry)
+        if m is None:
+            self.lost += 1
+            raise ValueError(f"telemetry: delta record {seq} without prior full record")
+        return Telemetry(seq, m.get('volts'), m.get('amps'), m.get('watts'), m.get('joules'), lost)
+
+    def decode_record(self, data, prev):
+        """ decode compact record. prev is list of the previous record's raw field values, or None.
+        Returns (dict of selected fields, raw field values to pass as prev next time), dict is None if
+        record is a delta record and prev is None. """
+        (fmt, mask) = self.S_HDR.unpack_from(data, 0)
+        if fmt & 0x0f != self.REC_VERSION:
+            raise ValueError(f"unknown measurement record version: {fmt & 0x0f}")
+        delta = fmt & self.REC_DELTA
+        if delta and prev is None:
+            return (None, None)
+        vals = list(prev) if prev else [0, 0, 0, 0]
+        i = self.S_HDR.size
+        for f in range(4):
+            if not mask & (1 << f):
+                continue
+            full = self.S_U32 if f == 3 else self.S_I16
+            if delta:
+                (d,) = self.S_I8.unpack_from(data, i)
+                i += 1
+                if d != self.REC_ESCAPE:
+                    vals[f] += d
+                    continue
+            (vals[f],) = full.unpack_from(data, i)
+            i += full.size
+        scale = self.REC_SCALE
+        if fmt & self.REC_RAW:
+            scale = self.REC_RAW_SCALE + scale[2:]
+        m = {self.REC_FIELDS[f]: vals[f] * scale[f] for f in range(4) if mask & (1 << f)}
+        return (m, vals)
         
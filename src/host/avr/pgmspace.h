@@ -0,0 +1,16 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// Host stand in for avr-libc's pgmspace.h: the host has only one address space.
+#ifndef HOST_PGMSPACE_H
+#define HOST_PGMSPACE_H
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define memcpy_P memcpy
+
+#endif
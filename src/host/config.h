@@ -0,0 +1,19 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// Configuration used when building lib/mmp/mmp.c as the host's mmp parser, see Makefile host target.
+#ifndef HOST_CONFIG_H
+#define HOST_CONFIG_H
+
+#define MMP_DEFS
+// host calls mmp_tick() when a read times out, which abandons a partly received message
+#define MMP_TIMER_TIMEOUT 1
+#define MMP_NO_REBOOT
+// receive everything the MCU may send
+#define MMP_CRC16
+#define MMP_COBS
+#define MMP_STATS
+// MCU sends v1 frames with the negated checksum
+#define MMP_RX_CS(sum) MSG_CS(sum)
+
+#endif
@@ -0,0 +1,194 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// The host's mmp receiver: lib/mmp/mmp.c, the MCU's own parser, built as a shared library that
+// telecnatron/mmp/parser.py loads with ctypes. Separates the MCU's log strings from its messages, as
+// telecnatron.mmp.MMP expects, and returns both as records in a buffer, so that Python handles each
+// message rather than each byte.
+#include <stdlib.h>
+#include <string.h>
+#include "lib/mmp/mmp.h"
+
+//! chars that start a log string, which ends with a newline
+#define MMP_HOST_LOGS "\tLOG"
+#define MMP_HOST_LOGS_LEN 4
+//! max length of log string, longer ones are truncated
+#define MMP_HOST_LOGS_MAX 255
+
+// record types
+#define MMP_HOST_REC_MSG 0
+#define MMP_HOST_REC_LOG 1
+//! record is: uint8_t type, uint8_t flags, uint16_t length, then length bytes of message data or log string
+#define MMP_HOST_REC_HDR 4
+
+typedef struct {
+    mmp_ctrl_t mmp;
+    uint8_t buf[256];
+    //! where mmp_host_feed() puts records
+    uint8_t *out;
+    uint32_t out_len;
+    uint32_t out_size;
+    //! number of chars of MMP_HOST_LOGS that have been matched
+    uint8_t log_match;
+    //! non-zero while receiving a log string
+    uint8_t in_log;
+    uint16_t log_len;
+    //! log string, without the leading tab
+    uint8_t log[MMP_HOST_LOGS_MAX];
+    // errors since mmp_host_errors() was last called
+    uint32_t errors_rx;
+    uint32_t errors_timeout;
+    uint32_t errors_log;
+} mmp_host_t;
+
+
+//! add a record to the output, drop it if there's no room
+static void mmp_host_record(mmp_host_t *h, uint8_t type, uint8_t flags, const uint8_t *data, uint16_t len)
+{
+    if(h->out_len + MMP_HOST_REC_HDR + len > h->out_size){
+	h->errors_rx++;
+	return;
+    }
+    uint8_t *r = h->out + h->out_len;
+    r[0] = type;
+    r[1] = flags;
+    r[2] = len & 0xff;
+    r[3] = len >> 8;
+    memcpy(r + MMP_HOST_REC_HDR, data, len);
+    h->out_len += MMP_HOST_REC_HDR + len;
+}
+
+//! mmp.c's handler, a message has been received
+static void mmp_host_msg(void *user_data, mmp_msg_t *msg)
+{
+    mmp_host_record((mmp_host_t *)user_data, MMP_HOST_REC_MSG, msg->flags, msg->data, msg->len);
+}
+
+//! add parser's error counts to ours
+static void mmp_host_stats(mmp_host_t *h)
+{
+    mmp_stats_t stats;
+    mmp_stats_read(&(h->mmp), &stats, 1);
+    h->errors_rx += stats.cs_fail + stats.overrun + stats.framing;
+    h->errors_timeout += stats.timeout;
+}
+
+// -----------------------------------------------------------------------------
+//! return a new receiver, or NULL
+mmp_host_t *mmp_host_new()
+{
+    mmp_host_t *h = calloc(1, sizeof(mmp_host_t));
+    if(h){
+	mmp_init(&(h->mmp), h->buf, sizeof(h->buf)-1, mmp_host_msg, h);
+    }
+    return h;
+}
+
+void mmp_host_free(mmp_host_t *h)
+{
+    free(h);
+}
+
+/**
+ * Parse received chars.
+ *
+ * @param data The chars.
+ * @param len Number of chars.
+ * @param out Where records of the messages and log strings that are completed are put.
+ * @param out_size Size of out, len + 1024 is always enough.
+ * @return Number of bytes of records that were put in out.
+ */
+uint32_t mmp_host_feed(mmp_host_t *h, const uint8_t *data, uint32_t len, uint8_t *out, uint32_t out_size)
+{
+    const uint8_t *end = data + len;
+    h->out = out;
+    h->out_len = 0;
+    h->out_size = out_size;
+    while(data != end){
+	if(h->in_log){
+	    // copy log string up to newline
+	    const uint8_t *nl = memchr(data, '\n', end - data);
+	    const uint8_t *stop = nl ? nl : end;
+	    while(data != stop && h->log_len < MMP_HOST_LOGS_MAX){
+		h->log[h->log_len++] = *data++;
+	    }
+	    if(data == nl){
+		data++;
+	    }else if(data != end){
+		// too long
+		h->errors_log++;
+	    }else{
+		continue;
+	    }
+	    mmp_host_record(h, MMP_HOST_REC_LOG, 0, h->log, h->log_len);
+	    h->in_log = 0;
+	    continue;
+	}
+	// pass parser as many chars as it may take without going past the end of the message,
+	// so that a log string that follows it isn't skipped
+	uint32_t n = 1;
+	mmp_msg_ctrl_t *msg = &(h->mmp.ctrl);
+	switch(h->mmp.state){
+	    case MMP_STATE_SOM:
+		if(*data != MSG_SOM && *data != MSG_COBS_DELIM){
+		    // not a message, may be part of a log string
+		    if(*data == MMP_HOST_LOGS[h->log_match]){
+			if(++h->log_match == MMP_HOST_LOGS_LEN){
+			    h->in_log = 1;
+			    h->log_match = 0;
+			    memcpy(h->log, MMP_HOST_LOGS+1, MMP_HOST_LOGS_LEN-1);
+			    h->log_len = MMP_HOST_LOGS_LEN-1;
+			}
+		    }else{
+			h->log_match = *data == MMP_HOST_LOGS[0];
+		    }
+		    data++;
+		    continue;
+		}
+		h->log_match = 0;
+		break;
+	    case MMP_STATE_DATA:
+		// rest of data, ETX, and checksum or CRC
+		n = msg->msg.len - msg->count + 2 + (msg->msg.flags & MMP_FLAGS_CRC ? 1 : 0);
+		break;
+	    case MMP_STATE_COBS:
+	    {
+		// up to and including the delimiter
+		const uint8_t *d = memchr(data, MSG_COBS_DELIM, end - data);
+		n = d ? d - data + 1 : end - data;
+		break;
+	    }
+	}
+	if(n > (uint32_t)(end - data)){
+	    n = end - data;
+	}
+	if(n > 255){
+	    n = 255;
+	}
+	mmp_rx_buf(&(h->mmp), data, n);
+	data += n;
+    }
+    mmp_host_stats(h);
+    return h->out_len;
+}
+
+//! Nothing has been received for a while: abandon the message or log string that is being received.
+void mmp_host_timeout(mmp_host_t *h)
+{
+    if(h->in_log){
+	h->in_log = 0;
+	h->errors_timeout++;
+    }
+    h->log_match = 0;
+    mmp_tick(&(h->mmp));
+    mmp_host_stats(h);
+}
+
+//! Copy rx, timeout and log error counts to errors[0..2], and zero them.
+void mmp_host_errors(mmp_host_t *h, uint32_t *errors)
+{
+    errors[0] = h->errors_rx;
+    errors[1] = h->errors_timeout;
+    errors[2] = h->errors_log;
+    h->errors_rx = h->errors_timeout = h->errors_log = 0;
+}
@@ -5,9 +5,11 @@
 
 #include "lib/devices/ina219.h"
 #include "lib/mmp/mmp_cmd.h"
+#include "lib/mmp/mmp_txq.h"
 #include "lib/log.h"
 #include "lib/sysclk.h"
 #include "lib/task.h"
+#include "lib/uart/uart.h"
 
 #include "config.h"
 #include "ina219.h"
@@ -20,6 +22,22 @@ uint8_t ina219_addr = INA219_ADDR;
 // measurement data
 ina219_t ina219_data;
 
+// telemetry, measurements sent to host in async messages:
+// ticks between messages, 0 when host is not subscribed
+static uint16_t telemetry_period;
+// ticks without a keepalive after which subscription lapses
+static uint16_t telemetry_timeout;
+// ticks left until subscription lapses
+static uint16_t telemetry_left;
+// sequence number of next message, so host can detect lost messages
+static uint16_t telemetry_seq;
+// compact record format and field mask, format 0 for float messages
+static uint8_t telemetry_fmt;
+static uint8_t telemetry_mask;
+// delta encoding state for telemetry, and for the read compact subcommand
+static ina219_rec_t telemetry_rec;
+static ina219_rec_t read_rec;
+
 // -------------------------------------------------
 void ina219_init()
 {
@@ -44,6 +62,7 @@ void task_ina219()
     if(state){
 	// read bus voltage
 	reg = INA219_READ_BUS_VOLTAGE(ina219_addr);
+	ina219_data.bus_reg = reg;
 	// to calculate volts:
 	//   FSR(here=16V) * vbus_reg / 2^15
 	ina219_data.voltage= 16.0 * reg / 32768;
@@ -51,6 +70,7 @@ void task_ina219()
     }else{
 	// read shunt voltage
 	reg = INA219_READ_SHUNT_VOLTAGE(ina219_addr);
+	ina219_data.shunt_reg = reg;
 	// calculate amps
 	// here fullscale corresponds to 160mV drop across shunt.
 	// Vshunt = 0.16 * vshunt_reg / 2^15
@@ -105,10 +125,120 @@ void task_energy()
     }
 }
 
+// -------------------------------------------------
+/**
+ * Encode current measurements as a compact record, see INA219_REC_xxx in ina219.h
+ * @param buf Buffer of at least INA219_REC_MAX_LEN bytes.
+ * @param fmt INA219_REC_RAW and/or INA219_REC_DELTA flags.
+ * @param mask Fields to include, INA219_REC_VOLTS etc.
+ * @param rec Delta encoding state.
+ * @return Length of record.
+ */
+static uint8_t ina219_encode(uint8_t *buf, uint8_t fmt, uint8_t mask, ina219_rec_t *rec)
+{
+    int32_t v[4];
+    if(fmt & INA219_REC_RAW){
+	v[0] = ina219_data.bus_reg;
+	v[1] = ina219_data.shunt_reg;
+    }else{
+	v[0] = ina219_data.voltage * 1000;
+	v[1] = ina219_data.current * 10000;
+    }
+    v[2] = ina219_data.power * 500;
+    v[3] = ina219_data.joules * 100;
+    mask &= INA219_REC_ALL;
+    fmt &= INA219_REC_RAW | INA219_REC_DELTA;
+    if(fmt != rec->fmt || mask != rec->mask){
+	// prev values are of other fields or units
+	rec->fmt = fmt;
+	rec->mask = mask;
+	rec->count = 0;
+    }
+    if(fmt & INA219_REC_DELTA){
+	if(rec->count == 0){
+	    // full record, host then has values to apply deltas to
+	    fmt &=~ INA219_REC_DELTA;
+	}
+	if(++rec->count == INA219_REC_KEYFRAME){
+	    rec->count = 0;
+	}
+    }
+    buf[0] = fmt | INA219_REC_VERSION;
+    buf[1] = mask;
+    uint8_t len = 2;
+    for(uint8_t i=0; i<4; i++){
+	if(!(mask & _BV(i))){
+	    continue;
+	}
+	// joules is 4 bytes, others 2
+	uint8_t size = i==3 ? sizeof(uint32_t) : sizeof(int16_t);
+	if(buf[0] & INA219_REC_DELTA){
+	    int32_t d = v[i] - rec->prev[i];
+	    if(d > INA219_REC_ESCAPE && d <= 127){
+		buf[len++] = (int8_t)d;
+		rec->prev[i] = v[i];
+		continue;
+	    }
+	    // doesn't fit, escape then full value
+	    buf[len++] = (uint8_t)INA219_REC_ESCAPE;
+	}
+	memcpy(buf+len, &v[i], size);
+	len += size;
+	rec->prev[i] = v[i];
+    }
+    return len;
+}
+
+// -------------------------------------------------
+// task sends telemetry message every telemetry_period ticks while host is subscribed.
+// Initialised as not runnable, made ready by subscribe subcommand of cmd_measurements.
+void task_telemetry()
+{
+    if(telemetry_period == 0){
+	task_ready(0);
+	return;
+    }
+    if(telemetry_left == 0){
+	// host has stopped sending keepalives
+	telemetry_period = 0;
+	task_ready(0);
+	LOG_INFO_FP("telemetry: keepalive timeout", NULL);
+	return;
+    }
+    telemetry_left = telemetry_left > telemetry_period ? telemetry_left - telemetry_period : 0;
+    if(telemetry_fmt){
+	// message: id, seq, compact record
+	uint8_t d[3+INA219_REC_MAX_LEN];
+	d[0]=INA219_ASYNC_TELEMETRY_COMPACT;
+	memcpy(d+1, &telemetry_seq, sizeof(uint16_t));
+	mmp_txq_send(MMP_TXQ_PRIO_TELEMETRY|MMP_TXQ_COALESCE, d, 3+ina219_encode(d+3, telemetry_fmt, telemetry_mask, &telemetry_rec));
+    }else{
+	// message: id, seq, volts, amps, watts, joules
+	uint8_t d[3+sizeof(float)*4];
+	d[0]=INA219_ASYNC_TELEMETRY;
+	memcpy(d+1, &telemetry_seq, sizeof(uint16_t));
+	// voltage, current, power and joules are consecutive in ina219_t
+	memcpy(d+3, &(ina219_data.voltage), sizeof(float)*4);
+	mmp_txq_send(MMP_TXQ_PRIO_TELEMETRY|MMP_TXQ_COALESCE, d, sizeof(d));
+    }
+    telemetry_seq++;
+    task_set_tick_timer(telemetry_period);
+}
+
 // -------------------------------------------------
 /** 
  * Send MMP reply message containing voltage, current, power etc
  * The reply data is copy of ina219_t contained in the ina219_data global variable
+ * data[0] is subcommand:
+ *   0: read. reply: float volts, amps, watts, joules.
+ *   1: reset joules counter.
+ *   2: subscribe. data[1..2]: uint16_t period in ms, 0 to unsubscribe, optional data[3..4]: uint16_t keepalive timeout in ms.
+ *      Measurements are then sent every period ms in async messages: uint8_t INA219_ASYNC_TELEMETRY, uint16_t sequence number,
+ *      float volts, amps, watts, joules. Reply: uint16_t period being used.
+ *      Optional data[5]: compact record format flags, data[6]: field mask. Messages are then: uint8_t INA219_ASYNC_TELEMETRY_COMPACT,
+ *      uint16_t sequence number, compact record.
+ *   3: keepalive. Must be sent within the keepalive timeout to keep the subscription going. Status 1 if there is no subscription.
+ *   4: read compact. data[1]: format flags, data[2]: field mask. reply: compact record, see INA219_REC_xxx in ina219.h
  *
  * @param handle MMP handle to pass to call to mmp_cmd_reply()
  * @param cmd The MMP command number
@@ -143,6 +273,52 @@ void cmd_measurements(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_
 	    ina219_data.joules=0;
 	    status=0;
 	    break;
+	case 2:
+	    // subscribe
+	    if(data_len >= 1+sizeof(uint16_t)){
+		uint16_t period;
+		memcpy(&period, data+1, sizeof(uint16_t));
+		telemetry_timeout = INA219_TELEMETRY_KEEPALIVE_MS;
+		if(data_len >= 1+2*sizeof(uint16_t)){
+		    memcpy(&telemetry_timeout, data+1+sizeof(uint16_t), sizeof(uint16_t));
+		}
+		telemetry_fmt = 0;
+		if(data_len >= 3+2*sizeof(uint16_t)){
+		    // compact records, version bits are set so that fmt is non-zero
+		    telemetry_fmt = data[5] | INA219_REC_VERSION;
+		    telemetry_mask = data[6];
+		    telemetry_rec.count = 0;
+		}
+		if(period && period < INA219_MEASUREMENT_PERIOD_MS){
+		    // no point sending faster than measurements are made
+		    period = INA219_MEASUREMENT_PERIOD_MS;
+		}
+		if(period && !telemetry_period){
+		    // new subscription
+		    telemetry_seq = 0;
+		    task_num_ready(TASK_TELEMETRY, 1);
+		}
+		telemetry_period = period;
+		telemetry_left = telemetry_timeout;
+		memcpy(reply_data, &period, sizeof(uint16_t));
+		rsize=sizeof(uint16_t);
+		status=0;
+	    }
+	    break;
+	case 3:
+	    // keepalive
+	    if(telemetry_period){
+		telemetry_left = telemetry_timeout;
+		status=0;
+	    }
+	    break;
+	case 4:
+	    // read compact
+	    if(data_len >= 3 && data_max_len >= INA219_REC_MAX_LEN){
+		rsize = ina219_encode(reply_data, data[1], data[2], &read_rec);
+		status=0;
+	    }
+	    break;
     }
     mmp_cmd_reply(handle, status, rsize);
 }
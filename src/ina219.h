@@ -16,6 +16,45 @@
 // ----------------
 #endif
 #define INA219_MEASUREMENTS_PER_SECOND 1000/INA219_MEASUREMENT_PERIOD_MS
+#ifndef INA219_TELEMETRY_KEEPALIVE_MS
+// default time after which telemetry stops if host doesn't send a keepalive
+#define INA219_TELEMETRY_KEEPALIVE_MS 5000
+#endif
+// first byte of async telemetry messages
+#define INA219_ASYNC_TELEMETRY 6
+// first byte of async telemetry messages that contain a compact record
+#define INA219_ASYNC_TELEMETRY_COMPACT 8
+
+// Compact measurement record: uint8_t format, uint8_t field mask, then the fields in mask bit order.
+// format byte: version in bits 0-3, and the INA219_REC_RAW and INA219_REC_DELTA flags.
+#define INA219_REC_VERSION 1
+#define INA219_REC_VERSION_MASK 0x0f
+// volts and amps fields are the raw bus and shunt voltage registers, rather than mV and 0.1mA
+#define INA219_REC_RAW   0x10
+// fields are int8 differences from those of the previous record, a difference of INA219_REC_ESCAPE is followed by the full value.
+#define INA219_REC_DELTA 0x20
+#define INA219_REC_ESCAPE -128
+// field mask bits. volts, amps, watts are int16: mV, 0.1mA, 2mW. joules is uint32: 0.01J.
+#define INA219_REC_VOLTS  0x01
+#define INA219_REC_AMPS   0x02
+#define INA219_REC_WATTS  0x04
+#define INA219_REC_JOULES 0x08
+#define INA219_REC_ALL    0x0f
+// number of delta records after which a full record is sent, so host can recover from a lost record
+#define INA219_REC_KEYFRAME 16
+// maximum record size
+#define INA219_REC_MAX_LEN (2 + 3*3 + 5)
+
+// state for delta encoding
+typedef struct {
+    //! field values of previous record
+    int32_t prev[4];
+    //! records since the last full one
+    uint8_t count;
+    //! format flags and field mask of previous record, a full record is sent if they change
+    uint8_t fmt;
+    uint8_t mask;
+} ina219_rec_t;
 
 // structure for measurement data 
 typedef struct {
@@ -32,6 +71,9 @@ typedef struct {
     float   _power_sum;
     uint8_t _power_num;
     uint32_t _start_seconds;
+    // most recently read bus and shunt voltage registers
+    int16_t bus_reg;
+    int16_t shunt_reg;
 } ina219_t ;
 
 //global  measurement data: volts, amps etc
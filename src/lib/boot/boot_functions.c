@@ -143,6 +143,14 @@ __inline__ void mmp_rx_ch(mmp_ctrl_t *mmp_ctrl, uint8_t ch)
     ((PF_VOID)((BOOT_FTAB_START + BOOT_FADDR_MMP_RX_CH)/2))(mmp_ctrl, ch);
 }
 
+// not in the bootloader's function table, so that existing bootloaders can be used: pass chars one at a time.
+void mmp_rx_buf(mmp_ctrl_t *mmp_ctrl, const uint8_t *buf, uint8_t len)
+{
+    while(len--){
+	mmp_rx_ch(mmp_ctrl, *buf++);
+    }
+}
+
 __inline__ void mmp_send(uint8_t *msg_data, uint8_t len, uint8_t flags, void (*tx_byte_fn)(const char c))
 {
     ((PF_VOID)((BOOT_FTAB_START + BOOT_FADDR_MMP_SEND)/2))(msg_data, len, flags, tx_byte_fn);
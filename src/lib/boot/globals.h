@@ -42,7 +42,7 @@
 
 //! UART control structure
 //! 7 bytes in length, therefore .data should begin at 0x107
-#define UART (*(uart_t*)0x100)
+#define UART (*(volatile uart_t*)0x100)
 
 
 
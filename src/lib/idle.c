@@ -0,0 +1,63 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include "idle.h"
+#include "sysclk.h"
+
+typedef struct {
+    // sysclk tick count at which stats were reset
+    uint32_t start;
+    // time asleep: whole ticks and sysclk timer counts
+    uint32_t idle_ticks;
+    uint16_t idle_counts;
+} idle_ctrl_t;
+
+static idle_ctrl_t idle_ctrl;
+
+void idle_sleep()
+{
+    if(sysclk_ticked || SYSCLK_TICK_PENDING()){
+	// tick's work to do, or will have once the pending ISR has run
+	sei();
+	return;
+    }
+    uint8_t start = SYSCLK_COUNT();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    // the instruction after sei is always run before an interrupt is taken, so one that is already pending
+    // can't be missed: it wakes us straight away.
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    cli();
+    // sysclk's tick wakes us, so at most one tick has passed, in which case the timer has wrapped. Another
+    // interrupt may have woken us just before the wrap, and the tick's ISR not run yet, as in sysclk_get_time().
+    uint16_t counts = SYSCLK_COUNT() - start;
+    if(sysclk_ticked || SYSCLK_TICK_PENDING()){
+	// count may have been read before the wrap, read it again
+	counts = SYSCLK_COUNT() + SYSCLK_TOP() + 1 - start;
+    }
+    idle_ctrl.idle_counts += counts;
+    while(idle_ctrl.idle_counts > SYSCLK_TOP()){
+	idle_ctrl.idle_counts -= SYSCLK_TOP() + 1;
+	idle_ctrl.idle_ticks++;
+    }
+    sei();
+}
+
+void idle_stats_read(idle_stats_t *stats, uint8_t reset)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+	uint32_t now = sysclk_get_time(NULL);
+	stats->ticks = now - idle_ctrl.start;
+	stats->idle_ticks = idle_ctrl.idle_ticks;
+	if(reset){
+	    idle_ctrl.start = now;
+	    idle_ctrl.idle_ticks = 0;
+	    idle_ctrl.idle_counts = 0;
+	}
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef _IDLE_H
+#define _IDLE_H 1
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+/**
+ * @file   idle.h
+ * @brief  Put the MCU in idle sleep when the main loop has nothing to do, and record how much of the time it
+ * sleeps, ie the CPU's duty cycle. Idle sleep stops the CPU but not the timers, uart etc, whose interrupts wake it.
+ * Time asleep is measured with the sysclk timer, see lib/sysclk.h.
+ */
+#include <stdint.h>
+
+//! CPU duty cycle since the stats were reset: busy for (ticks - idle_ticks) of ticks.
+typedef struct {
+    //! sysclk ticks
+    uint32_t ticks;
+    //! ticks spent asleep
+    uint32_t idle_ticks;
+} idle_stats_t;
+
+/** 
+ * Sleep until the next interrupt. Call with interrupts disabled, having found that the main loop has nothing
+ * to do. Returns at once if sysclk has ticked since sysclk_has_ticked() was last called. Interrupts are enabled
+ * on return, and the handler of the interrupt that woke the MCU has been run.
+ */
+void idle_sleep();
+
+/** 
+ * Read the duty cycle stats.
+ * 
+ * @param stats Where the stats are put.
+ * @param reset If non-zero, the stats are reset after being read.
+ */
+void idle_stats_read(idle_stats_t *stats, uint8_t reset);
+
+#endif /* _IDLE_H */
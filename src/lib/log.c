@@ -101,3 +101,64 @@ void log_log_fmt_P(uint8_t level, const char* format_p, ...)
 	printf("\n");
     }
 }
+
+#ifdef LOG_TOKENIZED
+//! pointer to the function that sends tokenized log messages
+void (*log_token_send_cb)(uint8_t *msg, uint8_t len) = NULL;
+
+void log_log_token(uint8_t level, uint16_t token, ...)
+{
+    if(level < log_level || log_token_send_cb == NULL){
+	return;
+    }
+    uint8_t msg[LOG_TOKEN_MSG_MAX];
+    uint8_t len=0;
+    msg[len++]=LOG_TOKEN_ASYNC_ID;
+    msg[len++]=level;
+    msg[len++]=token & 0xff;
+    msg[len++]=token >> 8;
+    va_list args;
+    va_start(args, token);
+    // append each argument's bytes, stopping at the first that doesn't fit so that host can tell where they stop
+    for(uint32_t types=pgm_read_dword(&log_token_args[token]); types; types >>= 4){
+	uint8_t type = types & 0xf;
+	if(type == LOG_ARG_STR){
+	    const char *s = va_arg(args, const char *);
+	    if(len == LOG_TOKEN_MSG_MAX){
+		break;
+	    }
+	    // copy including the terminating 0, truncating to fit
+	    while(len < LOG_TOKEN_MSG_MAX-1 && *s){
+		msg[len++] = *s++;
+	    }
+	    msg[len++] = 0;
+	    if(*s){
+		break;
+	    }
+	}else if(type == LOG_ARG_INT){
+	    int v = va_arg(args, int);
+	    if(len+2 > LOG_TOKEN_MSG_MAX){
+		break;
+	    }
+	    memcpy(msg+len, &v, 2);
+	    len+=2;
+	}else{
+	    uint32_t v;
+	    if(type == LOG_ARG_LONG){
+		v = va_arg(args, long);
+	    }else{
+		// doubles are floats on avr
+		float f = va_arg(args, double);
+		memcpy(&v, &f, 4);
+	    }
+	    if(len+4 > LOG_TOKEN_MSG_MAX){
+		break;
+	    }
+	    memcpy(msg+len, &v, 4);
+	    len+=4;
+	}
+    }
+    va_end(args);
+    log_token_send_cb(msg, len);
+}
+#endif
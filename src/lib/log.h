@@ -25,6 +25,7 @@
  * in <stdio.h>
  * 
  */
+#include "config.h"
 #include <stdint.h>
 #include <avr/pgmspace.h>
 
@@ -68,11 +69,54 @@ void log_set_level(uint8_t level);
  * @param format_p  The format string which is put into PROGMEM
  */
 void log_log_fmt_P(uint8_t level, const char* format_p, ...);
+
+#if defined(LOG_TOKENS) && defined(LOG_TOKEN)
+// Tokenized logging: configure.py gives each format string that is passed to the LOG_xxx_FP() macros
+// a token id, LOG_TOKEN(fmt) evaluates to it at compile time so the string itself isn't put into flash.
+// The id and the raw argument bytes are sent as an async mmp message:
+//   [LOG_TOKEN_ASYNC_ID, level, token id (uint16_t), args...]
+// and the host turns them back into text using the log_tokens.json dictionary.
+// Format strings that configure.py couldn't tokenize are logged as text.
+#define LOG_TOKENIZED
+//! first data byte of tokenized log messages
+#define LOG_TOKEN_ASYNC_ID 9
+//! LOG_TOKEN(fmt) value for format strings that don't have a token id
+#define LOG_TOKEN_NONE 0xffff
+#ifndef LOG_TOKEN_MSG_MAX
+//! max length of a tokenized log message, arguments that don't fit are dropped, strings are truncated
+#define LOG_TOKEN_MSG_MAX 32
+#endif
+// argument types, each argument's type is a nibble of log_token_args[id], first argument in lowest nibble
+#define LOG_ARG_INT    1
+#define LOG_ARG_LONG   2
+#define LOG_ARG_DOUBLE 3
+#define LOG_ARG_STR    4
+//! argument types of each token, in PROGMEM. Defined in config.c
+extern const uint32_t log_token_args[];
+
+//! Pointer to the function that sends tokenized log messages, eg via mmp_async_send(). Messages are dropped until it is set.
+extern void (*log_token_send_cb)(uint8_t *msg, uint8_t len);
+//! Macro to set the tokenized log message send function
+#define LOG_INIT_TOKEN_CB(cbf) log_token_send_cb=cbf
+
+/** 
+ * Log the message whose format string has the passed token id.
+ * @param level The log level being one of the LOG_LEVEL_xxx defines
+ * @param token The format string's token id
+ */
+void log_log_token(uint8_t level, uint16_t token, ...);
+#define LOG_TOKEN_FP(level, fmt, msg...) (LOG_TOKEN(fmt) != LOG_TOKEN_NONE ? log_log_token(level, LOG_TOKEN(fmt), msg) : log_log_fmt_P(level, PSTR(fmt), msg))
+#define LOG_DEBUG_FP(fmt,msg...) LOG_TOKEN_FP(LOG_LEVEL_DEBUG, fmt, msg)
+#define LOG_INFO_FP(fmt,msg...)  LOG_TOKEN_FP(LOG_LEVEL_INFO,  fmt, msg)
+#define LOG_WARN_FP(fmt,msg...)  LOG_TOKEN_FP(LOG_LEVEL_WARN,  fmt, msg)
+#define LOG_ERROR_FP(fmt,msg...) LOG_TOKEN_FP(LOG_LEVEL_ERROR, fmt, msg)
+#else
 #define LOG_DEBUG_FP(fmt,msg...) log_log_fmt_P(LOG_LEVEL_DEBUG, PSTR(fmt),msg)
 #define LOG_INFO_FP(fmt,msg...)  log_log_fmt_P(LOG_LEVEL_INFO,  PSTR(fmt),msg)
 #define LOG_WARN_FP(fmt,msg...)  log_log_fmt_P(LOG_LEVEL_WARN,  PSTR(fmt),msg)
 #define LOG_ERROR_FP(fmt,msg...) log_log_fmt_P(LOG_LEVEL_ERROR, PSTR(fmt),msg)
-#define LOG_FP(fmt,msg...)       LOG_INFO_FP(PSTR(fmt),msg);
+#endif
+#define LOG_FP(fmt,msg...)       LOG_INFO_FP(fmt,msg)
 
 
 /** 
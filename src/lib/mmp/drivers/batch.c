@@ -0,0 +1,58 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// mmp command that runs several commands, received in one message, and returns all their replies in one message.
+#include "config.h"
+#include "../mmp_cmd.h"
+
+#ifndef MMP_BATCH_REPLY_MIN
+//! A sub-command is only run if there's at least this much space left for its reply data, so that handlers
+//! with fixed length replies needn't check data_max_len. The longest such reply is uart_stats', 22 bytes.
+#define MMP_BATCH_REPLY_MIN 22
+#endif
+
+// -------------------------------------------------------------------
+/**
+ * Run a batch of commands. data is a sequence of sub-commands, each: uint8_t cmd, uint8_t len, len bytes of data.
+ * Each is passed to its handler from the command table just as if it had been received by itself.
+ * Reply is the sequence of sub-replies, each: uint8_t cmd, uint8_t status, uint8_t len, len bytes of reply data.
+ * Sub-status is MMP_CMD_STATUS_NO_REPLY if there is no such command, or its handler didn't reply before returning.
+ * Status is 0 if all sub-commands were run, 1 if data was malformed, 2 if replies didn't all fit, ie there was
+ * less than MMP_BATCH_REPLY_MIN bytes left for the next one, in which case the replies of those that were run are returned.
+ */
+void cmd_batch(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_len, uint8_t *data, uint8_t *reply_data)
+{
+    mmp_cmd_ctrl_t *ctrl = (mmp_cmd_ctrl_t *)handle;
+    uint8_t *reply_buf = ctrl->reply_buf;
+    uint8_t status=0;
+    uint8_t i=0, rlen=0;
+    while(i < data_len){
+	uint8_t scmd = data[i];
+	if(i+2 > data_len || data[i+1] > data_len-i-2){
+	    status=1;
+	    break;
+	}
+	uint8_t slen = data[i+1];
+	uint8_t *sdata = data+i+2;
+	i += slen+2;
+	if(rlen+3+MMP_BATCH_REPLY_MIN > data_max_len){
+	    status=2;
+	    break;
+	}
+	// sub-reply header, handler's reply data follows it
+	uint8_t *sreply = reply_data+rlen;
+	sreply[0]=scmd;
+	sreply[1]=MMP_CMD_STATUS_NO_REPLY;
+	sreply[2]=0;
+	if(scmd < ctrl->num_handlers && scmd != cmd){
+	    // mmp_cmd_reply() fills in status and len
+	    ctrl->reply_buf = sreply;
+	    ctrl->batch = 1;
+	    ctrl->cmd_handler_tab[scmd](handle, scmd, slen, data_max_len-rlen-3, sdata, sreply+3);
+	    ctrl->batch = 0;
+	    ctrl->reply_buf = reply_buf;
+	}
+	rlen += sreply[2]+3;
+    }
+    mmp_cmd_reply(handle, status, rlen);
+}
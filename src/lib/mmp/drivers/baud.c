@@ -0,0 +1,182 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// Baud rate negotiation: host proposes a new baud rate, we acknowledge at the old rate,
+// switch, and then revert to the old rate if host does not confirm within the timeout.
+#include "config.h"
+#include <string.h>
+#include "../../task.h"
+#include "../../log.h"
+#include "../../uart/uart.h"
+#include "../mmp_cmd.h"
+
+// subcommands
+#define BAUD_SC_READ    0
+#define BAUD_SC_PROPOSE 1
+#define BAUD_SC_CONFIRM 2
+
+// states
+#define BAUD_STATE_IDLE    0
+// waiting for the acknowledgement to be sent, then switch
+#define BAUD_STATE_SWITCH  1
+// switched, waiting for confirmation
+#define BAUD_STATE_CONFIRM 2
+
+// max allowed baud rate error in parts per thousand
+#define BAUD_MAX_ERROR_PPT 25
+// default confirmation timeout in ticks
+#define BAUD_DEFAULT_TIMEOUT 1000
+
+static uint8_t baud_state = BAUD_STATE_IDLE;
+// UBRR value and U2X setting that will be switched to
+static uint16_t baud_ubrr;
+// UBRR and U2X to revert to if not confirmed
+static uint16_t baud_old_ubrr;
+static uint8_t  baud_old_u2x;
+// ticks to wait for confirmation
+static uint16_t baud_timeout;
+
+// -------------------------------------------------------------------
+// set UBRR registers and U2X bit
+static void baud_set_ubrr(uint16_t ubrr, uint8_t u2x)
+{
+    UART_REG_UBRRH = ubrr >> 8;
+    UART_REG_UBRRL = ubrr & 0xff;
+    // FE, DOR, UPE must be written as zero, writing zero to TXC has no effect.
+    UART_REG_UCSRA = u2x ? _BV(UART_BIT_U2X) : 0;
+}
+
+// -------------------------------------------------------------------
+// return currently set baud rate, as calculated from UBRR and U2X
+static uint32_t baud_get()
+{
+    uint16_t ubrr = (UART_REG_UBRRH << 8) | UART_REG_UBRRL;
+    uint8_t div = (UART_REG_UCSRA & _BV(UART_BIT_U2X)) ? 8 : 16;
+    return F_CPU / div / (ubrr+1);
+}
+
+// -------------------------------------------------------------------
+// calculate UBRR value for U2X mode, eg with 16MHz: 115200: 16 (2.1%), 250k: 7, 500k: 3, 1M: 1
+// Return 0 if baud rate can not be generated to within BAUD_MAX_ERROR_PPT, non-zero otherwise.
+static uint8_t baud_calc_ubrr(uint32_t baud, uint16_t *ubrr)
+{
+    if(baud == 0 || baud > F_CPU/8){
+	return 0;
+    }
+    // divisor, rounded to nearest
+    uint32_t div = (F_CPU/8 + baud/2) / baud;
+    if(div > 4096){
+	return 0;
+    }
+    uint32_t actual = F_CPU/8 / div;
+    uint32_t err = actual > baud ? actual - baud : baud - actual;
+    if( err * 1000 / baud > BAUD_MAX_ERROR_PPT){
+	return 0;
+    }
+    *ubrr = div-1;
+    return 1;
+}
+
+// -------------------------------------------------------------------
+// return non-zero when all queued chars have been transmitted
+static uint8_t baud_tx_done()
+{
+#ifdef UART_TX_BUFFERED
+    if(uart_tx.txbuf_head != uart_tx.txbuf_tail){
+	return 0;
+    }
+#endif
+    return UART_TX_READY() && UART_TX_COMPLETE();
+}
+
+// -------------------------------------------------------------------
+// task switches baud rate once acknowledgement has been sent, and then reverts it if the timeout expires.
+// Initialised as not runnable, made ready by cmd_baud.
+void task_baud()
+{
+    switch(baud_state){
+	case BAUD_STATE_SWITCH:
+	    if(!baud_tx_done()){
+		// check again next tick
+		task_set_tick_timer(1);
+		return;
+	    }
+	    // save current setting so it can be reverted
+	    baud_old_ubrr = (UART_REG_UBRRH << 8) | UART_REG_UBRRL;
+	    baud_old_u2x  = UART_REG_UCSRA & _BV(UART_BIT_U2X);
+	    baud_set_ubrr(baud_ubrr, 1);
+	    baud_state = BAUD_STATE_CONFIRM;
+	    // host has this long to confirm
+	    task_set_tick_timer(baud_timeout);
+	    break;
+	case BAUD_STATE_CONFIRM:
+	    // timed out waiting for confirmation: revert
+	    baud_set_ubrr(baud_old_ubrr, baud_old_u2x);
+	    baud_state = BAUD_STATE_IDLE;
+	    LOG_WARN_FP("baud: not confirmed, reverted to %lu", baud_get());
+	    task_ready(0);
+	    break;
+	default:
+	    task_ready(0);
+    }
+}
+
+// -------------------------------------------------------------------
+/**
+ * Baud rate negotiation. data[0] is subcommand:
+ *   0: read. reply: uint32_t current baud rate.
+ *   1: propose. data[1..4]: uint32_t baud rate, optional data[5..6]: uint16_t confirmation timeout in ticks.
+ *      reply: status 0 and uint32_t new baud rate, sent at current rate, if rate can be used, status 1 otherwise.
+ *      After reply has been sent we switch to new rate.
+ *   2: confirm. Sent by host at new rate. Reply: uint32_t current baud rate.
+ * Requests with no subcommand, or a propose without a whole rate and timeout, get status 1 and no reply data.
+ */
+void cmd_baud(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_len, uint8_t *data, uint8_t *reply_data)
+{
+    uint8_t status=1;
+    if(data_len < 1 || (data[0] == BAUD_SC_PROPOSE && data_len != 1+sizeof(uint32_t)
+			&& data_len != 1+sizeof(uint32_t)+sizeof(uint16_t))){
+	// no subcommand, or propose has part of a field
+	mmp_cmd_reply(handle, status, 0);
+	return;
+    }
+    uint8_t subcmd=data[0];
+    uint32_t baud;
+    switch(subcmd){
+	case BAUD_SC_PROPOSE:
+	    if(baud_state != BAUD_STATE_CONFIRM){
+		memcpy(&baud, data+1, sizeof(uint32_t));
+		baud_timeout = BAUD_DEFAULT_TIMEOUT;
+		if(data_len == 1+sizeof(uint32_t)+sizeof(uint16_t)){
+		    memcpy(&baud_timeout, data+1+sizeof(uint32_t), sizeof(uint16_t));
+		}
+		if(baud_calc_ubrr(baud, &baud_ubrr)){
+		    status=0;
+		    baud_state = BAUD_STATE_SWITCH;
+		    task_num_ready(TASK_BAUD, 1);
+		    // so that baud_tx_done() can tell when reply has been sent
+		    UART_TXC_CLEAR();
+		}
+	    }
+	    break;
+	case BAUD_SC_CONFIRM:
+	    if(baud_state == BAUD_STATE_CONFIRM){
+		// cancel timeout
+		baud_state = BAUD_STATE_IDLE;
+		task_num_ready(TASK_BAUD, 0);
+		LOG_INFO_FP("baud: confirmed %lu", baud_get());
+	    }
+	    status=0;
+	    break;
+	case BAUD_SC_READ:
+	    status=0;
+	    break;
+    }
+    baud = baud_get();
+    if(status == 0 && subcmd == BAUD_SC_PROPOSE){
+	// the rate being switched to
+	baud = F_CPU/8/(baud_ubrr+1);
+    }
+    memcpy(reply_data, &baud, sizeof(uint32_t));
+    mmp_cmd_reply(handle, status, sizeof(uint32_t));
+}
@@ -0,0 +1,124 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// mmp command with which host acknowledges bulk transfer fragments, and the task that sends them,
+// see lib/mmp/mmp_bulk.h. Also reads memory, as an example of a command that starts a bulk transfer.
+#include "config.h"
+#include <string.h>
+#include <avr/pgmspace.h>
+#include "../../task.h"
+#include "../../uart/uart.h"
+#include "../mmp_cmd.h"
+#include "../mmp_bulk.h"
+
+// subcommands
+#define BULK_SC_ACK    0
+#define BULK_SC_RESEND 1
+#define BULK_SC_ABORT  2
+#define BULK_SC_MEM    3
+
+// memory spaces that can be read
+#define BULK_MEM_RAM   0
+#define BULK_MEM_FLASH 1
+
+// max number of chars sent for a fragment: its async id, xfer id and sequence number, data, and framing
+#define BULK_FRAG_TX_LEN (4 + MMP_BULK_FRAG_SIZE + MMP_FRAME_OVERHEAD)
+
+#if defined(UART_TX_BUFFERED) && UART_TXBUF_SIZE < BULK_FRAG_TX_LEN
+// task_bulk() waits for there to be room for a whole fragment, which there never would be
+#error "UART_TXBUF_SIZE is too small for MMP_BULK_FRAG_SIZE"
+#endif
+
+// memory being read
+static uint8_t  bulk_mem_space;
+static uint16_t bulk_mem_addr;
+
+// -------------------------------------------------------------------
+// produce the data of a memory read
+static uint8_t bulk_mem_read(uint32_t offset, uint8_t *buf, uint8_t len)
+{
+    uint16_t addr = bulk_mem_addr + offset;
+    if(bulk_mem_space == BULK_MEM_FLASH){
+	memcpy_P(buf, (const void *)(uintptr_t)addr, len);
+    }else{
+	memcpy(buf, (const void *)(uintptr_t)addr, len);
+    }
+    return len;
+}
+
+// -------------------------------------------------------------------
+// task sends the fragments of the transfer in progress.
+// Initialised as not runnable, made ready when a transfer is started or acknowledged.
+void task_bulk()
+{
+#ifdef UART_TX_BUFFERED
+    if(uart_tx_free() < BULK_FRAG_TX_LEN){
+	// wait for room rather than block in uart_putc()
+	task_set_tick_timer(1);
+	return;
+    }
+#endif
+    switch(mmp_bulk_run()){
+	case MMP_BULK_SENT:
+	    // stay ready, send the next as soon as there's room
+	    break;
+	case MMP_BULK_WAIT:
+	    task_set_tick_timer(1);
+	    break;
+	default:
+	    task_ready(0);
+    }
+}
+
+// -------------------------------------------------------------------
+/**
+ * Bulk transfers. data[0] is subcommand:
+ *   0: acknowledge. data[1]: uint8_t xfer id, data[2..3]: uint16_t sequence number of first fragment not received.
+ *   1: resend. As acknowledge, and have fragments resent from the sequence number.
+ *   2: abort. data[1]: uint8_t xfer id.
+ *   Reply to these is status 0 if xfer is in progress, 1 otherwise, no data.
+ *   3: read memory. data[1]: uint8_t space, 0 RAM, 1 flash, data[2..3]: uint16_t address, data[4..5]: uint16_t length.
+ *      Reply is that of mmp_bulk_start(), then the memory is sent as a bulk transfer. Status is 1 if the memory isn't all
+ *      within RAMSTART..RAMEND, or flash. RAM below RAMSTART is the I/O registers, some of which change when read, eg UDR.
+ */
+void cmd_bulk(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_len, uint8_t *data, uint8_t *reply_data)
+{
+    uint8_t status=1;
+    uint16_t seq;
+    switch(data_len ? data[0] : 0xff){
+	case BULK_SC_ACK:
+	case BULK_SC_RESEND:
+	    if(data_len >= 2+sizeof(uint16_t)){
+		memcpy(&seq, data+2, sizeof(uint16_t));
+		status = mmp_bulk_ack(data[1], seq, data[0] == BULK_SC_RESEND);
+		// window may have opened
+		task_num_ready(TASK_BULK, 1);
+	    }
+	    break;
+	case BULK_SC_ABORT:
+	    if(data_len >= 2){
+		status = mmp_bulk_abort(data[1]);
+	    }
+	    break;
+	case BULK_SC_MEM:
+	    if(data_len >= 2+2*sizeof(uint16_t) && data_max_len >= 7){
+		// a refused request mustn't change the memory of a transfer in progress
+		uint8_t space = data[1];
+		uint16_t addr, len;
+		memcpy(&addr, data+2, sizeof(uint16_t));
+		memcpy(&len, data+4, sizeof(uint16_t));
+		uint32_t end = (uint32_t)addr + len;
+		if(space == BULK_MEM_FLASH ? end > (uint32_t)FLASHEND+1 :
+		   space != BULK_MEM_RAM || addr < RAMSTART || end > (uint32_t)RAMEND+1){
+		    break;
+		}
+		bulk_mem_space = space;
+		bulk_mem_addr = addr;
+		mmp_bulk_start(handle, reply_data, bulk_mem_read, len);
+		task_num_ready(TASK_BULK, 1);
+		return;
+	    }
+	    break;
+    }
+    mmp_cmd_reply(handle, status, 0);
+}
@@ -0,0 +1,142 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// mmp command with which host measures link throughput, round trip time and error rate, see
+// telecnatron/avr/cmd/link_test.py. Payloads are pseudo-random, generated from the sequence number of the
+// message that carries them, so that either end can check them without having to keep a copy.
+#include "config.h"
+#include <string.h>
+#include "../mmp_cmd.h"
+
+// subcommands
+#define LINK_TEST_SC_ECHO  0
+#define LINK_TEST_SC_GEN   1
+#define LINK_TEST_SC_STATS 2
+
+//! payload checks
+static struct {
+    //! echo payloads received
+    uint16_t frames;
+    //! echo sequence numbers that were skipped
+    uint16_t seq_gaps;
+    //! payload bits that differed from those expected
+    uint32_t bit_errors;
+    //! payload bytes received
+    uint32_t bytes;
+    //! sequence number expected next
+    uint16_t seq;
+} link_test;
+
+// -------------------------------------------------------------------
+//! Start of the payload of message seq: return the generator state.
+static uint16_t link_test_seed(uint16_t seq)
+{
+    uint16_t x = seq ^ 0xace1;
+    return x ? x : 1;
+}
+
+//! Next payload byte: xorshift16
+static uint8_t link_test_next(uint16_t *x)
+{
+    uint16_t s = *x;
+    s ^= s << 7;
+    s ^= s >> 9;
+    s ^= s << 8;
+    *x = s;
+    return (uint8_t)s;
+}
+
+// -------------------------------------------------------------------
+/**
+ * Link quality test. data[0] is subcommand, data[1..2] is uint16_t sequence number for 0 and 1:
+ *   0: echo. data[3..] is the payload for the sequence number. It is checked, and then the sequence number
+ *      and the payload as it should have been are sent back, so that host's check of the reply only counts
+ *      errors on the way back. Payload is reduced to what fits in a reply.
+ *   1: generate. data[3] is uint8_t length. Reply is the sequence number and length bytes of its payload,
+ *      length is reduced to what fits in a reply.
+ *   2: statistics. data[1] optional, non-zero to zero counters after reading them. Reply, all little endian:
+ *      uint16_t echo payloads, uint16_t sequence gaps, uint32_t payload bit errors, uint32_t payload bytes,
+ *      then this endpoint's mmp receive errors: uint16_t checksum failures, timeouts, overruns, framing errors,
+ *      which read as zero when MMP_STATS isn't defined.
+ * Status is 1, with no data, if the request is malformed or there isn't room for the sequence number, or the statistics.
+ */
+void cmd_link_test(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_len, uint8_t *data, uint8_t *reply_data)
+{
+    uint16_t seq;
+    uint16_t x;
+    switch(data_len ? data[0] : 0xff){
+	case LINK_TEST_SC_ECHO:
+	{
+	    if(data_len < 3 || data_max_len < 2){
+		break;
+	    }
+	    memcpy(&seq, data+1, sizeof(uint16_t));
+	    if(link_test.frames && seq != link_test.seq){
+		link_test.seq_gaps++;
+	    }
+	    link_test.seq = seq+1;
+	    link_test.frames++;
+	    uint8_t len = data_len-3;
+	    link_test.bytes += len;
+	    if(len > data_max_len-2){
+		len = data_max_len-2;
+	    }
+	    memcpy(reply_data, &seq, sizeof(uint16_t));
+	    x = link_test_seed(seq);
+	    for(uint8_t i=0; i < data_len-3; i++){
+		uint8_t b = link_test_next(&x);
+		uint8_t diff = data[3+i] ^ b;
+		for(; diff; diff &= diff-1){
+		    link_test.bit_errors++;
+		}
+		if(i < len){
+		    reply_data[2+i] = b;
+		}
+	    }
+	    mmp_cmd_reply(handle, 0, 2+len);
+	    return;
+	}
+	case LINK_TEST_SC_GEN:
+	{
+	    if(data_len < 4 || data_max_len < 2){
+		break;
+	    }
+	    memcpy(&seq, data+1, sizeof(uint16_t));
+	    uint8_t len = data[3];
+	    if(len > data_max_len-2){
+		len = data_max_len-2;
+	    }
+	    memcpy(reply_data, &seq, sizeof(uint16_t));
+	    x = link_test_seed(seq);
+	    for(uint8_t i=0; i < len; i++){
+		reply_data[2+i] = link_test_next(&x);
+	    }
+	    mmp_cmd_reply(handle, 0, 2+len);
+	    return;
+	}
+	case LINK_TEST_SC_STATS:
+	{
+	    if(data_max_len < 12+sizeof(mmp_stats_t)){
+		break;
+	    }
+	    uint8_t reset = data_len > 1 && data[1];
+	    mmp_stats_t stats;
+#ifdef MMP_RX_STATS
+	    mmp_stats_read(&(((mmp_cmd_ctrl_t *)handle)->mmp_ctrl), &stats, reset);
+#else
+	    memset(&stats, 0, sizeof(stats));
+#endif
+	    memcpy(reply_data, &link_test.frames, sizeof(uint16_t));
+	    memcpy(reply_data+2, &link_test.seq_gaps, sizeof(uint16_t));
+	    memcpy(reply_data+4, &link_test.bit_errors, sizeof(uint32_t));
+	    memcpy(reply_data+8, &link_test.bytes, sizeof(uint32_t));
+	    memcpy(reply_data+12, &stats, sizeof(mmp_stats_t));
+	    if(reset){
+		memset(&link_test, 0, sizeof(link_test));
+	    }
+	    mmp_cmd_reply(handle, 0, 12+sizeof(mmp_stats_t));
+	    return;
+	}
+    }
+    mmp_cmd_reply(handle, 1, 0);
+}
@@ -34,3 +34,39 @@ void cmd_version(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_l
 }
 
 
+
+
+// Return them our protocol version, MMP_CAP_XXX capability bits, max length of reply data, the number
+// of commands that can be queued, and max length of command data, allowing for a tag. Host may then use the
+// capabilities, eg send v2 frames, and not send commands that are too long.
+void cmd_caps(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_len, uint8_t *data, uint8_t *reply_data)
+{
+#ifdef MMP_V2
+    reply_data[0]=2;
+#else
+    reply_data[0]=1;
+#endif
+    reply_data[1]=MMP_CAPS | MMP_CMD_CAPS;
+    reply_data[2]=data_max_len;
+    reply_data[3]=1;
+#ifdef MMP_CMD_QUEUED
+    if(((mmp_cmd_ctrl_t *)handle)->queue){
+	reply_data[3]=((mmp_cmd_ctrl_t *)handle)->queue_len;
+    }
+#endif
+    reply_data[4]=mmp_cmd_max_len((mmp_cmd_ctrl_t *)handle)-2;
+    mmp_cmd_reply(handle, 0, 5);
+}
+
+
+// Read, or with data[0..1] set, the uint16_t mask of async message types that are sent to the endpoint
+// this is received on, see MMP_CMD_ASYNC_BIT(). Reply is the mask.
+void cmd_subscribe(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_len, uint8_t *data, uint8_t *reply_data)
+{
+    mmp_cmd_ctrl_t *ctrl = (mmp_cmd_ctrl_t *)handle;
+    if(data_len >= sizeof(uint16_t)){
+	memcpy(&ctrl->async_mask, data, sizeof(uint16_t));
+    }
+    memcpy(reply_data, &ctrl->async_mask, sizeof(uint16_t));
+    mmp_cmd_reply(handle, 0, sizeof(uint16_t));
+}
@@ -0,0 +1,73 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// mmp command that reports the run time of each task, how late tasks are run, and the CPU's duty cycle.
+#include "config.h"
+#include <string.h>
+#include "../../task.h"
+#include "../../sysclk.h"
+#include "../../idle.h"
+#include "../mmp_cmd.h"
+
+//! task number that reads the summary rather than a task's statistics
+#define TASK_STATS_SUMMARY 0xff
+
+// -------------------------------------------------------------------
+/**
+ * Read task statistics. data[0] is the task number, or 0xff for the summary. data[1] is optional, if non-zero
+ * the statistics are reset after being read: those of the task, or of all tasks and the duty cycle for the summary.
+ * Times are in sysclk timer counts, see lib/sysclk.h. Reply, all little endian, for a task:
+ *   uint32_t runs, uint32_t total run time, uint16_t min run time, uint16_t max run time, uint16_t max lateness
+ * for the summary:
+ *   uint8_t number of tasks, uint16_t timer counts per tick, uint16_t ticks per second,
+ *   uint32_t ticks and uint32_t of those asleep since duty cycle was reset, zeros if IDLE_SLEEP isn't defined.
+ * Replies with status 1 if the task number is out of range or the reply doesn't fit, 2 if TASK_STATS isn't defined.
+ */
+void cmd_task_stats(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_len, uint8_t *data, uint8_t *reply_data)
+{
+#ifdef TASK_STATS
+    uint8_t task_num = data_len ? data[0] : TASK_STATS_SUMMARY;
+    uint8_t reset = data_len > 1 && data[1];
+    if(task_num == TASK_STATS_SUMMARY){
+	if(data_max_len < 13){
+	    mmp_cmd_reply(handle, 1, 0);
+	    return;
+	}
+	reply_data[0] = TASK_NUM_TASKS;
+	uint16_t u = SYSCLK_TOP() + 1;
+	memcpy(reply_data+1, &u, sizeof(uint16_t));
+	u = sysclk_get_tick_freq();
+	memcpy(reply_data+3, &u, sizeof(uint16_t));
+#ifdef IDLE_SLEEP
+	idle_stats_t idle;
+	idle_stats_read(&idle, reset);
+	memcpy(reply_data+5, &idle.ticks, sizeof(uint32_t));
+	memcpy(reply_data+9, &idle.idle_ticks, sizeof(uint32_t));
+#else
+	memset(reply_data+5, 0, 2*sizeof(uint32_t));
+#endif
+	if(reset){
+	    task_stats_t stats;
+	    for(uint8_t i=0; i < TASK_NUM_TASKS; i++){
+		task_stats_read(i, &stats, 1);
+	    }
+	}
+	mmp_cmd_reply(handle, 0, 13);
+	return;
+    }
+    if(task_num >= TASK_NUM_TASKS || data_max_len < 14){
+	mmp_cmd_reply(handle, 1, 0);
+	return;
+    }
+    task_stats_t stats;
+    task_stats_read(task_num, &stats, reset);
+    memcpy(reply_data, &stats.runs, sizeof(uint32_t));
+    memcpy(reply_data+4, &stats.total, sizeof(uint32_t));
+    memcpy(reply_data+8, &stats.min, sizeof(uint16_t));
+    memcpy(reply_data+10, &stats.max, sizeof(uint16_t));
+    memcpy(reply_data+12, &stats.late_max, sizeof(uint16_t));
+    mmp_cmd_reply(handle, 0, 14);
+#else
+    mmp_cmd_reply(handle, 2, 0);
+#endif
+}
@@ -0,0 +1,60 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+// mmp command that reports uart rx error counts and buffer usage.
+#include "config.h"
+#include <string.h>
+#include "../../uart/uart.h"
+#include "../mmp_cmd.h"
+#include "../mmp_txq.h"
+
+// subcommands
+#define UART_STATS_SC_READ  0
+#define UART_STATS_SC_RESET 1
+
+// -------------------------------------------------------------------
+/**
+ * Read uart statistics. data[0] is optional subcommand: 0 read, 1 read then reset counters.
+ * reply, all little endian:
+ *   uint16_t frame errors, uint16_t overruns, uint16_t rx buffer full drops, uint16_t flow control stops,
+ *   uint8_t rx high water mark, uint8_t rx buffer size, uint16_t tx buffer full drops,
+ *   then async message queue: uint16_t drops of high, telemetry and log priority messages, uint16_t coalesced telemetry,
+ *   uint8_t blocks high water mark, uint8_t number of blocks.
+ * Counters that are not compiled in read as zero. Status is 1, with no data, if the 22 byte reply doesn't fit.
+ */
+void cmd_uart_stats(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_len, uint8_t *data, uint8_t *reply_data)
+{
+    if(data_max_len < 22){
+	mmp_cmd_reply(handle, 1, 0);
+	return;
+    }
+    uint8_t reset = data_len && data[0] == UART_STATS_SC_RESET;
+    uart_stats_t stats;
+    uint16_t tx_dropped=0;
+#ifdef UART_RX_STATS
+    uart_stats_read(&stats, reset);
+#else
+    memset(&stats, 0, sizeof(stats));
+    (void)reset;
+#endif
+#ifdef UART_TX_BUFFERED
+    tx_dropped = uart_tx.dropped;
+    if(reset){
+	uart_tx.dropped = 0;
+    }
+#endif
+    memcpy(reply_data, &stats.frame_err, sizeof(uint16_t));
+    memcpy(reply_data+2, &stats.overrun, sizeof(uint16_t));
+    memcpy(reply_data+4, &stats.rx_full, sizeof(uint16_t));
+    memcpy(reply_data+6, &stats.flow_stops, sizeof(uint16_t));
+    reply_data[8] = stats.rx_high_water;
+    reply_data[9] = UART_RX_SIZE();
+    memcpy(reply_data+10, &tx_dropped, sizeof(uint16_t));
+    mmp_txq_stats_t txq;
+    mmp_txq_read_stats(&txq, reset);
+    memcpy(reply_data+12, txq.dropped, sizeof(txq.dropped));
+    memcpy(reply_data+18, &txq.coalesced, sizeof(uint16_t));
+    reply_data[20] = txq.high_water;
+    reply_data[21] = MMP_TXQ_BLOCKS;
+    mmp_cmd_reply(handle, 0, 22);
+}
@@ -32,6 +32,10 @@
 #define MMP_FLAGS_BOOT        0x0
 // bit indicates whether message is a CMD msg (1) or ASYNC msg (0)
 #define MMP_FLAGS_BIT_TYPE    0x1
+// bits 2 and 3 are used by the mmp layer, see MMP_FLAGS_CRC and MMP_FLAGS_COBS in mmp.h
+// bit indicates that a CMD msg's first data byte is a tag, which is returned as the first byte of its reply.
+// Lets the host have several commands outstanding and match replies to them.
+#define MMP_FLAGS_BIT_TAG     0x4
 
 
 // convenience macros
@@ -39,6 +43,7 @@
 #define MMP_FLAGS_IS_BOOT(flags)    ( flags == 0x1 )
 #define MMP_FLAGS_IS_CMD(flags)     ( flags & _BV(MMP_FLAGS_BIT_TYPE) )
 #define MMP_FLAGS_IS_ASYNC(flags)   ( ! MMP_FLAGS_IS_TYPE(flags) )
+#define MMP_FLAGS_IS_TAGGED(flags)  ( flags & _BV(MMP_FLAGS_BIT_TAG) )
 
 // setting flag bits
 #define MMP_FLAGS_SET_BOOT(flags)  ( flags = 0x1)
@@ -14,25 +14,30 @@
 //    limitations under the License.
 // -----------------------------------------------------------------------------   
 #include "mmp.h"
+#ifndef MMP_NO_REBOOT
 #include "lib/wdt.h"
+#endif
 #include <stdlib.h>
 #include <string.h>
-
-// Function  declrations.
-// State-machine functions
-void *mmp_handler_SOM(mmp_msg_ctrl_t *msg,  uint8_t byte);
-void *mmp_handler_LEN(mmp_msg_ctrl_t *msg,  uint8_t byte);
-void *mmp_handler_FLAGS(mmp_msg_ctrl_t *msg,  uint8_t byte);
-void *mmp_handler_STX(mmp_msg_ctrl_t *msg,  uint8_t byte);
-void *mmp_handler_DATA(mmp_msg_ctrl_t *msg, uint8_t byte);
-void *mmp_handler_EOT(mmp_msg_ctrl_t *msg,  uint8_t byte);
-void *mmp_handler_CS(mmp_msg_ctrl_t *msg,  uint8_t byte);
-
+#ifdef MMP_V2
+#include <avr/pgmspace.h>
+#endif
 
 // convienence macros
 #define MMP_TIMER_START() msg->timer=MMP_TIMER_TIMEOUT
 #define MMP_TIMER_STOP() msg->timer=0
 #define MSG_CS(sum)    (uint8_t)(256-sum)
+#ifndef MMP_RX_CS
+//! checksum byte of a received v1 frame whose len, flags and data sum to sum. Commands are sent with the sum,
+//! and replies with MSG_CS() of it, so the host's parser, see host/config.h, overrides this.
+#define MMP_RX_CS(sum) (sum)
+#endif
+#ifdef MMP_RX_STATS
+//! count a receive error
+#define MMP_STAT_INC(ctrl, field) if((ctrl)->stats.field != 0xffff) (ctrl)->stats.field++
+#else
+#define MMP_STAT_INC(ctrl, field)
+#endif
 
 // -----------------------------------------------------------------------------------
 #ifdef BOOT_APP
@@ -58,11 +63,120 @@ void mmp_init(mmp_ctrl_t *msg_ctrl,  uint8_t *buf, uint8_t buf_size,  void (*use
     msg_ctrl->ctrl.msg.data=buf;
     msg_ctrl->ctrl.data_max_len=buf_size;
     // set initial state
-    msg_ctrl->state_fn = mmp_handler_SOM;
+    msg_ctrl->state = MMP_STATE_SOM;
+    msg_ctrl->ctrl.timer = 0;
     msg_ctrl->ctrl.handler = user_handler;
     msg_ctrl->ctrl.user_data= user_data;
+#ifdef MMP_RX_IN_PLACE
+    msg_ctrl->ctrl.msg.ring=NULL;
+#endif
+#ifdef MMP_RX_STATS
+    memset(&(msg_ctrl->ctrl.stats), 0, sizeof(mmp_stats_t));
+#endif
+}
+
+#ifdef MMP_RX_IN_PLACE
+void mmp_init_ring(mmp_ctrl_t *msg_ctrl, uint8_t *ring, uint8_t ring_size, void (*user_handler)(void *user_data, mmp_msg_t *msg), void *user_data)
+{
+#ifdef MMP_V2
+    // data, ETX and both CRC chars must all fit in the ring at once.
+    mmp_init(msg_ctrl, ring, ring_size-3, user_handler, user_data);
+#else
+    // data, ETX and CS chars must all fit in the ring at once.
+    mmp_init(msg_ctrl, ring, ring_size-2, user_handler, user_data);
+#endif
+    msg_ctrl->ctrl.msg.ring=ring;
+    msg_ctrl->ctrl.msg.ring_mask=ring_size-1;
+    msg_ctrl->ctrl.pos = 0;
 }
 
+uint8_t mmp_rx_ring(mmp_ctrl_t *msg_ctrl, uint8_t tail)
+{
+    mmp_msg_ctrl_t *msg = &(msg_ctrl->ctrl);
+    uint8_t mask = msg->msg.ring_mask;
+    uint8_t n = tail - msg->pos;
+    if(n){
+	// parse new chars, in two runs if they wrap around the end of the ring.
+	uint8_t i = msg->pos & mask;
+	uint8_t to_end = mask+1 - i;
+	if(n > to_end){
+	    mmp_rx_buf(msg_ctrl, msg->msg.ring+i, to_end);
+	    mmp_rx_buf(msg_ctrl, msg->msg.ring, n-to_end);
+	}else{
+	    mmp_rx_buf(msg_ctrl, msg->msg.ring+i, n);
+	}
+	msg->pos = tail;
+    }
+    if(msg_ctrl->state >= MMP_STATE_DATA){
+	// message data has been received, or is being received, keep it.
+	// The data starts less than a ring's length before tail.
+	uint8_t i = msg->msg.data - msg->msg.ring;
+	return tail - ((uint8_t)(tail - i) & mask);
+    }
+    return tail;
+}
+
+uint8_t mmp_msg_contig_len(mmp_msg_t *msg)
+{
+    if(msg->ring){
+	uint8_t to_end = msg->ring_mask+1 - (msg->data - msg->ring);
+	if(to_end < msg->len){
+	    return to_end;
+	}
+    }
+    return msg->len;
+}
+
+void mmp_msg_copy(mmp_msg_t *msg, uint8_t offset, uint8_t *dst, uint8_t n)
+{
+    if(msg->ring){
+	uint8_t i = (msg->data - msg->ring) + offset;
+	while(n--){
+	    *dst++ = msg->ring[i++ & msg->ring_mask];
+	}
+    }else{
+	memcpy(dst, msg->data+offset, n);
+    }
+}
+#endif
+
+
+#ifdef MMP_V2
+//! CRC-16/CCITT of each nibble value, the crc is calculated 4 bits at a time.
+static const uint16_t mmp_crc_tab[16] PROGMEM = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
+
+uint16_t mmp_crc16(uint16_t crc, const uint8_t *data, uint8_t len)
+{
+    while(len--){
+	uint8_t b = *data++;
+	crc = (crc << 4) ^ pgm_read_word(&mmp_crc_tab[(crc >> 12) ^ (b >> 4)]);
+	crc = (crc << 4) ^ pgm_read_word(&mmp_crc_tab[(crc >> 12) ^ (b & 0x0f)]);
+    }
+    return crc;
+}
+
+//! return crc of received message's len, flags and data
+static uint16_t mmp_msg_crc(mmp_msg_t *msg)
+{
+    uint8_t hdr[2] = { msg->len, msg->flags };
+    uint16_t crc = mmp_crc16(MMP_CRC_INIT, hdr, 2);
+#ifdef MMP_RX_IN_PLACE
+    // data may wrap around end of the ring
+    uint8_t n = mmp_msg_contig_len(msg);
+    crc = mmp_crc16(crc, msg->data, n);
+    if(n < msg->len){
+	crc = mmp_crc16(crc, msg->ring, msg->len - n);
+    }
+    return crc;
+#else
+    return mmp_crc16(crc, msg->data, msg->len);
+#endif
+}
+#endif
+
 
 #if 1
 // debug display contents of mmp_msg_t
@@ -74,8 +188,24 @@ void mmp_print_mmp_msg_t(mmp_msg_t *msg, char* file, int line, char *text)
 
 void mmp_rx_ch(mmp_ctrl_t *msg_ctrl, uint8_t byte)
 {
-    // call state function: it returns pointer to the next state function
-    msg_ctrl->state_fn = (void *) msg_ctrl->state_fn(&(msg_ctrl->ctrl), byte) ;
+    mmp_msg_ctrl_t *msg = &(msg_ctrl->ctrl);
+    // fast path for data chars, which are most of a message: no state switch, no loop setup.
+    if(msg_ctrl->state == MMP_STATE_DATA){
+	msg->cs += byte;
+#ifdef MMP_RX_IN_PLACE
+	if(!msg->msg.ring)
+#endif
+	{
+	    msg->msg.data[msg->count] = byte;
+	}
+	if(++msg->count == msg->msg.len){
+	    // have received all the data
+	    msg_ctrl->state = MMP_STATE_ETX;
+	}
+	MMP_TIMER_START();
+	return;
+    }
+    mmp_rx_buf(msg_ctrl, &byte, 1);
 }
 
 
@@ -86,138 +216,344 @@ void mmp_tick(mmp_ctrl_t *msg_ctrl)
 	if(--msg_ctrl->ctrl.timer == 0)
 	{
 	    // timer has expired.
-	    msg_ctrl->state_fn = mmp_handler_SOM;
+	    msg_ctrl->state = MMP_STATE_SOM;
+	    MMP_STAT_INC(&(msg_ctrl->ctrl), timeout);
 	    MMP_LOG("mmp tick timeout", NULL);
 	}
     }
 }
 
-
-void *mmp_handler_SOM(mmp_msg_ctrl_t *msg,  uint8_t byte)
+#ifdef MMP_RX_STATS
+void mmp_stats_read(mmp_ctrl_t *msg_ctrl, mmp_stats_t *stats, uint8_t reset)
 {
-    if( byte == MSG_SOM ){
-	// got the start-of-message character
-	MMP_TIMER_START();
-	MMP_LOG_DEBUG("-SOM-", NULL);
-	return mmp_handler_LEN;
+    *stats = msg_ctrl->ctrl.stats;
+    if(reset){
+	memset(&(msg_ctrl->ctrl.stats), 0, sizeof(mmp_stats_t));
     }
-    return mmp_handler_SOM;
 }
+#endif
 
 
-void *mmp_handler_LEN(mmp_msg_ctrl_t *msg,  uint8_t byte)
+//! msg has been received successfully
+static void mmp_msg_received(mmp_msg_ctrl_t *msg)
 {
-    msg->msg.len=byte;
-    // restart timer
-    MMP_TIMER_START();
-    // calc checksum
-    msg->cs = byte;
-    MMP_LOG_DEBUG("-LEN %u-", byte);
-    // next, wait for FLAGS character
-    return mmp_handler_FLAGS;
+#ifndef MMP_NO_REBOOT
+    // check for reboot-message and reboot if so.
+    // reboot-message comprises:
+    //    flags set to 0x1 (ie indicating that this is a bootloader message), data set to single char 'r', len set to 1 
+    if(msg->msg.flags==0x1 && msg->msg.len==1 && msg->msg.data[0]=='r'){
+	// get wdt to reboot mcu
+	wdt_reset_mcu();
+    }
+#endif	
+    // call user msg handler
+    msg->handler(msg->user_data, &(msg->msg));
 }
 
-
-void *mmp_handler_FLAGS(mmp_msg_ctrl_t *msg,  uint8_t byte)
+#ifdef MMP_COBS_FRAMING
+//! return pointer to the i'th byte of received msg's data, which may wrap around the end of the ring
+static inline uint8_t *mmp_msg_data_ptr(mmp_msg_ctrl_t *msg, uint8_t i)
 {
-    msg->msg.flags=byte;
-    // restart timer
-    MMP_TIMER_START();
-    // calc checksum
-    msg->cs  += byte;
-    MMP_LOG_DEBUG("-FLAGS %u-", byte);
-    // next, wait for STX character
-    return mmp_handler_STX;
+#ifdef MMP_RX_IN_PLACE
+    if(msg->msg.ring){
+	return &(msg->msg.ring[(uint8_t)(msg->msg.data - msg->msg.ring + i) & msg->msg.ring_mask]);
+    }
+#endif
+    return &(msg->msg.data[i]);
 }
 
+#ifdef MMP_RX_IN_PLACE
+//! when decoding in place, data (flags excepted) is decoded to the ring starting from the char after the
+//! frame's first code byte. Decoded chars are always written behind the chars being read.
+#define MMP_COBS_SET_DATA() if(msg->msg.ring){ \
+	msg->msg.data = (buf == msg->msg.ring + msg->msg.ring_mask + 1) ? msg->msg.ring : (uint8_t *)buf; }
+#else
+#define MMP_COBS_SET_DATA()
+#endif
 
+//! start receiving COBS frame, the frame's leading delimiter has been received
+#define MMP_COBS_START() msg->count = 0; \
+    msg->cobs_code = msg->cobs_left = 0; \
+    MMP_COBS_SET_DATA();		 \
+    state = MMP_STATE_COBS
+//! start receiving COBS frame if byte is a delimiter
+#define MMP_COBS_RESYNC() if(byte == MSG_COBS_DELIM){ MMP_COBS_START(); }
 
-void *mmp_handler_STX(mmp_msg_ctrl_t *msg, uint8_t byte)
+//! add a decoded char to received COBS msg, return 0 if msg is too long
+static inline uint8_t mmp_cobs_put(mmp_msg_ctrl_t *msg, uint8_t byte)
 {
-    if( byte == MSG_STX){
-	// got start-of-text character,
-	// restart timer
-	MMP_TIMER_START();
-	// prepare to receive data
-	msg->count=0;
-	MMP_LOG_DEBUG("-STX-", NULL);
-	return mmp_handler_DATA;
+    uint8_t i = msg->count;
+    if(i == 0){
+	msg->msg.flags = byte;
+    }else if(i > msg->data_max_len){
+	MMP_STAT_INC(msg, overrun);
+	MMP_LOG("-DATA LEN EXCEEDED-", NULL);
+	return 0;
+    }else{
+	*mmp_msg_data_ptr(msg, i-1) = byte;
     }
-    MMP_LOG("-STX FAIL-", NULL);
-    MMP_TIMER_STOP();
-    return mmp_handler_SOM;
+    msg->count = i+1;
+    return 1;
 }
 
+//! COBS frame delimiter has been received
+static void mmp_cobs_end(mmp_msg_ctrl_t *msg)
+{
+    // count is number of decoded chars: flags, data, 2 crc chars
+    if(msg->cobs_left || msg->count < 3){
+	MMP_STAT_INC(msg, framing);
+	MMP_LOG("-COBS FAIL-", NULL);
+	return;
+    }
+    msg->msg.len = msg->count - 3;
+    uint16_t crc = *mmp_msg_data_ptr(msg, msg->msg.len) | *mmp_msg_data_ptr(msg, msg->msg.len+1) << 8;
+    if(crc == mmp_msg_crc(&(msg->msg))){
+	mmp_msg_received(msg);
+    }else{
+	MMP_STAT_INC(msg, cs_fail);
+	MMP_LOG("-CRC FAIL-", NULL);
+    }
+}
+#else
+#define MMP_COBS_RESYNC()
+#endif
 
-void *mmp_handler_DATA(mmp_msg_ctrl_t *msg, uint8_t byte)
+void mmp_rx_buf(mmp_ctrl_t *msg_ctrl, const uint8_t *buf, uint8_t len)
 {
-    if(msg->count  <  msg->data_max_len){
-	// update data
-	msg->msg.data[msg->count]=byte;
-	// and checksum
-	msg->cs  += byte;
-	MMP_TIMER_START();
-	MMP_LOG_DEBUG("-DATA- %c", byte);
-	if( ++msg->count == msg->msg.len ){
-	    // have received all the data
-	    return mmp_handler_EOT;
+    mmp_msg_ctrl_t *msg = &(msg_ctrl->ctrl);
+    const uint8_t *end = buf+len;
+    // keep state and checksum in registers for the duration
+    uint8_t state = msg_ctrl->state;
+    uint8_t cs = msg->cs;
+
+    while(buf != end){
+	uint8_t byte = *buf++;
+	switch(state){
+	    case MMP_STATE_SOM:
+		if( byte == MSG_SOM ){
+		    // got the start-of-message character
+		    MMP_LOG_DEBUG("-SOM-", NULL);
+		    state = MMP_STATE_LEN;
+		}
+#ifdef MMP_COBS_FRAMING
+		else if( byte == MSG_COBS_DELIM ){
+		    // start of COBS frame
+		    MMP_COBS_START();
+		}
+#endif
+		break;
+#ifdef MMP_COBS_FRAMING
+	    case MMP_STATE_COBS:
+		if( byte == MSG_COBS_DELIM ){
+		    if(msg->cobs_code){
+			// end of frame
+			mmp_cobs_end(msg);
+			state = MMP_STATE_SOM;
+		    }
+		    // otherwise the frame hasn't started, this is the second of two delimiters.
+		    break;
+		}
+		if(msg->cobs_left){
+		    msg->cobs_left--;
+		    if(!mmp_cobs_put(msg, byte)){
+			state = MMP_STATE_SOM;
+		    }
+		    break;
+		}
+		// code byte: it's followed by code-1 chars and then, unless code is 0xff or the frame ends, a zero.
+		if(msg->cobs_code == 0){
+		    // first code byte, flags is next char, and data is decoded in place from the char after that.
+		    MMP_COBS_SET_DATA();
+		}else if(msg->cobs_code != 0xff && !mmp_cobs_put(msg, 0)){
+		    state = MMP_STATE_SOM;
+		    break;
+		}
+		msg->cobs_code = byte;
+		msg->cobs_left = byte - 1;
+		break;
+#endif
+	    case MMP_STATE_LEN:
+		// check length now, rather than as the data arrives
+		if(byte > msg->data_max_len){
+		    MMP_STAT_INC(msg, overrun);
+		    MMP_LOG("-DATA LEN EXCEEDED-", NULL);
+		    state = MMP_STATE_SOM;
+		    break;
+		}
+		msg->msg.len=byte;
+		cs = byte;
+		MMP_LOG_DEBUG("-LEN %u-", byte);
+		state = MMP_STATE_FLAGS;
+		break;
+	    case MMP_STATE_FLAGS:
+		msg->msg.flags=byte;
+		cs += byte;
+		MMP_LOG_DEBUG("-FLAGS %u-", byte);
+		state = MMP_STATE_STX;
+		break;
+	    case MMP_STATE_STX:
+		if( byte != MSG_STX){
+		    MMP_STAT_INC(msg, framing);
+		    MMP_LOG("-STX FAIL-", NULL);
+		    state = MMP_STATE_SOM;
+		    // SOM was a false alarm, it may have been a char of a COBS frame whose delimiter this is.
+		    MMP_COBS_RESYNC();
+		    break;
+		}
+		// got start-of-text character, prepare to receive data
+		msg->count=0;
+#ifdef MMP_RX_IN_PLACE
+		if(msg->msg.ring){
+		    // data starts at next char in the ring
+		    msg->msg.data = (uint8_t *)buf;
+		    if(buf == msg->msg.ring + msg->msg.ring_mask + 1){
+			msg->msg.data = msg->msg.ring;
+		    }
+		}
+#endif
+		MMP_LOG_DEBUG("-STX-", NULL);
+		state = msg->msg.len ? MMP_STATE_DATA : MMP_STATE_ETX;
+		break;
+	    case MMP_STATE_DATA:
+	    {
+		// take as much of the data as is available in one go
+		uint8_t n = msg->msg.len - msg->count;
+		if(n > (uint8_t)(end - buf) + 1){
+		    n = (end - buf) + 1;
+		}
+		buf--;
+#ifdef MMP_RX_IN_PLACE
+		if(msg->msg.ring){
+		    // parsing in place, checksum only
+		    for(uint8_t i=n; i; i--){
+			cs += *buf++;
+		    }
+		}else
+#endif
+		{
+		    uint8_t *dst = msg->msg.data + msg->count;
+		    for(uint8_t i=n; i; i--){
+			uint8_t b = *buf++;
+			cs += b;
+			*dst++ = b;
+		    }
+		}
+		msg->count += n;
+		if(msg->count == msg->msg.len){
+		    // have received all the data
+		    state = MMP_STATE_ETX;
+		}
+		break;
+	    }
+	    case MMP_STATE_ETX:
+		if( byte == MSG_ETX ){
+		    // got the end-of-text character, expect checksum next
+		    MMP_LOG_DEBUG("-EOT-", NULL);
+		    state = MMP_STATE_CS;
+		}else{
+		    MMP_STAT_INC(msg, framing);
+		    MMP_LOG("-EOT FAIL- %c",byte);
+		    state = MMP_STATE_SOM;
+		    MMP_COBS_RESYNC();
+		}
+		break;
+	    case MMP_STATE_CS:
+	    case MMP_STATE_CRC:
+	    {
+		uint8_t ok;
+#ifdef MMP_V2
+		if(msg->msg.flags & MMP_FLAGS_CRC){
+		    if(state == MMP_STATE_CS){
+			// v2 frame, keep crc low byte until the high byte arrives
+			cs = byte;
+			state = MMP_STATE_CRC;
+			break;
+		    }
+		    ok = mmp_msg_crc(&(msg->msg)) == (uint16_t)(byte << 8 | cs);
+		}else
+#endif
+		ok = (byte == MMP_RX_CS(cs));
+		state = MMP_STATE_SOM;
+		if(ok){
+		    // checksum checks out.
+		    mmp_msg_received(msg);
+		}else{
+		    // checksum failed
+		    MMP_STAT_INC(msg, cs_fail);
+		    MMP_LOG("-CS FAIL- e: 0x%x, c: 0x%x", cs, byte);
+		}
+		break;
+	    }
 	}
-	// expecting more data
-	return mmp_handler_DATA;
     }
-    // max length exceeded.
-    MMP_LOG("-DATA LEN EXCEEDED-", NULL);
-    MMP_TIMER_STOP();
-    return mmp_handler_SOM;
+    msg_ctrl->state = state;
+    msg->cs = cs;
+    // (re)start timer if part of a message has been received.
+    if(state == MMP_STATE_SOM){
+	MMP_TIMER_STOP();
+    }else{
+	MMP_TIMER_START();
+    }
 }
 
 
-void *mmp_handler_EOT(mmp_msg_ctrl_t *msg,  uint8_t byte)
+#ifdef MMP_COBS_FRAMING
+//! return the i'th char of a COBS frame's content: flags, data, crc low byte, crc high byte
+static inline uint8_t mmp_cobs_src(uint8_t *msg_data, uint8_t len, uint8_t flags, uint16_t crc, uint16_t i)
 {
-    if( byte == MSG_ETX ){
-	// got the end-of-text character
-	MMP_TIMER_START();
-	// expect checksum next
-	MMP_LOG_DEBUG("-EOT-", NULL);
-	return mmp_handler_CS;
+    if(i == 0){
+	return flags;
+    }
+    if(i <= len){
+	return msg_data[i-1];
     }
-    // didn't get end-of-text character
-    MMP_LOG("-EOT FAIL- %c",byte);
-    MMP_TIMER_STOP();
-    return mmp_handler_SOM;
+    return i == len+1 ? crc & 0xff : crc >> 8;
 }
 
-void *mmp_handler_CS(mmp_msg_ctrl_t *msg,  uint8_t byte)
+//! send COBS frame
+static void mmp_send_cobs(uint8_t *msg_data, uint8_t len, uint8_t flags, uint16_t crc, void (*tx_byte_fn)(const char c))
 {
-
-    if( byte == msg->cs){
-	// checksum checks out.
-	// msg received successfully,
-
-#ifndef MMP_NO_REBOOT
-	// check for reboot-message and reboot if so.
-	// reboot-message comprises:
-	//    flags set to 0x1 (ie indicating that this is a bootloader message), data set to single char 'r', len set to 1 
-	if(msg->msg.flags==0x1 && msg->msg.len==1 && msg->msg.data[0]=='r'){
-	    // get wdt to reboot mcu
-	    wdt_reset_mcu();
+    uint16_t n = len+3;
+    uint16_t i = 0;
+    tx_byte_fn(MSG_COBS_DELIM);
+    for(;;){
+	// find run of up to 254 non-zero chars starting at i
+	uint16_t j = i;
+	while(j < n && j-i < 254 && mmp_cobs_src(msg_data, len, flags, crc, j)){
+	    j++;
 	}
-#endif	
-	// call user msg handler
-	msg->handler(msg->user_data, &(msg->msg));
-    }else{
-	// checksum failed
-	MMP_LOG("-CS FAIL- e: 0x%x, c: 0x%x", msg->cs, byte);
+	// code byte, then the run
+	tx_byte_fn(j-i+1);
+	for(uint16_t k=i; k<j; k++){
+	    tx_byte_fn(mmp_cobs_src(msg_data, len, flags, crc, k));
+	}
+	if(j == n){
+	    break;
+	}
+	// the zero that ended the run is implied by the code byte, skip it. A run of 254 has no zero.
+	i = (j-i == 254) ? j : j+1;
     }
-    MMP_TIMER_STOP();
-    return mmp_handler_SOM;
+    tx_byte_fn(MSG_COBS_DELIM);
 }
-
+#endif
 
 void mmp_send(uint8_t *msg_data, uint8_t len, uint8_t flags, void (*tx_byte_fn)(const char c))
 {
     // checksum 
     uint8_t cs=len;
+#ifdef MMP_V2
+    uint16_t crc=0;
+    if(flags & (MMP_FLAGS_CRC | MMP_FLAGS_COBS)){
+	uint8_t hdr[2] = { len, flags };
+	crc = mmp_crc16(mmp_crc16(MMP_CRC_INIT, hdr, 2), msg_data, len);
+    }
+#endif
+#ifdef MMP_COBS_FRAMING
+    if(flags & MMP_FLAGS_COBS){
+	mmp_send_cobs(msg_data, len, flags, crc, tx_byte_fn);
+	return;
+    }
+#endif
     // send SOM
     tx_byte_fn(MSG_SOM);
     // send length
@@ -236,6 +572,14 @@ void mmp_send(uint8_t *msg_data, uint8_t len, uint8_t flags, void (*tx_byte_fn)(
     }
     // send ETX
     tx_byte_fn(MSG_ETX);
+#ifdef MMP_V2
+    if(flags & MMP_FLAGS_CRC){
+	// send crc, low byte first
+	tx_byte_fn(crc & 0xff);
+	tx_byte_fn(crc >> 8);
+	return;
+    }
+#endif
     // send checksum
     tx_byte_fn(MSG_CS( cs));
 }
@@ -35,6 +35,76 @@
 #undef MMP_NO_REBOOT
 #endif
 
+//! MMP_RX_IN_PLACE: define to enable parsing of messages in place in a circular rx buffer (eg the uart's),
+//! see mmp_init_ring(). Not available when app uses the bootloader's mmp functions.
+#if defined(MMP_RX_IN_PLACE) && defined(BOOT_APP)
+#error "MMP_RX_IN_PLACE can not be used with BOOT_APP"
+#endif
+
+
+//! MMP_CRC16: define to support v2 frames, in which a CRC-16 replaces the 8 bit checksum. v1 frames are
+//! still accepted, and always used by the bootloader. Not available when app uses the bootloader's mmp functions.
+#if defined(MMP_CRC16) && !defined(BOOT) && !defined(BOOT_APP)
+#define MMP_V2
+#endif
+
+//! flags bit that marks a v2 frame: ETX is followed by the CRC-16/CCITT (poly 0x1021, init 0xffff) of
+//! the len, flags and data bytes, sent low byte first, rather than by the checksum byte.
+//! A v2 frame is sent in reply to a v2 frame.
+#define MMP_FLAGS_CRC 0x04
+#define MMP_CRC_INIT  0xffff
+
+//! MMP_COBS: define to also accept COBS framed messages, requires MMP_CRC16.
+//! A COBS frame is the COBS encoding of: flags, data, CRC-16 (as for v2 frames, of len, flags and data, where len
+//! is the length of the data), with a zero byte before and after it. As zero can't occur within an encoded frame,
+//! a zero always marks a frame boundary and a corrupted frame costs only that frame.
+//! The receiver enters COBS framing when it sees a zero while waiting for SOM, so v1 and v2 frames are still accepted.
+#if defined(MMP_COBS) && defined(MMP_V2)
+#define MMP_COBS_FRAMING
+#elif defined(MMP_COBS) && !defined(BOOT) && !defined(BOOT_APP)
+#error "MMP_COBS requires MMP_CRC16"
+#endif
+
+//! MMP_STATS: define to count each receiver's errors, see mmp_stats_read(). Not available when app uses the
+//! bootloader's mmp functions.
+#if defined(MMP_STATS) && !defined(BOOT) && !defined(BOOT_APP)
+#define MMP_RX_STATS
+#endif
+
+//! receive error counters, maintained when MMP_RX_STATS is defined. Counts saturate at 0xffff.
+typedef struct {
+    uint16_t cs_fail;  //! frames whose checksum or CRC was wrong
+    uint16_t timeout;  //! frames abandoned because the rest of them didn't arrive in time
+    uint16_t overrun;  //! frames too long for the receive buffer
+    uint16_t framing;  //! frames with a missing STX or ETX, or a malformed COBS encoding
+} mmp_stats_t;
+
+//! flags bit that marks a COBS framed message. It's set in received COBS messages, and a message sent with it set is COBS framed. 
+#define MMP_FLAGS_COBS 0x08
+//! the COBS frame delimiter
+#define MSG_COBS_DELIM 0
+
+//! max number of chars, besides its data, that framing a message adds. v1: SOM, len, flags, STX, ETX and checksum.
+//! v2: the same with a 2 byte CRC. COBS: two delimiters, flags, CRC, and a code byte per 254 chars of flags, data
+//! and CRC, of which there are at most 258.
+#if defined(MMP_COBS_FRAMING)
+#define MMP_FRAME_OVERHEAD 7
+#elif defined(MMP_V2)
+#define MMP_FRAME_OVERHEAD 7
+#else
+#define MMP_FRAME_OVERHEAD 6
+#endif
+
+//! capability bits, as reported by the caps command
+#define MMP_CAP_CRC16 0x01
+#define MMP_CAP_COBS  0x02
+#if defined(MMP_COBS_FRAMING)
+#define MMP_CAPS (MMP_CAP_CRC16 | MMP_CAP_COBS)
+#elif defined(MMP_V2)
+#define MMP_CAPS MMP_CAP_CRC16
+#else
+#define MMP_CAPS 0
+#endif
 
 //! Message indicator characters:
 //! start of message
@@ -52,6 +122,13 @@ typedef struct mmp_msg_t {
     uint8_t flags;
     //! The message data
     uint8_t *data;
+#ifdef MMP_RX_IN_PLACE
+    //! When message was parsed in place: start of the circular buffer that data points into, NULL otherwise.
+    //! The data may wrap around the end of the buffer, use mmp_msg_contig_len() and mmp_msg_copy() to access it.
+    uint8_t *ring;
+    //! size of circular buffer minus one, size is a power of two.
+    uint8_t ring_mask;
+#endif
 } mmp_msg_t;
 
 typedef struct mmp_msg_ctrl_t {
@@ -67,17 +144,43 @@ typedef struct mmp_msg_ctrl_t {
     uint8_t count;
     //! crc check sum of received message's len and data bytes
     uint8_t cs; 
+#ifdef MMP_COBS_FRAMING
+    //! the most recent COBS code byte, 0 if none has yet been received for the current frame.
+    uint8_t cobs_code;
+    //! number of chars before next COBS code byte
+    uint8_t cobs_left;
+#endif
     //! handler fn, gets call when message has been received
     void (*handler)(void *user_data, mmp_msg_t *msg);
     //! user data, gets passed to the handler function
     void *user_data;
+#ifdef MMP_RX_IN_PLACE
+    //! free running count of circular buffer chars that have been parsed
+    uint8_t pos;
+#endif
+#ifdef MMP_RX_STATS
+    mmp_stats_t stats;
+#endif
 } mmp_msg_ctrl_t;
 
 
+//! receiver states
+#define MMP_STATE_SOM   0
+#define MMP_STATE_LEN   1
+#define MMP_STATE_FLAGS 2
+#define MMP_STATE_STX   3
+#define MMP_STATE_DATA  4
+#define MMP_STATE_ETX   5
+#define MMP_STATE_CS    6
+//! second byte of a v2 frame's CRC
+#define MMP_STATE_CRC   7
+//! within a COBS frame
+#define MMP_STATE_COBS  8
+
 //! struct for holding state-machine and msg data.
 typedef struct {
-    //! Pointer to state-machine current handler function
-    void *(*state_fn)(mmp_msg_ctrl_t *msg, uint8_t byte);
+    //! State-machine current state, the next char expected: one of MMP_STATE_XXX
+    uint8_t state;
     mmp_msg_ctrl_t ctrl;
 } mmp_ctrl_t;
 
@@ -99,6 +202,44 @@ void mmp_print_mmp_msg_t(mmp_msg_t *msg, char* file, int line, char *text);
 void mmp_init(mmp_ctrl_t *msg_ctrl,  uint8_t *buf, uint8_t buf_size,  void (*user_handler)(void *user_data, mmp_msg_t *msg), void *user_data);
 
 
+#ifdef MMP_RX_IN_PLACE
+/** 
+ * Initialise the messaging system to parse messages in place in a circular buffer, eg the uart rx buffer.
+ * Message data is not copied, the msg passed to the handler has data pointing into the circular buffer,
+ * and data may wrap around the end of the buffer.
+ * 
+ * @param msg_ctrl Pointer to the mmp_msg_ctrl_t structure.
+ * @param ring The circular buffer.
+ * @param ring_size The size of the circular buffer, must be a power of two.
+ * @param user_msg_handler The callback function that will be called when a message has been successfully received.
+ * @param user_data 
+ */
+void mmp_init_ring(mmp_ctrl_t *msg_ctrl, uint8_t *ring, uint8_t ring_size, void (*user_handler)(void *user_data, mmp_msg_t *msg), void *user_data);
+
+/** 
+ * Parse the chars that have been added to the circular buffer since the prior call.
+ * Should be called regularly, even when no new chars have been received, so that chars of timed out
+ * messages are released.
+ * 
+ * @param msg_ctrl Pointer to the mmp_ctrl_t structure.
+ * @param tail Free running count of chars that have been added to the circular buffer.
+ * @return Free running count of chars up to which the circular buffer may be released (ie reused) by its producer.
+ */
+uint8_t mmp_rx_ring(mmp_ctrl_t *msg_ctrl, uint8_t tail);
+
+//! Return the number of msg's data bytes that are contiguous in memory starting at msg->data
+uint8_t mmp_msg_contig_len(mmp_msg_t *msg);
+
+/** 
+ * Copy msg's data bytes to a buffer, handling wrap around the end of a circular buffer.
+ * @param msg The message.
+ * @param offset Index of the first data byte to be copied.
+ * @param dst Destination buffer.
+ * @param n Number of bytes to copy.
+ */
+void mmp_msg_copy(mmp_msg_t *msg, uint8_t offset, uint8_t *dst, uint8_t n);
+#endif
+
 /** 
  * Should be called periodically so message reception timeouts can be detected.
  * Default implementation calls this at about 1000Hz
@@ -114,11 +255,44 @@ void mmp_tick(mmp_ctrl_t *mmp_ctrl);
  */
 void mmp_rx_ch(mmp_ctrl_t *mmp_ctrl, uint8_t ch);
 
+/** 
+ * Called to pass a run of characters (bytes) that have been received on the communication channel onto the mmp system.
+ * This is much faster than calling mmp_rx_ch() for each of them, message data is checksummed and copied in one
+ * loop, and the reception timeout is restarted once per call rather than once per char.
+ * 
+ * @param msg_ctrl Pointer to the mmp_ctrl_t structure.
+ * @param buf The characters that have been received.
+ * @param len The number of characters.
+ */
+void mmp_rx_buf(mmp_ctrl_t *mmp_ctrl, const uint8_t *buf, uint8_t len);
+
+#ifdef MMP_V2
+/** 
+ * Calculate CRC-16/CCITT, as used by v2 frames.
+ * @param crc Initial value, MMP_CRC_INIT, or the result of a prior call to continue the calculation.
+ * @param data The bytes.
+ * @param len Number of bytes.
+ * @return The crc.
+ */
+uint16_t mmp_crc16(uint16_t crc, const uint8_t *data, uint8_t len);
+
+#ifdef MMP_RX_STATS
+/** 
+ * Copy the receive error counters.
+ * @param msg_ctrl Pointer to the mmp_ctrl_t structure.
+ * @param stats Where the counters are copied to.
+ * @param reset If non-zero, counters are zeroed after being copied.
+ */
+void mmp_stats_read(mmp_ctrl_t *msg_ctrl, mmp_stats_t *stats, uint8_t reset);
+#endif
+#endif
+
 /** 
  * Send a message.
  * 
  * @param msg_data The data that is to be contained in the message. 
  * @param len The length of the data.
+ * @param flags The message's flags. If MMP_FLAGS_CRC is set then a v2 frame is sent, if MMP_FLAGS_COBS is set then a COBS frame.
  * @param tx_byte_fn Function that is to be called to transmit a byte on the communication channel.
  */
 void mmp_send(uint8_t *msg_data, uint8_t len, uint8_t flags, void (*tx_byte_fn)(const char c));
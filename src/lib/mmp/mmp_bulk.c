@@ -0,0 +1,146 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+#include "mmp_bulk.h"
+#include "../log.h"
+#include <string.h>
+
+// flags
+//! transfer is in progress
+#define MMP_BULK_ACTIVE   0x01
+//! last fragment has been produced, its sequence number is in last
+#define MMP_BULK_HAVE_LAST 0x02
+
+//! state of the transfer in progress
+static struct {
+    mmp_bulk_read_fn_t read_fn;
+    //! endpoint that asked for the transfer, fragments are sent to it
+    mmp_cmd_ctrl_t *ctrl;
+    //! length of data, or MMP_BULK_LEN_UNKNOWN
+    uint32_t len;
+    //! sequence number of next fragment to be sent
+    uint16_t next;
+    //! sequence number of first fragment that host hasn't acknowledged
+    uint16_t acked;
+    //! one after the highest sequence number that has been sent
+    uint16_t high;
+    //! sequence number of last fragment, if MMP_BULK_HAVE_LAST
+    uint16_t last;
+    //! calls to mmp_bulk_run() since host last acknowledged anything, or fragments were resent
+    uint16_t timer;
+    uint8_t retries;
+    uint8_t xfer;
+    uint8_t flags;
+    //! fragment message being sent
+    uint8_t msg[4+MMP_BULK_FRAG_SIZE];
+} mmp_bulk;
+
+
+void mmp_bulk_start(void *handle, uint8_t *reply_data, mmp_bulk_read_fn_t read_fn, uint32_t len)
+{
+    // id tells host which transfer fragments belong to, never 0
+    uint8_t xfer = mmp_bulk.xfer+1;
+    if(!xfer){
+	xfer=1;
+    }
+    memset(&mmp_bulk, 0, sizeof(mmp_bulk));
+    mmp_bulk.xfer = xfer;
+    mmp_bulk.read_fn = read_fn;
+    mmp_bulk.ctrl = (mmp_cmd_ctrl_t *)handle;
+    mmp_bulk.len = len;
+    mmp_bulk.flags = MMP_BULK_ACTIVE;
+    reply_data[0] = xfer;
+    memcpy(reply_data+1, &len, sizeof(uint32_t));
+    reply_data[5] = MMP_BULK_FRAG_SIZE;
+    reply_data[6] = MMP_BULK_WINDOW;
+    mmp_cmd_reply(handle, 0, 7);
+}
+
+
+uint8_t mmp_bulk_run()
+{
+    if(!(mmp_bulk.flags & MMP_BULK_ACTIVE)){
+	return MMP_BULK_IDLE;
+    }
+    uint16_t seq = mmp_bulk.next;
+    if((uint16_t)(seq - mmp_bulk.acked) < MMP_BULK_WINDOW &&
+       !((mmp_bulk.flags & MMP_BULK_HAVE_LAST) && seq == (uint16_t)(mmp_bulk.last+1))){
+	// window has room and there is more to send: produce and send next fragment
+	uint32_t offset = (uint32_t)seq * MMP_BULK_FRAG_SIZE;
+	uint8_t n = MMP_BULK_FRAG_SIZE;
+	if(mmp_bulk.len != MMP_BULK_LEN_UNKNOWN){
+	    if(offset >= mmp_bulk.len){
+		n=0;
+	    }else if(mmp_bulk.len - offset < n){
+		n = mmp_bulk.len - offset;
+	    }
+	}
+	if(n){
+	    n = mmp_bulk.read_fn(offset, mmp_bulk.msg+4, n);
+	}
+	if(n < MMP_BULK_FRAG_SIZE){
+	    // short fragment is the last
+	    mmp_bulk.last = seq;
+	    mmp_bulk.flags |= MMP_BULK_HAVE_LAST;
+	}
+	mmp_bulk.msg[0] = MMP_BULK_ASYNC_ID;
+	mmp_bulk.msg[1] = mmp_bulk.xfer;
+	memcpy(mmp_bulk.msg+2, &seq, sizeof(uint16_t));
+	mmp_cmd_async_send(mmp_bulk.ctrl, mmp_bulk.msg, 4+n);
+	mmp_bulk.next = ++seq;
+	if((uint16_t)(seq - mmp_bulk.acked) > (uint16_t)(mmp_bulk.high - mmp_bulk.acked)){
+	    mmp_bulk.high = seq;
+	}
+	return MMP_BULK_SENT;
+    }
+    // waiting for host
+    if(++mmp_bulk.timer >= MMP_BULK_TIMEOUT){
+	mmp_bulk.timer = 0;
+	if(++mmp_bulk.retries > MMP_BULK_RETRIES){
+	    LOG_WARN_FP("bulk: xfer %u timed out at %u", mmp_bulk.xfer, mmp_bulk.acked);
+	    mmp_bulk.flags = 0;
+	    return MMP_BULK_IDLE;
+	}
+	// go back to the first fragment host doesn't have
+	mmp_bulk.next = mmp_bulk.acked;
+    }
+    return MMP_BULK_WAIT;
+}
+
+
+uint8_t mmp_bulk_ack(uint8_t xfer, uint16_t seq, uint8_t resend)
+{
+    if(!(mmp_bulk.flags & MMP_BULK_ACTIVE) || xfer != mmp_bulk.xfer){
+	return 1;
+    }
+    if((uint16_t)(seq - mmp_bulk.acked) > (uint16_t)(mmp_bulk.high - mmp_bulk.acked)){
+	// not a fragment that has been sent
+	return 1;
+    }
+    if(seq != mmp_bulk.acked){
+	mmp_bulk.acked = seq;
+	mmp_bulk.timer = 0;
+	mmp_bulk.retries = 0;
+	if((mmp_bulk.flags & MMP_BULK_HAVE_LAST) && seq == (uint16_t)(mmp_bulk.last+1)){
+	    // host has it all
+	    mmp_bulk.flags = 0;
+	    return 0;
+	}
+    }
+    if(resend || (uint16_t)(mmp_bulk.next - seq) > (uint16_t)(mmp_bulk.high - seq)){
+	// go back to seq, or forward to it if fragments have been resent that host already had
+	mmp_bulk.next = seq;
+	mmp_bulk.timer = 0;
+    }
+    return 0;
+}
+
+
+uint8_t mmp_bulk_abort(uint8_t xfer)
+{
+    if(!(mmp_bulk.flags & MMP_BULK_ACTIVE) || xfer != mmp_bulk.xfer){
+	return 1;
+    }
+    mmp_bulk.flags = 0;
+    return 0;
+}
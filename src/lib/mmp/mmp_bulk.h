@@ -0,0 +1,102 @@
+#ifndef _MMP_BULK_H
+#define _MMP_BULK_H 1
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+/**
+ * @file   mmp_bulk.h
+ *
+ * @brief  Bulk transfers of more data than fits in a reply, on top of mmp_cmd.
+ *
+ * A command handler starts a transfer by calling mmp_bulk_start() rather than mmp_cmd_reply(), passing a
+ * function that produces the data. The command is replied to with:
+ *   uint8_t xfer id, uint32_t length, uint8_t fragment size, uint8_t window
+ * and the data is then sent, to the endpoint that sent the command only, as async messages, each a fragment of it:
+ *   MMP_BULK_ASYNC_ID, uint8_t xfer id, uint16_t sequence number, up to fragment size bytes of data
+ * The last fragment is the one that is shorter than the fragment size, it may be empty.
+ * Up to window fragments are sent ahead of the host's acknowledgement, see mmp_bulk_ack(). If host doesn't
+ * acknowledge them in time, or asks for a fragment to be resent, sending goes back to the first fragment
+ * it doesn't have. Data is produced as it is sent, so the transfer needs no more RAM than one fragment,
+ * but the produce function must be able to produce any part of it again.
+ */
+#include "config.h"
+#include "mmp_cmd.h"
+
+#ifndef MMP_BULK_FRAG_SIZE
+//! number of data bytes in each fragment
+#define MMP_BULK_FRAG_SIZE 32
+#endif
+#ifndef MMP_BULK_WINDOW
+//! max number of fragments that are sent ahead of the host's acknowledgement
+#define MMP_BULK_WINDOW 8
+#endif
+#ifndef MMP_BULK_TIMEOUT
+//! number of calls to mmp_bulk_run() that wait for an acknowledgement before unacknowledged fragments are resent
+#define MMP_BULK_TIMEOUT 100
+#endif
+#ifndef MMP_BULK_RETRIES
+//! transfer is abandoned after this many timeouts without host acknowledging anything
+#define MMP_BULK_RETRIES 5
+#endif
+
+//! first data byte of fragment messages
+#define MMP_BULK_ASYNC_ID 10
+//! transfer length to pass to mmp_bulk_start() when it isn't known in advance
+#define MMP_BULK_LEN_UNKNOWN 0xffffffff
+
+// mmp_bulk_run() return values
+//! there is no transfer in progress
+#define MMP_BULK_IDLE 0
+//! a fragment was sent, call again as soon as possible
+#define MMP_BULK_SENT 1
+//! waiting for host to acknowledge fragments, call again next tick
+#define MMP_BULK_WAIT 2
+
+/**
+ * Type of function that produces the data of a transfer.
+ * @param offset Offset of the data from the start of the transfer.
+ * @param buf Where the data is to be put.
+ * @param len Number of bytes wanted.
+ * @return Number of bytes put in buf. Fewer than len ends the transfer.
+ */
+typedef uint8_t (*mmp_bulk_read_fn_t)(uint32_t offset, uint8_t *buf, uint8_t len);
+
+/**
+ * Start a transfer, replacing any that is in progress, and reply to the command that asked for it.
+ * Called from a command handler in place of mmp_cmd_reply(). mmp_bulk_run() must then be called until
+ * it returns MMP_BULK_IDLE.
+ *
+ * @param handle The handle passed to the command handler.
+ * @param reply_data The reply_data passed to the command handler.
+ * @param read_fn Function that produces the data.
+ * @param len Length of the data, or MMP_BULK_LEN_UNKNOWN in which case read_fn ends the transfer.
+ */
+void mmp_bulk_start(void *handle, uint8_t *reply_data, mmp_bulk_read_fn_t read_fn, uint32_t len);
+
+/**
+ * Send the next fragment of the transfer in progress if the window allows, otherwise count down
+ * the acknowledgement timeout. Should be called from a task, see lib/mmp/drivers/bulk.c
+ *
+ * @return MMP_BULK_IDLE, MMP_BULK_SENT or MMP_BULK_WAIT
+ */
+uint8_t mmp_bulk_run();
+
+/**
+ * Host has received the fragments of the transfer before seq.
+ *
+ * @param xfer The transfer's id.
+ * @param seq Sequence number of the first fragment that host doesn't have.
+ * @param resend Non-zero to have fragments sent again from seq, eg because host has seen one is missing.
+ * @return 0 if ack was for the transfer in progress, 1 otherwise.
+ */
+uint8_t mmp_bulk_ack(uint8_t xfer, uint16_t seq, uint8_t resend);
+
+/**
+ * Abandon the transfer.
+ *
+ * @param xfer The transfer's id.
+ * @return 0 if xfer was the transfer in progress, 1 otherwise.
+ */
+uint8_t mmp_bulk_abort(uint8_t xfer);
+
+#endif /* _MMP_BULK_H */
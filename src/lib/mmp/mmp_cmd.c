@@ -15,6 +15,7 @@
 // -----------------------------------------------------------------------------   
 #include "mmp_cmd.h"
 #include "../log.h"
+#include <string.h>
 
 // define MSG_USE_LOGGER to have error messages logged
 #ifdef MMP_CMD_LOGGING
@@ -32,13 +33,154 @@
 void mmp_cmd_reply(void *handle, uint8_t status, uint8_t data_len)
 {
     mmp_cmd_ctrl_t *ctrl = (mmp_cmd_ctrl_t *)handle;
-    mmp_msg_t *msg = &(ctrl->mmp_ctrl.ctrl.msg);
+    if(ctrl->batch){
+	// reply to a sub-command of a batch: record its status and length ahead of its data, see cmd_batch()
+	ctrl->reply_buf[1]=status;
+	ctrl->reply_buf[2]=data_len;
+	return;
+    }
+    // tagged reply has the tag ahead of the command
+    uint8_t hdr = MMP_FLAGS_IS_TAGGED(ctrl->reply_flags) ? 1 : 0;
     // set status
-    msg->data[1]=status;
+    ctrl->reply_buf[hdr+1]=status;
     // send reply message
-    mmp_send(msg->data, data_len+2, msg->flags, ctrl->tx_byte_fn);
+    mmp_send(ctrl->reply_buf, data_len+hdr+2, ctrl->reply_flags, ctrl->tx_byte_fn);
+}
+
+
+#ifdef MMP_V2
+//! MMP_FLAGS_CRC and MMP_FLAGS_COBS bits of the last command received by any endpoint, for mmp_async_send()
+static uint8_t mmp_cmd_async_flags;
+#endif
+
+//! endpoints that have been initialised
+static mmp_cmd_ctrl_t *mmp_cmd_endpoints[MMP_CMD_MAX_ENDPOINTS];
+static uint8_t mmp_cmd_num_endpoints;
+
+//! Add endpoint to those that are ticked, run and sent async messages, unless it has been already.
+static void mmp_cmd_register(mmp_cmd_ctrl_t *ctrl)
+{
+    ctrl->async_mask = MMP_CMD_ASYNC_ALL;
+#ifdef MMP_V2
+    ctrl->async_flags = 0;
+#endif
+    for(uint8_t i=0; i < mmp_cmd_num_endpoints; i++){
+	if(mmp_cmd_endpoints[i] == ctrl){
+	    return;
+	}
+    }
+    if(mmp_cmd_num_endpoints == MMP_CMD_MAX_ENDPOINTS){
+	MMP_CMD_LOG_WARN("too many endpoints: %u", MMP_CMD_MAX_ENDPOINTS);
+	return;
+    }
+    mmp_cmd_endpoints[mmp_cmd_num_endpoints++] = ctrl;
+}
+
+/**
+ * Call the handler for a command message.
+ * @param ctrl The control structure.
+ * @param flags The message's flags.
+ * @param data The message's data: [tag,] cmd, command data.
+ * @param len Length of data.
+ */
+static void mmp_cmd_dispatch(mmp_cmd_ctrl_t *ctrl, uint8_t flags, uint8_t *data, uint8_t len)
+{
+    // tagged command has the tag ahead of the command
+    uint8_t hdr = MMP_FLAGS_IS_TAGGED(flags) ? 1 : 0;
+    if(len < hdr+1){
+	// data length is invalid
+	return;
+    }
+    uint8_t cmd = data[hdr];
+    if( cmd >= ctrl->num_handlers ){
+	// invalid command, ie cmd number exceeds number of entries in cmd table
+	MMP_CMD_LOG_WARN("invalid command: %u", cmd);
+	return;
+    }
+    // the reply is built in reply_buf, which doesn't overlap data:
+    //   byte 0 is the tag, if tagged, then
+    //   the command
+    //   the status byte
+    //   and the user reply data
+    uint8_t *reply = ctrl->reply_buf;
+    reply[0]=data[0];
+    reply[hdr]=cmd;
+    ctrl->reply_flags=flags;
+    ctrl->batch=0;
+    // call the handler
+    ctrl->cmd_handler_tab[cmd](ctrl, cmd, len-hdr-1, ctrl->reply_buf_size-hdr-2, data+hdr+1, reply+hdr+2);
+}
+
+#ifdef MMP_CMD_QUEUED
+//! Copy n of msg's data bytes starting at offset to dst.
+static void mmp_cmd_msg_copy(mmp_msg_t *msg, uint8_t offset, uint8_t *dst, uint8_t n)
+{
+#ifdef MMP_RX_IN_PLACE
+    mmp_msg_copy(msg, offset, dst, n);
+#else
+    memcpy(dst, msg->data+offset, n);
+#endif
 }
 
+//! Queue the received command-message, or reply busy if the queue is full.
+static void mmp_cmd_enqueue(mmp_cmd_ctrl_t *ctrl, mmp_msg_t *msg)
+{
+    uint8_t hdr = MMP_FLAGS_IS_TAGGED(msg->flags) ? 1 : 0;
+    if(msg->len < hdr+1){
+	// data length is invalid
+	return;
+    }
+    if(ctrl->queue_count == ctrl->queue_len || msg->len > ctrl->queue_slot_size-2){
+	// can't queue it: reply now with the command's tag and number, and an error status
+	uint8_t reply[3];
+	mmp_cmd_msg_copy(msg, 0, reply, hdr+1);
+	reply[hdr+1] = ctrl->queue_count == ctrl->queue_len ? MMP_CMD_STATUS_BUSY : MMP_CMD_STATUS_TOO_LONG;
+	mmp_send(reply, hdr+2, msg->flags, ctrl->tx_byte_fn);
+	MMP_CMD_LOG_DEBUG("cmd not queued: %u", reply[hdr]);
+	return;
+    }
+    uint8_t i = ctrl->queue_head + ctrl->queue_count;
+    if(i >= ctrl->queue_len){
+	i -= ctrl->queue_len;
+    }
+    // slot is: len, flags, data
+    uint8_t *slot = ctrl->queue + i * ctrl->queue_slot_size;
+    slot[0] = msg->len;
+    slot[1] = msg->flags;
+    mmp_cmd_msg_copy(msg, 0, slot+2, msg->len);
+    ctrl->queue_count++;
+}
+
+void mmp_cmd_run(mmp_cmd_ctrl_t *ctrl)
+{
+    if(ctrl->queue_count){
+	uint8_t *slot = ctrl->queue + ctrl->queue_head * ctrl->queue_slot_size;
+	mmp_cmd_dispatch(ctrl, slot[1], slot+2, slot[0]);
+	if(++ctrl->queue_head == ctrl->queue_len){
+	    ctrl->queue_head = 0;
+	}
+	ctrl->queue_count--;
+    }
+}
+
+uint8_t mmp_cmd_run_all()
+{
+    uint8_t queued = 0;
+    for(uint8_t i=0; i < mmp_cmd_num_endpoints; i++){
+	mmp_cmd_run(mmp_cmd_endpoints[i]);
+	queued |= mmp_cmd_endpoints[i]->queue_count;
+    }
+    return queued;
+}
+
+void mmp_cmd_init_queue(mmp_cmd_ctrl_t *ctrl, uint8_t *queue, uint8_t slot_size, uint8_t queue_len)
+{
+    ctrl->queue = queue;
+    ctrl->queue_slot_size = slot_size;
+    ctrl->queue_len = queue_len;
+    ctrl->queue_head = ctrl->queue_count = 0;
+}
+#endif
 
 void mmp_cmd_msg_handler(void *user_data, mmp_msg_t *msg)
 {
@@ -46,55 +188,122 @@ void mmp_cmd_msg_handler(void *user_data, mmp_msg_t *msg)
     mmp_cmd_ctrl_t *ctrl = (mmp_cmd_ctrl_t *)user_data;
 
     if (MMP_FLAGS_IS_CMD(msg->flags)){
+#ifdef MMP_V2
+	ctrl->async_flags = mmp_cmd_async_flags = msg->flags & (MMP_FLAGS_CRC | MMP_FLAGS_COBS);
+#endif
 	//mmp_print_mmp_msg_t(msg, __FILE__, __LINE__, "it's a cmd message");
 	// yup, it's a command-message that's been received.
-	if(msg->len >=1 ){
-	    // First byte of data is cmd, 
-	    uint8_t cmd = msg->data[0];
-	    if( cmd < ctrl->num_handlers ){
-		// valid command, call handler
-
-		// for the data that is sent in reply:
-		//   byte 0 is left as the command
-		//   byte 1 is for the status byte
-		//   byte 3 onwards are for the user reply data
-		// note that by writing to reply_data, data is overwritten
-		uint8_t reply_data_max_len = ctrl->mmp_ctrl.ctrl.data_max_len-2;
-		void *data=(msg->data)+1;
-		void *reply_data=(msg->data)+2;
-		// call the handler
-		//LOG_INFO_FP("%s:%i: data: %p, reply_data: %p",__FILE__,__LINE__, data, reply_data);
-		ctrl->cmd_handler_tab[cmd](ctrl, cmd, msg->len-1, reply_data_max_len, data,  reply_data);
-	    }else{
-		// invalid command, ie cmd number exceeds number of entries in cmd table
-		MMP_CMD_LOG_WARN("invalid command: %u", cmd);
+#ifdef MMP_CMD_QUEUED
+	if(ctrl->queue){
+	    // handler is called later, from mmp_cmd_run()
+	    mmp_cmd_enqueue(ctrl, msg);
+	    return;
+	}
+#endif
+	uint8_t *data = msg->data;
+#ifdef MMP_RX_IN_PLACE
+	if(mmp_msg_contig_len(msg) < msg->len){
+	    // command was parsed in place and wraps around end of circular buffer, copy it to msg_buf.
+	    if(msg->len > ctrl->msg_buf_size){
+		MMP_CMD_LOG_WARN("cmd too long: %u", msg->len);
+		return;
 	    }
-//	    mmp_send(msg->data, msg->len, msg->flags, ((mmp_cmd_ctrl_t *)user_data)->tx_byte_fn);
-	}else{
-	    // data length is invalid
+	    mmp_msg_copy(msg, 0, ctrl->msg_buf, msg->len);
+	    data = ctrl->msg_buf;
 	}
+#endif
+	mmp_cmd_dispatch(ctrl, msg->flags, data, msg->len);
     }else{
 	// received message wasn't a command-message
     }
 
 }
 
-void mmp_cmd_init(mmp_cmd_ctrl_t *ctrl, uint8_t* msg_buf, uint8_t msg_buf_size, 
+uint8_t mmp_cmd_max_len(mmp_cmd_ctrl_t *ctrl)
+{
+    uint8_t len = ctrl->mmp_ctrl.ctrl.data_max_len;
+#ifdef MMP_CMD_QUEUED
+    if(ctrl->queue && len > ctrl->queue_slot_size-2){
+	len = ctrl->queue_slot_size-2;
+    }
+#endif
+    return len;
+}
+
+void mmp_cmd_init(mmp_cmd_ctrl_t *ctrl, uint8_t* msg_buf, uint8_t msg_buf_size, uint8_t *reply_buf, uint8_t reply_buf_size,
 		  mmp_cmd_handler_t *cmd_handler_tab, uint8_t num_handlers,
 		  void (*tx_byte_fn)(const char c))
 {
     ctrl->tx_byte_fn = tx_byte_fn;
     ctrl->cmd_handler_tab = cmd_handler_tab;
     ctrl->num_handlers = num_handlers;
+    ctrl->reply_buf = reply_buf;
+    ctrl->reply_buf_size = reply_buf_size;
     mmp_init(&(ctrl->mmp_ctrl), msg_buf, msg_buf_size, mmp_cmd_msg_handler, ctrl);
+#ifdef MMP_CMD_QUEUED
+    ctrl->queue = NULL;
+#endif
+    mmp_cmd_register(ctrl);
 }
 
+#ifdef MMP_RX_IN_PLACE
+void mmp_cmd_init_ring(mmp_cmd_ctrl_t *ctrl, uint8_t* ring, uint8_t ring_size, uint8_t *msg_buf, uint8_t msg_buf_size,
+		       uint8_t *reply_buf, uint8_t reply_buf_size,
+		       mmp_cmd_handler_t *cmd_handler_tab, uint8_t num_handlers,
+		       void (*tx_byte_fn)(const char c))
+{
+    ctrl->tx_byte_fn = tx_byte_fn;
+    ctrl->cmd_handler_tab = cmd_handler_tab;
+    ctrl->num_handlers = num_handlers;
+    ctrl->msg_buf = msg_buf;
+    ctrl->msg_buf_size = msg_buf_size;
+    ctrl->reply_buf = reply_buf;
+    ctrl->reply_buf_size = reply_buf_size;
+#ifdef MMP_CMD_QUEUED
+    ctrl->queue = NULL;
+#endif
+    mmp_init_ring(&(ctrl->mmp_ctrl), ring, ring_size, mmp_cmd_msg_handler, ctrl);
+    mmp_cmd_register(ctrl);
+}
+
+inline uint8_t mmp_cmd_rx_ring(mmp_cmd_ctrl_t *mmp_cmd_ctrl, uint8_t tail)
+{
+    // just call corresponding mmp function.
+    return mmp_rx_ring(&(mmp_cmd_ctrl->mmp_ctrl), tail);
+}
+#endif
+
 void mmp_async_send(uint8_t *msg_data, uint8_t len, void (*tx_byte_fn)(const char c))
 {
+#ifdef MMP_V2
+    // framed as host's commands are
+    uint8_t flags=mmp_cmd_async_flags;
+#else
     uint8_t flags=0;
+#endif
     mmp_send(msg_data, len,  MMP_FLAGS_SET_ASYNC(flags), tx_byte_fn);
 }
 
+void mmp_cmd_async_send(mmp_cmd_ctrl_t *ctrl, uint8_t *msg_data, uint8_t len)
+{
+#ifdef MMP_V2
+    uint8_t flags=ctrl->async_flags;
+#else
+    uint8_t flags=0;
+#endif
+    mmp_send(msg_data, len,  MMP_FLAGS_SET_ASYNC(flags), ctrl->tx_byte_fn);
+}
+
+void mmp_cmd_async_publish(uint8_t *msg_data, uint8_t len)
+{
+    uint16_t bit = MMP_CMD_ASYNC_BIT(msg_data[0]);
+    for(uint8_t i=0; i < mmp_cmd_num_endpoints; i++){
+	if(mmp_cmd_endpoints[i]->async_mask & bit){
+	    mmp_cmd_async_send(mmp_cmd_endpoints[i], msg_data, len);
+	}
+    }
+}
+
 
 inline void mmp_cmd_rx_ch(mmp_cmd_ctrl_t *mmp_cmd_ctrl, uint8_t ch)
 {
@@ -103,8 +312,22 @@ inline void mmp_cmd_rx_ch(mmp_cmd_ctrl_t *mmp_cmd_ctrl, uint8_t ch)
 }
 
 
+inline void mmp_cmd_rx_buf(mmp_cmd_ctrl_t *mmp_cmd_ctrl, const uint8_t *buf, uint8_t len)
+{
+    // just call corresponding mmp function.
+    mmp_rx_buf(&(mmp_cmd_ctrl->mmp_ctrl), buf, len);
+}
+
+
 inline void mmp_cmd_tick(mmp_cmd_ctrl_t *mmp_cmd_ctrl)
 {
     // just call corresponding mmp function.
     mmp_tick(&(mmp_cmd_ctrl->mmp_ctrl));
 }
+
+void mmp_cmd_tick_all()
+{
+    for(uint8_t i=0; i < mmp_cmd_num_endpoints; i++){
+	mmp_cmd_tick(mmp_cmd_endpoints[i]);
+    }
+}
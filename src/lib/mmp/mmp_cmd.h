@@ -35,7 +35,40 @@
 #define MMP_CMD_LOGGING
 #endif
 
-//! type for message-handler callback functions
+//! Define MMP_CMD_QUEUE_LEN to have received commands queued, and their handlers called from mmp_cmd_run(),
+//! rather than from within the receive function. Up to MMP_CMD_QUEUE_LEN commands can be outstanding.
+#if defined(MMP_CMD_QUEUE_LEN) && !defined(BOOT) && !defined(BOOT_APP)
+#define MMP_CMD_QUEUED
+#ifndef MMP_CMD_QUEUE_SLOT_SIZE
+//! size of each queue slot: command length and flags, then the command.
+#define MMP_CMD_QUEUE_SLOT_SIZE 40
+#endif
+#endif
+
+#ifndef MMP_CMD_MAX_ENDPOINTS
+//! Max number of mmp_cmd endpoints, each on its own channel with its own parser state, buffers and tx function.
+//! Endpoints are registered by their init function, and receive async messages that they have subscribed to.
+#define MMP_CMD_MAX_ENDPOINTS 1
+#endif
+//! bit of an endpoint's async_mask for async messages whose first data byte is type, types above 14 share bit 15
+#define MMP_CMD_ASYNC_BIT(type) ((type) < 15 ? (uint16_t)1 << (type) : (uint16_t)0x8000)
+//! async_mask of an endpoint that receives all async messages, as it is initialised
+#define MMP_CMD_ASYNC_ALL 0xffff
+
+//! capability bit, as reported by the caps command: tagged commands are accepted, see MMP_FLAGS_BIT_TAG
+#define MMP_CAP_TAG 0x04
+#define MMP_CMD_CAPS MMP_CAP_TAG
+
+//! reply status: command was not run because the command queue was full, host should retry.
+#define MMP_CMD_STATUS_BUSY     0xff
+//! reply status: command was not run because it doesn't fit in a queue slot.
+#define MMP_CMD_STATUS_TOO_LONG 0xfe
+//! batch sub-reply status: sub-command's handler didn't reply, or there was no handler
+#define MMP_CMD_STATUS_NO_REPLY 0xfd
+
+//! type for message-handler callback functions.
+//! data is the command's data_len bytes, reply_data is where up to data_max_len bytes of reply are put before calling
+//! mmp_cmd_reply(). They don't overlap, and data may be overwritten by the next command once the handler returns.
 typedef  void (*mmp_cmd_handler_t)(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_max_len, uint8_t *data, uint8_t *reply_data);
 
 
@@ -49,22 +82,122 @@ typedef struct mmp_cmd_ctrl_t{
     mmp_cmd_handler_t *cmd_handler_tab;
     //! number of entries in cmd_handler_tab
     uint8_t num_handlers;
+#ifdef MMP_RX_IN_PLACE
+    //! buffer that commands parsed in place are copied to when they wrap around the end of the circular buffer
+    uint8_t *msg_buf;
+    //! size of msg_buf
+    uint8_t msg_buf_size;
+#endif
+    //! buffer in which reply messages are built, separate from received messages: [tag,] cmd, status, reply data
+    uint8_t *reply_buf;
+    //! size of reply_buf
+    uint8_t reply_buf_size;
+    //! flags the reply is sent with, those of the command
+    uint8_t reply_flags;
+    //! non-zero while cmd_batch() runs a sub-command, mmp_cmd_reply() then records the reply rather than sending it
+    uint8_t batch;
+    //! async messages this endpoint is sent by mmp_cmd_async_publish(), see MMP_CMD_ASYNC_BIT()
+    uint16_t async_mask;
+#ifdef MMP_V2
+    //! MMP_FLAGS_CRC and MMP_FLAGS_COBS bits of the last command received, so async messages are framed the same way
+    uint8_t async_flags;
+#endif
+#ifdef MMP_CMD_QUEUED
+    //! queue of received commands, queue_len slots of queue_slot_size bytes. NULL if commands aren't queued.
+    uint8_t *queue;
+    uint8_t queue_slot_size;
+    uint8_t queue_len;
+    //! index of oldest slot
+    uint8_t queue_head;
+    //! number of commands in queue
+    uint8_t queue_count;
+#endif
 }mmp_cmd_ctrl_t;
 
 
 /** 
- * Initialise the mmp_cmd system.
+ * Initialise the mmp_cmd system. Each endpoint, eg the uart and a second link to a supervisor, has its own
+ * control structure, initialised by calling this or mmp_cmd_init_ring(). Received chars are passed to
+ * the endpoint with mmp_cmd_rx_ch() or mmp_cmd_rx_buf().
  * 
  * @param ctrl Pointer to control-data structure.
- * @param msg_buf Buffer for received command-messages, and possibly for response messages.
+ * @param msg_buf Buffer for received command-messages.
  * @param msg_buf_size Maximum size of the msg_buf
+ * @param reply_buf Buffer for response messages.
+ * @param reply_buf_size Size of reply_buf.
  * @param cmd_handler_tab Pointer to table of command-handler callback functions.
  * @param num_handlers The number of command-handler callback functions in the command-handler table.
  * @param tx_byte_fn Pointer to the function that will be called to transmit each byte (character) of the response message.
  */
-void mmp_cmd_init(mmp_cmd_ctrl_t *ctrl, uint8_t* msg_buf, uint8_t msg_buf_size, 
+void mmp_cmd_init(mmp_cmd_ctrl_t *ctrl, uint8_t* msg_buf, uint8_t msg_buf_size, uint8_t *reply_buf, uint8_t reply_buf_size,
 		  mmp_cmd_handler_t *cmd_handler_tab, uint8_t num_handlers,
 		  void (*tx_byte_fn)(const char c));
+#ifdef MMP_RX_IN_PLACE
+/** 
+ * Initialise the mmp_cmd system to parse command-messages in place in a circular buffer, eg the uart's rx buffer.
+ * See mmp_init_ring(). Command data is passed to the command handler without being copied, unless it wraps 
+ * around the end of the circular buffer, in which case it's copied to msg_buf. 
+ * 
+ * @param ctrl Pointer to control-data structure.
+ * @param ring The circular buffer, size must be a power of two.
+ * @param ring_size Size of the circular buffer.
+ * @param msg_buf Buffer for commands that wrap around the end of the circular buffer. May be NULL if commands are queued.
+ * @param msg_buf_size Size of msg_buf.
+ * @param reply_buf Buffer for response messages.
+ * @param reply_buf_size Size of reply_buf.
+ * @param cmd_handler_tab Pointer to table of command-handler callback functions.
+ * @param num_handlers The number of command-handler callback functions in the command-handler table.
+ * @param tx_byte_fn Pointer to the function that will be called to transmit each byte (character) of the response message.
+ */
+void mmp_cmd_init_ring(mmp_cmd_ctrl_t *ctrl, uint8_t* ring, uint8_t ring_size, uint8_t *msg_buf, uint8_t msg_buf_size,
+		       uint8_t *reply_buf, uint8_t reply_buf_size,
+		       mmp_cmd_handler_t *cmd_handler_tab, uint8_t num_handlers,
+		       void (*tx_byte_fn)(const char c));
+
+/** 
+ * Parse command-messages that have been added to the circular buffer, see mmp_rx_ring()
+ * 
+ * @param mmp_cmd_ctrl Pointer to the mmp_cmd_ctrl_t structure.
+ * @param tail Free running count of chars that have been added to the circular buffer.
+ * @return Free running count of chars up to which the circular buffer may be released.
+ */
+uint8_t mmp_cmd_rx_ring(mmp_cmd_ctrl_t *mmp_cmd_ctrl, uint8_t tail);
+#endif
+
+#ifdef MMP_CMD_QUEUED
+/** 
+ * Queue received command-messages, rather than calling their handlers as they are received. 
+ * Call after mmp_cmd_init() or mmp_cmd_init_ring(). When the queue is full, commands are replied to with
+ * status MMP_CMD_STATUS_BUSY.
+ * 
+ * @param ctrl Pointer to control-data structure.
+ * @param queue Buffer of slot_size * queue_len bytes.
+ * @param slot_size Size of each slot, commands longer than slot_size-2 can not be handled.
+ * @param queue_len Number of slots.
+ */
+void mmp_cmd_init_queue(mmp_cmd_ctrl_t *ctrl, uint8_t *queue, uint8_t slot_size, uint8_t queue_len);
+
+/** 
+ * Call the handler of the oldest queued command, if there is one. Should be called from the main loop.
+ * 
+ * @param ctrl Pointer to the mmp_cmd_ctrl_t structure.
+ */
+void mmp_cmd_run(mmp_cmd_ctrl_t *ctrl);
+
+//! Call mmp_cmd_run() for each endpoint.
+//! @return Non-zero if any endpoint has commands still queued.
+uint8_t mmp_cmd_run_all();
+#endif
+
+/** 
+ * The longest command message that an endpoint can receive: the parser's buffer, or its queue's slots if
+ * commands are queued. Longer commands are dropped by the parser, or replied to with MMP_CMD_STATUS_TOO_LONG.
+ * 
+ * @param ctrl Pointer to the endpoint's mmp_cmd_ctrl_t structure.
+ * @return Max message length, ie of [tag,] cmd and command data.
+ */
+uint8_t mmp_cmd_max_len(mmp_cmd_ctrl_t *ctrl);
+
 //! Macro calculates number of entries in the passed msg_tab (which is an array of mmp_cmd_handler_t)
 #define CMD_TAB_NUM_ENTRIES(msg_tab) (sizeof(msg_tab) / sizeof(mmp_cmd_handler_t))
 
@@ -90,6 +223,23 @@ void mmp_cmd_reply(void *handle, uint8_t status, uint8_t data_len);
  */
 void mmp_async_send(uint8_t *msg_data, uint8_t len, void (*tx_byte_fn)(const char c));
 
+/** 
+ * Send an async message to an endpoint, framed as the last command it received was.
+ * 
+ * @param ctrl Pointer to the endpoint's mmp_cmd_ctrl_t structure.
+ * @param msg_data Pointer to the message's data.
+ * @param len Length of the message's data.
+ */
+void mmp_cmd_async_send(mmp_cmd_ctrl_t *ctrl, uint8_t *msg_data, uint8_t len);
+
+/** 
+ * Send an async message to each endpoint that has subscribed to its type, ie the first data byte.
+ * 
+ * @param msg_data Pointer to the message's data.
+ * @param len Length of the message's data, must be at least 1.
+ */
+void mmp_cmd_async_publish(uint8_t *msg_data, uint8_t len);
+
 
 /** 
  * Called to pass a character (byte) that has been received on the communication channel onto the mmp_cmd system.
@@ -99,6 +249,16 @@ void mmp_async_send(uint8_t *msg_data, uint8_t len, void (*tx_byte_fn)(const cha
  */
 void mmp_cmd_rx_ch(mmp_cmd_ctrl_t *mmp_cmd_ctrl, uint8_t ch);
 
+/** 
+ * Called to pass a run of characters (bytes) that have been received on the communication channel onto the mmp_cmd system.
+ * See mmp_rx_buf()
+ * 
+ * @param msg_cmd_ctrl Pointer to the mmp_cmd_ctrl_t structure.
+ * @param buf The characters that have been received.
+ * @param len The number of characters.
+ */
+void mmp_cmd_rx_buf(mmp_cmd_ctrl_t *mmp_cmd_ctrl, const uint8_t *buf, uint8_t len);
+
 /** 
  * Should be called periodically so message reception timeouts can be detected.
  * Default implementation calls this at about 1000Hz
@@ -106,6 +266,9 @@ void mmp_cmd_rx_ch(mmp_cmd_ctrl_t *mmp_cmd_ctrl, uint8_t ch);
  */
 void mmp_cmd_tick(mmp_cmd_ctrl_t *mmp_cmd_ctrl);
 
+//! Call mmp_cmd_tick() for each endpoint.
+void mmp_cmd_tick_all();
+
 #if 0
 // XXX internal function, declaration not required here.
 void mmp_cmd_msg_handler(void *user_data, mmp_msg_t *msg);
@@ -0,0 +1,142 @@
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+#include "mmp_txq.h"
+#include "mmp_cmd.h"
+#include <string.h>
+
+//! index of no block
+#define MMP_TXQ_NONE 0xff
+
+typedef struct {
+    //! next block in list
+    uint8_t next;
+    uint8_t len;
+    uint8_t data[MMP_TXQ_BLOCK_SIZE];
+} mmp_txq_block_t;
+
+static struct {
+    mmp_txq_block_t pool[MMP_TXQ_BLOCKS];
+    //! list of free blocks
+    uint8_t free;
+    uint8_t num_free;
+    //! list of queued blocks of each priority, oldest first
+    uint8_t head[MMP_TXQ_NUM_PRIO];
+    uint8_t tail[MMP_TXQ_NUM_PRIO];
+    uint8_t (*tx_free_fn)();
+    mmp_txq_stats_t stats;
+} mmp_txq;
+
+
+void mmp_txq_init(uint8_t (*tx_free_fn)())
+{
+    memset(&mmp_txq, 0, sizeof(mmp_txq));
+    for(uint8_t i=0; i < MMP_TXQ_BLOCKS; i++){
+	mmp_txq.pool[i].next = i+1 < MMP_TXQ_BLOCKS ? i+1 : MMP_TXQ_NONE;
+    }
+    mmp_txq.num_free = MMP_TXQ_BLOCKS;
+    memset(mmp_txq.head, MMP_TXQ_NONE, MMP_TXQ_NUM_PRIO);
+    mmp_txq.tx_free_fn = tx_free_fn;
+}
+
+//! remove and return oldest block of priority prio, there must be one
+static uint8_t mmp_txq_pop(uint8_t prio)
+{
+    uint8_t b = mmp_txq.head[prio];
+    mmp_txq.head[prio] = mmp_txq.pool[b].next;
+    return b;
+}
+
+//! return block b to the free list
+static void mmp_txq_free(uint8_t b)
+{
+    mmp_txq.pool[b].next = mmp_txq.free;
+    mmp_txq.free = b;
+    mmp_txq.num_free++;
+}
+
+
+uint8_t mmp_txq_send(uint8_t prio, const uint8_t *data, uint8_t len)
+{
+    uint8_t coalesce = prio & MMP_TXQ_COALESCE;
+    prio &=~ MMP_TXQ_COALESCE;
+    if(len > MMP_TXQ_BLOCK_SIZE || prio >= MMP_TXQ_NUM_PRIO){
+	mmp_txq.stats.dropped[prio < MMP_TXQ_NUM_PRIO ? prio : MMP_TXQ_NUM_PRIO-1]++;
+	return MMP_TXQ_DROPPED;
+    }
+    uint8_t b;
+    if(coalesce && len){
+	// replace queued message of same type
+	for(b = mmp_txq.head[prio]; b != MMP_TXQ_NONE; b = mmp_txq.pool[b].next){
+	    if(mmp_txq.pool[b].data[0] == data[0]){
+		memcpy(mmp_txq.pool[b].data, data, len);
+		mmp_txq.pool[b].len = len;
+		mmp_txq.stats.coalesced++;
+		return MMP_TXQ_MERGED;
+	    }
+	}
+    }
+    if(mmp_txq.num_free > prio){
+	// each priority leaves a block for each of those above it
+	b = mmp_txq.free;
+	mmp_txq.free = mmp_txq.pool[b].next;
+	mmp_txq.num_free--;
+	uint8_t used = MMP_TXQ_BLOCKS - mmp_txq.num_free;
+	if(used > mmp_txq.stats.high_water){
+	    mmp_txq.stats.high_water = used;
+	}
+    }else{
+	// take the oldest of the lowest priority that is below this one
+	uint8_t p = MMP_TXQ_NUM_PRIO-1;
+	while(p > prio && mmp_txq.head[p] == MMP_TXQ_NONE){
+	    p--;
+	}
+	if(p == prio){
+	    mmp_txq.stats.dropped[prio]++;
+	    return MMP_TXQ_DROPPED;
+	}
+	b = mmp_txq_pop(p);
+	mmp_txq.stats.dropped[p]++;
+    }
+    memcpy(mmp_txq.pool[b].data, data, len);
+    mmp_txq.pool[b].len = len;
+    mmp_txq.pool[b].next = MMP_TXQ_NONE;
+    // append to its list
+    if(mmp_txq.head[prio] == MMP_TXQ_NONE){
+	mmp_txq.head[prio] = b;
+    }else{
+	mmp_txq.pool[mmp_txq.tail[prio]].next = b;
+    }
+    mmp_txq.tail[prio] = b;
+    return MMP_TXQ_OK;
+}
+
+
+uint8_t mmp_txq_run()
+{
+    uint8_t prio=0;
+    while(prio < MMP_TXQ_NUM_PRIO){
+	uint8_t b = mmp_txq.head[prio];
+	if(b == MMP_TXQ_NONE){
+	    prio++;
+	    continue;
+	}
+	if(mmp_txq.tx_free_fn && mmp_txq.tx_free_fn() < mmp_txq.pool[b].len + MMP_FRAME_OVERHEAD){
+	    // wait for room, rather than block
+	    break;
+	}
+	mmp_txq_pop(prio);
+	mmp_cmd_async_publish(mmp_txq.pool[b].data, mmp_txq.pool[b].len);
+	mmp_txq_free(b);
+    }
+    return MMP_TXQ_BLOCKS - mmp_txq.num_free;
+}
+
+
+void mmp_txq_read_stats(mmp_txq_stats_t *stats, uint8_t reset)
+{
+    *stats = mmp_txq.stats;
+    if(reset){
+	memset(&mmp_txq.stats, 0, sizeof(mmp_txq_stats_t));
+    }
+}
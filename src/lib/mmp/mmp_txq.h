@@ -0,0 +1,95 @@
+#ifndef _MMP_TXQ_H
+#define _MMP_TXQ_H 1
+// -----------------------------------------------------------------------------
+// Copyright Stephen Stebbing 2023. http://telecnatron.com/
+// -----------------------------------------------------------------------------
+/**
+ * @file   mmp_txq.h
+ *
+ * @brief  Prioritised queue of outbound async messages, held in a static pool of fixed size blocks.
+ *
+ * Rather than calling mmp_async_send(), which blocks until the message is in the uart's tx buffer, tasks
+ * queue messages with mmp_txq_send() and a task calls mmp_txq_run(), which sends them, highest priority
+ * first, as there is room in the tx buffer. They are sent to each endpoint that has subscribed to them,
+ * see mmp_cmd_async_publish().
+ * Command replies aren't queued: they are sent as soon as the handler has built them, ahead of anything queued.
+ *
+ * When the pool runs low, lower priority messages are refused first: each priority leaves a block
+ * for each priority above it. High priority messages that still can't get a block take the oldest lowest priority one.
+ * Telemetry that is sent with MMP_TXQ_COALESCE replaces a queued message of the same type, rather than
+ * taking another block, so that host gets the latest. Refused, displaced and coalesced messages are counted.
+ */
+#include "config.h"
+#include <stdint.h>
+
+#ifndef MMP_TXQ_BLOCKS
+//! number of blocks in the pool
+#define MMP_TXQ_BLOCKS 6
+#endif
+#ifndef MMP_TXQ_BLOCK_SIZE
+//! max message length
+#define MMP_TXQ_BLOCK_SIZE 24
+#endif
+
+// priorities, lower number is sent first
+//! fault and state change events
+#define MMP_TXQ_PRIO_HIGH      0
+//! telemetry
+#define MMP_TXQ_PRIO_TELEMETRY 1
+//! log messages
+#define MMP_TXQ_PRIO_LOG       2
+#define MMP_TXQ_NUM_PRIO       3
+//! or with priority to have message replace a queued message of the same priority and type (first data byte)
+#define MMP_TXQ_COALESCE       0x80
+
+// mmp_txq_send() return values
+#define MMP_TXQ_OK      0
+//! message was coalesced with a queued one
+#define MMP_TXQ_MERGED  1
+//! message was dropped
+#define MMP_TXQ_DROPPED 2
+
+//! queue statistics
+typedef struct {
+    //! messages of each priority that were refused, or displaced by higher priority messages
+    uint16_t dropped[MMP_TXQ_NUM_PRIO];
+    //! messages that replaced a queued message
+    uint16_t coalesced;
+    //! max number of blocks that have been in use
+    uint8_t high_water;
+} mmp_txq_stats_t;
+
+/**
+ * Initialise the queue.
+ *
+ * @param tx_free_fn Function that returns the amount of free space in the tx buffer, or NULL to send regardless.
+ */
+void mmp_txq_init(uint8_t (*tx_free_fn)());
+
+/**
+ * Queue an async message.
+ *
+ * @param prio One of the MMP_TXQ_PRIO_xxx values, optionally or'ed with MMP_TXQ_COALESCE.
+ * @param data The message's data, it is copied.
+ * @param len Length of data, at most MMP_TXQ_BLOCK_SIZE.
+ * @return MMP_TXQ_OK, MMP_TXQ_MERGED or MMP_TXQ_DROPPED.
+ */
+uint8_t mmp_txq_send(uint8_t prio, const uint8_t *data, uint8_t len);
+
+/**
+ * Send queued messages, highest priority first, while there is room for them in the tx buffer.
+ * Should be called from a task.
+ *
+ * @return Number of messages that are still queued.
+ */
+uint8_t mmp_txq_run();
+
+/**
+ * Read the queue statistics.
+ *
+ * @param stats Where they are copied to.
+ * @param reset Non-zero to zero the counters after reading them.
+ */
+void mmp_txq_read_stats(mmp_txq_stats_t *stats, uint8_t reset);
+
+#endif /* _MMP_TXQ_H */
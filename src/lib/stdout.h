@@ -20,6 +20,7 @@
  * 
  * @brief  This include file eases setup of stdout stream for use of printf type functions.
  * It uses  macro PUTC(c) to output a characer- it must have been defined prior to including this file.
+ * When uart TX is buffered (UART_TX_BUFFERED), PUTC() queues the character and returns without waiting.
  */
 
 #include <stdio.h>
@@ -15,6 +15,7 @@
 // -----------------------------------------------------------------------------   
 #include "sysclk.h"
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 
 // tick count
 uint16_t sysclk_ticks;
@@ -23,7 +24,7 @@ uint32_t sysclk_seconds;
 // seconds since boot
 uint32_t sysclk_seconds_count;
 // flag to indicated that clk has ticked since last call to sysclk_has_ticked()
-uint8_t sysclk_ticked;
+volatile uint8_t sysclk_ticked;
 // flag to indicated that seconds haveticked since last call to sysclk_have_seconds_ticked()
 uint8_t sysclk_seconds_ticked;
 //!
@@ -121,6 +122,25 @@ inline void sysclk_reset_seconds()
     sysclk_seconds=0;
 }
 
+uint32_t sysclk_get_time(uint8_t *count)
+{
+    uint32_t ticks;
+    uint8_t c;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+	c = SYSCLK_COUNT();
+	ticks = sysclk_seconds_count * sysclk_tick_freq + sysclk_ticks;
+	if(SYSCLK_TICK_PENDING()){
+	    // timer has wrapped but its ISR hasn't been run, count may have been read before or after the wrap
+	    c = SYSCLK_COUNT();
+	    ticks++;
+	}
+    }
+    if(count){
+	*count = c;
+    }
+    return ticks;
+}
+
 
 ISR(SYSCLK_ISR_NAME)
 {
@@ -43,6 +43,11 @@
 #define SYSCLK_START()       T2_START();
 #define SYSCLK_STOP()        T2_STOP();
 #define SYSCLK_ISR_NAME      TIMER2_COMPA_vect
+//! timer's count, and the count at which it's cleared, ie there are SYSCLK_TOP()+1 counts per tick
+#define SYSCLK_COUNT()       TCNT2
+#define SYSCLK_TOP()         OCR2A
+//! non-zero if timer has reached its top and the ISR hasn't yet been run
+#define SYSCLK_TICK_PENDING() (TIFR2 & _BV(OCF2A))
 
 #ifndef SYSCLK_DEFS
 #define SYSCLK_DEFS
@@ -73,6 +78,9 @@ void sysclk_reset();
 //! Return the current tick count
 uint16_t sysclk_get_ticks();
 
+//! set by the ISR on each tick, cleared by sysclk_has_ticked(). Read directly by idle_sleep().
+extern volatile uint8_t sysclk_ticked;
+
 //! Return true if a tick has occured since prior call, false otherwise.
 uint8_t sysclk_has_ticked();
 
@@ -97,6 +105,14 @@ uint8_t sysclk_have_seconds_ticked();
 //! Reset the seconds count to 0
 void sysclk_reset_seconds();
 
+/** 
+ * Return the time since boot, to a timer count: ticks, and the count of the timer within the current tick.
+ * Differences between times are good for as long as the tick frequency isn't changed.
+ * @param count Where the timer count, 0 to SYSCLK_TOP(), is put. May be NULL.
+ * @return Number of ticks since boot.
+ */
+uint32_t sysclk_get_time(uint8_t *count);
+
 
 #endif /* _SYSCLK_H */
 
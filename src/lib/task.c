@@ -15,6 +15,10 @@
 // -----------------------------------------------------------------------------   
 #include "task.h"
 #include "lib/util/io.h"
+#ifdef TASK_STATS
+#include <string.h>
+#include "sysclk.h"
+#endif
 
 
 #ifdef TASK_LOGGING
@@ -34,40 +38,55 @@ typedef struct {
     uint32_t seconds_alarm;
     // user data gets passed to task function when it is called.
     void *user_data;
+    // task number + 1 of next and previous tasks in the same timer wheel slot, 0 if none
+    uint8_t wheel_next;
+    uint8_t wheel_prev;
+#ifdef TASK_STATS
+    // sysclk tick, low 16 bits, at which tick alarm is due
+    uint16_t due;
+    task_stats_t stats;
+#endif
 } task_t;
 
 
 typedef struct {
     // task table
     task_t task_tab[TASK_NUM_TASKS];
+    // bit n is set if task n is ready to be run
+    task_mask_t ready;
     // task num (index into task_tab) of currently running task
     uint8_t task_num;
     // current tick
     uint16_t tick_count;
     // current second
     uint32_t seconds_count;
-    // tick at which next task alarm will expire
-    uint16_t tick_wake;
     // number of tasks that are waiting on a tick alarm
     uint8_t task_alarm_count;
+    // timer wheel: task number + 1 of first task whose tick alarm falls in slot (tick_alarm % TASK_WHEEL_SIZE), 0 if none
+    uint8_t wheel[TASK_WHEEL_SIZE];
 } task_ctrl_t;
 
 
 // defines for task_t.flags bits:
-// if this bit is set then task is ready to be run
-#define TASK_FLAGS_READY      0x1
 // if this bit is set then task is waiting for a tick alarm
 #define TASK_FLAGS_TICK_ALARM 0x2
 // if this bit is set then task is waiting for seconds alarm
 #define TASK_FLAGS_SECONDS_ALARM 0x4
+// if this bit is set then task's tick alarm was set and not cancelled, its lateness is recorded when it's next run.
+// (these are bit numbers, for BIT_HI() etc)
+#define TASK_FLAGS_DUE 5
 
 // global control structure
 static task_ctrl_t task_ctrl;
 
+// tasks posted by interrupt handlers, see task_num_post()
+volatile uint8_t task_pending[TASK_NUM_TASKS];
+volatile uint8_t task_posted;
+
 // convenience macros
-#define TASK_READY(task_p)    BIT_HI(task_p->flags, TASK_FLAGS_READY)
-#define TASK_UNREADY(task_p)  BIT_LO(task_p->flags, TASK_FLAGS_READY)
-#define TASK_IS_READY(task_p) BIT_IS_SET(task_p->flags, TASK_FLAGS_READY )
+#define TASK_BIT(task_num)      ((task_mask_t)1 << (task_num))
+#define TASK_READY(task_num)    (task_ctrl.ready |= TASK_BIT(task_num))
+#define TASK_UNREADY(task_num)  (task_ctrl.ready &= ~TASK_BIT(task_num))
 
 #define TASK_IS_ALARM_TICK(task_p)     BIT_IS_SET(task_p->flags, TASK_FLAGS_TICK_ALARM )
 #define TASK_SET_TICK_ALARM(task_p)    BIT_HI(task_p->flags, TASK_FLAGS_TICK_ALARM)
@@ -77,26 +96,92 @@ static task_ctrl_t task_ctrl;
 #define TASK_SET_SECONDS_ALARM(task_p)    BIT_HI(task_p->flags, TASK_FLAGS_SECONDS_ALARM)
 #define TASK_UNSET_SECONDS_ALARM(task_p)  BIT_LO(task_p->flags, TASK_FLAGS_SECONDS_ALARM)
 
-// calculate tick of alarm to expire soonest, set task_ctrl.tick_wake to that value.
-void task_set_tick_wake()
+#ifdef TASK_STATS
+// return time since sysclk time (ticks, count), in sysclk timer counts, UINT16_MAX if it doesn't fit.
+static uint16_t task_stats_since(uint32_t ticks, uint8_t count)
+{
+    uint8_t now_count;
+    uint32_t t = (sysclk_get_time(&now_count) - ticks) * (SYSCLK_TOP() + 1) + now_count - count;
+    return t > UINT16_MAX ? UINT16_MAX : t;
+}
+
+static void task_stats_reset(task_t *task)
 {
-    if(task_ctrl.task_alarm_count){
-	// calculate when the next task alarm will expire
-	task_t *task = task_ctrl.task_tab;
-	
-	uint16_t ticks_away = UINT16_MAX;
-	for (uint8_t i=0; i < TASK_NUM_TASKS;  i++, task++){
-	    if (TASK_IS_ALARM_TICK(task) ){
-		uint16_t task_ticks_away = task->tick_alarm - task_ctrl.tick_count;
-		if (task_ticks_away < ticks_away){
-		    ticks_away = task_ticks_away;
-		}
+    memset(&(task->stats), 0, sizeof(task_stats_t));
+    task->stats.min = UINT16_MAX;
+}
+
+// task is about to be run: return time now, and record how late it is if it was woken by its tick alarm
+static void task_stats_start(task_t *task, uint32_t *ticks, uint8_t *count)
+{
+    *ticks = sysclk_get_time(count);
+    if( BIT_IS_SET(task->flags, TASK_FLAGS_DUE)){
+	BIT_LO(task->flags, TASK_FLAGS_DUE);
+	// alarm was due at the start of tick 'due'
+	int16_t late_ticks = (uint16_t)*ticks - task->due;
+	if(late_ticks >= 0){
+	    uint32_t late = (uint32_t)late_ticks * (SYSCLK_TOP() + 1) + *count;
+	    if(late > task->stats.late_max){
+		task->stats.late_max = late > UINT16_MAX ? UINT16_MAX : late;
 	    }
 	}
-	task_ctrl.tick_wake = task_ctrl.tick_count + ticks_away;
     }
 }
 
+// task that was started at sysclk time (ticks, count) has returned: record its run time
+static void task_stats_end(task_t *task, uint32_t ticks, uint8_t count)
+{
+    uint16_t t = task_stats_since(ticks, count);
+    task_stats_t *s = &(task->stats);
+    if(s->runs != UINT32_MAX){
+	s->runs++;
+    }
+    s->total = (s->total > UINT32_MAX - t) ? UINT32_MAX : s->total + t;
+    if(t < s->min){
+	s->min = t;
+    }
+    if(t > s->max){
+	s->max = t;
+    }
+}
+
+void task_stats_read(uint8_t task_num, task_stats_t *stats, uint8_t reset)
+{
+    task_t *task = &(task_ctrl.task_tab[task_num]);
+    memcpy(stats, &(task->stats), sizeof(task_stats_t));
+    if(reset){
+	task_stats_reset(task);
+    }
+}
+#endif
+
+#define TASK_WHEEL_SLOT(tick) (task_ctrl.wheel[(tick) & (TASK_WHEEL_SIZE-1)])
+
+// add task to the wheel slot of its tick alarm
+static void task_wheel_add(uint8_t task_num)
+{
+    task_t *task = &(task_ctrl.task_tab[task_num]);
+    uint8_t *slot = &TASK_WHEEL_SLOT(task->tick_alarm);
+    task->wheel_prev = 0;
+    task->wheel_next = *slot;
+    if(*slot){
+	task_ctrl.task_tab[*slot - 1].wheel_prev = task_num + 1;
+    }
+    *slot = task_num + 1;
+}
+
+// remove task from the wheel slot of its tick alarm
+static void task_wheel_remove(task_t *task)
+{
+    if(task->wheel_next){
+	task_ctrl.task_tab[task->wheel_next - 1].wheel_prev = task->wheel_prev;
+    }
+    if(task->wheel_prev){
+	task_ctrl.task_tab[task->wheel_prev - 1].wheel_next = task->wheel_next;
+    }else{
+	TASK_WHEEL_SLOT(task->tick_alarm) = task->wheel_next;
+    }
+}
 
 
 void task_num_set_callback(uint8_t task_num, void (* callback)(void *data))
@@ -128,12 +213,18 @@ void *task_num_get_user_data(uint8_t task_num)
 void task_init(uint8_t task_num, void(*task_callback)(void *data), void *data, uint8_t run)
 {
     task_t *task = &(task_ctrl.task_tab[task_num]);
+    task_num_cancel_tick_timer(task_num);
     task->flags = 0;
+#ifdef TASK_STATS
+    task_stats_reset(task);
+#endif
     task->task= task_callback;
     task->user_data = data;
     //  make task ready (runnable) according to 'run' parameter
     if(run){
-	TASK_READY(task);
+	TASK_READY(task_num);
+    }else{
+	TASK_UNREADY(task_num);
     }
 }
 
@@ -145,14 +236,11 @@ void task_num_ready(uint8_t task_num, uint8_t ready)
     task_num_cancel_tick_timer(task_num);
     if (ready){
 	TASK_LOG_DEBUG("%s:%u: ready %u",__FILE__,__LINE__,task_ctrl.tick_count, task_num);
-	TASK_READY(task);
+	TASK_READY(task_num);
     }else{
-	TASK_UNREADY(task);
+	TASK_UNREADY(task_num);
 	TASK_LOG_DEBUG("%s:%u: unready %u",__FILE__,__LINE__,task_ctrl.tick_count, task_num);
     }
-    // figure out next alarm to expire
-    // XXX this is done in task_num_cancel_tick_timer();
-//  task_set_tick_wake();
 }
 
 void task_ready(uint8_t ready)
@@ -166,28 +254,33 @@ void task_num_cancel_tick_timer(uint8_t task_num)
     if( TASK_IS_ALARM_TICK(task)){
 	// yup, alarm was set
 	TASK_UNSET_TICK_ALARM(task);
+#ifdef TASK_STATS
+	BIT_LO(task->flags, TASK_FLAGS_DUE);
+#endif
+	task_wheel_remove(task);
 	task_ctrl.task_alarm_count--;
 	TASK_LOG_DEBUG("%s:%u: cancelled tick timer: %u",__FILE__,__LINE__, task_num);
-	// figure out next alarm to expire
-	task_set_tick_wake();
-
     }
 }
 
 void task_num_set_tick_timer(uint8_t task_num, uint16_t ticks)
 {
     task_t *task = &(task_ctrl.task_tab[task_num]);
-    TASK_UNREADY(task);
+    // an alarm that is already set is replaced
+    task_num_cancel_tick_timer(task_num);
+    TASK_UNREADY(task_num);
     // set flag to indicate task is waiting on timer
     TASK_SET_TICK_ALARM(task);
     // set the tick_count at which timer expires
     task->tick_alarm = task_ctrl.tick_count + ticks;
+    task_wheel_add(task_num);
+#ifdef TASK_STATS
+    task->due = sysclk_get_time(NULL) + ticks;
+    BIT_HI(task->flags, TASK_FLAGS_DUE);
+#endif
     // increment count of task that are waiting on an alarm
     task_ctrl.task_alarm_count++;
-
-    // figure out next alarm to expire
-    task_set_tick_wake();
-    TASK_LOG_DEBUG("%s:%u:%u %u wake at %u ticks, next wake: %u ticks",__FILE__,__LINE__,task_ctrl.tick_count, task_num, task->tick_alarm, task_ctrl.tick_wake);
+    TASK_LOG_DEBUG("%s:%u:%u %u wake at %u ticks",__FILE__,__LINE__,task_ctrl.tick_count, task_num, task->tick_alarm);
 
 }
 
@@ -200,7 +293,7 @@ void task_num_set_seconds_timer(uint8_t task_num, uint16_t seconds)
 {
     task_t *task = &(task_ctrl.task_tab[task_num]);
     TASK_SET_SECONDS_ALARM(task);
-    TASK_UNREADY(task);
+    TASK_UNREADY(task_num);
     task->seconds_alarm  = task_ctrl.seconds_count + seconds;
 }
 
@@ -209,41 +302,84 @@ void task_set_seconds_timer(uint16_t seconds)
     task_num_set_seconds_timer(task_ctrl.task_num, seconds);
 }
 
-void task_run()
+// make the tasks that have been posted since last called ready, return mask of them.
+// Interrupts aren't disabled: an interrupt handler only ever sets the flags, task_posted is cleared before the
+// task_pending[] that it covers, and a task that is posted again after its flag is read has not yet been run.
+static task_mask_t task_take_posted()
 {
-    // loop thru all tasks,
-    task_t *task = task_ctrl.task_tab;
-    for (uint8_t i=0; i< TASK_NUM_TASKS; i++, task++) {
-	// check if task is ready to be run
-	if (TASK_IS_READY(task)){
-	    // yup it's ready, call it
-	    task_ctrl.task_num = i;
-	    TASK_LOG_DEBUG("%s:%u:%u running %u",__FILE__,__LINE__,task_ctrl.tick_count, i );
-	    task->task(task->user_data);
+    task_mask_t posted = 0;
+    if(task_posted){
+	task_posted = 0;
+	for (uint8_t i=0; i < TASK_NUM_TASKS; i++){
+	    if(task_pending[i]){
+		task_pending[i] = 0;
+		posted |= TASK_BIT(i);
+		task_num_ready(i, 1);
+	    }
 	}
     }
+    return posted;
+}
+
+// run ready tasks that are in mask, or that are posted while they run, once each, highest priority first.
+static void task_run_mask(task_mask_t mask)
+{
+    // tasks that have been run by this call
+    task_mask_t run = 0;
+    task_mask_t ready;
+    // look again after each task returns: it, or an interrupt, may have made a higher priority task ready
+    for(;;){
+	mask |= task_take_posted();
+	ready = task_ctrl.ready & mask & ~run;
+	if(!ready){
+	    break;
+	}
+	// lowest numbered ready task is highest priority
+	uint8_t i = TASK_MASK_CTZ(ready);
+	task_t *task = &(task_ctrl.task_tab[i]);
+	run |= TASK_BIT(i);
+	task_ctrl.task_num = i;
+	TASK_LOG_DEBUG("%s:%u:%u running %u",__FILE__,__LINE__,task_ctrl.tick_count, i );
+#ifdef TASK_STATS
+	uint32_t ticks;
+	uint8_t count;
+	task_stats_start(task, &ticks, &count);
+	task->task(task->user_data);
+	task_stats_end(task, ticks, count);
+#else
+	task->task(task->user_data);
+#endif
+    }
+}
+
+void task_run()
+{
+    task_run_mask(~(task_mask_t)0);
+}
+
+void task_run_posted()
+{
+    task_run_mask(0);
 }
 
 void task_tick()
 {
     task_ctrl.tick_count ++;
-    if(task_ctrl.task_alarm_count && task_ctrl.tick_count == task_ctrl.tick_wake){
-	// a task alarm has expired.
-	task_t *task = task_ctrl.task_tab;
-	// loop thru tasks.
-	for (uint8_t i=0; i < TASK_NUM_TASKS;  i++, task++){
-	    if( TASK_IS_ALARM_TICK(task) ){
-		// only interested in tasks with tick alarm set
-		if ( task->tick_alarm == task_ctrl.tick_count){
-		    // alarm has expired, make task ready
-		    TASK_READY(task);
-		    TASK_UNSET_TICK_ALARM(task);
-		    task_ctrl.task_alarm_count--;
-	    	    TASK_LOG_DEBUG("%s:%u:%u ready on tick alarm: %u",__FILE__,__LINE__,task_ctrl.tick_count, i );
-		}
-	    }
+    // only tasks in this tick's wheel slot can have alarms that expire now, the others in the slot
+    // expire a multiple of TASK_WHEEL_SIZE ticks later.
+    uint8_t n = TASK_WHEEL_SLOT(task_ctrl.tick_count);
+    while(n){
+	task_t *task = &(task_ctrl.task_tab[n - 1]);
+	uint8_t next = task->wheel_next;
+	if ( task->tick_alarm == task_ctrl.tick_count){
+	    // alarm has expired, make task ready
+	    task_wheel_remove(task);
+	    TASK_READY(n - 1);
+	    TASK_UNSET_TICK_ALARM(task);
+	    task_ctrl.task_alarm_count--;
+	    TASK_LOG_DEBUG("%s:%u:%u ready on tick alarm: %u",__FILE__,__LINE__,task_ctrl.tick_count, n - 1 );
 	}
-	task_set_tick_wake();
+	n = next;
     }
 }
 
@@ -256,7 +392,7 @@ void task_seconds_tick()
 	if(TASK_IS_ALARM_SECONDS(task) && task->seconds_alarm == task_ctrl.seconds_count){
 	    // make task ready to run
 	    TASK_LOG_DEBUG("%s:%u:%u ready on seconds alarm: %u",__FILE__,__LINE__,task_ctrl.tick_count, i );
-	    TASK_READY(task);
+	    TASK_READY(i);
 	    TASK_UNSET_SECONDS_ALARM(task);
 	}
     }
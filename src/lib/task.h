@@ -37,6 +37,59 @@
 #error "TASK_NUM_TASKS is not defined."
 #endif
 
+//! \def TASK_WHEEL_SIZE
+//! \brief Number of slots in the timer wheel that holds tasks waiting on a tick alarm, must be a power of two.
+//! A task sleeping for n ticks is looked at every TASK_WHEEL_SIZE ticks until it wakes; each slot costs one byte of RAM.
+#ifndef TASK_WHEEL_SIZE
+#define TASK_WHEEL_SIZE 16
+#endif
+#if TASK_WHEEL_SIZE & (TASK_WHEEL_SIZE - 1)
+#error "TASK_WHEEL_SIZE must be a power of two."
+#endif
+
+//! Bit mask with a bit for each task, bit n is task number n. Tasks are run in order of their numbers, lowest first,
+//! so configure.py numbers them in order of the priority given in config.def, eg .task(ina219, prio=high)
+#if TASK_NUM_TASKS <= 8
+typedef uint8_t task_mask_t;
+#define TASK_MASK_CTZ(mask) __builtin_ctz(mask)
+#elif TASK_NUM_TASKS <= 16
+typedef uint16_t task_mask_t;
+#define TASK_MASK_CTZ(mask) __builtin_ctz(mask)
+#elif TASK_NUM_TASKS <= 32
+typedef uint32_t task_mask_t;
+#define TASK_MASK_CTZ(mask) __builtin_ctzl(mask)
+#elif TASK_NUM_TASKS <= 64
+typedef uint64_t task_mask_t;
+#define TASK_MASK_CTZ(mask) __builtin_ctzll(mask)
+#else
+#error "TASK_NUM_TASKS must be 64 or less."
+#endif
+
+#ifdef TASK_STATS
+//! Run time statistics of a task, since they were reset. Times are in sysclk timer counts, see lib/sysclk.h,
+//! there being SYSCLK_TOP()+1 counts per tick. Times that don't fit are 0xffff.
+typedef struct {
+    //! number of times that task was run
+    uint32_t runs;
+    //! total of run times, average is total/runs. Stops at 0xffffffff.
+    uint32_t total;
+    //! shortest and longest run times
+    uint16_t min;
+    uint16_t max;
+    //! longest time between a tick alarm becoming due and the task being run
+    uint16_t late_max;
+} task_stats_t;
+
+/** 
+ * Read a task's run time statistics. Only compiled in if TASK_STATS is defined.
+ * 
+ * @param task_num The number of the task.
+ * @param stats Where the statistics are put.
+ * @param reset If non-zero, statistics are reset after being read.
+ */
+void task_stats_read(uint8_t task_num, task_stats_t *stats, uint8_t reset);
+#endif
+
 /** 
  * Initialise a task.
  * 
@@ -89,7 +142,8 @@ void task_set_seconds_timer(uint16_t seconds);
 
 /** 
  * Function that should be called periodically to make the tasks run. This function, in turn, calls the callback function of all
- * tasks that are in a ready (runnable) state.
+ * tasks that are in a ready (runnable) state, once each, highest priority (lowest task number) first. The ready tasks are
+ * looked at again each time a task returns, so a higher priority task that it, or an interrupt, made ready is run next.
  */
 void task_run();
 
@@ -148,6 +202,28 @@ void *task_num_get_user_data(uint8_t task_num);
  */
 void task_num_ready(uint8_t task_num, uint8_t ready);
 
+//! Set by task_num_post(): non-zero if task has been posted since task_run() last looked.
+extern volatile uint8_t task_pending[TASK_NUM_TASKS];
+//! Set by task_num_post(): non-zero if any task has been posted.
+extern volatile uint8_t task_posted;
+
+/** 
+ * Make task ready to run, from an interrupt handler. task_num_ready() must not be called from interrupt
+ * context as it changes tick alarms that the main loop may be changing too. This just sets flags with single
+ * byte stores, which the main loop takes and clears without disabling interrupts, and the task is then made ready
+ * as by task_num_ready(task_num, 1). Posting a task several times before it runs, runs it once.
+ * @see task_run_posted
+ * @param task_num The number of the task to be made ready.
+ */
+#define task_num_post(task_num) do{ task_pending[task_num]=1; task_posted=1; }while(0)
+
+/** 
+ * Run the tasks that have been posted with task_num_post(), highest priority first, and any that are posted while
+ * they run. Main loop calls this when task_posted is set between ticks, so that a task that an interrupt posts is run
+ * within microseconds rather than at the next tick, without running all of the other ready tasks too.
+ */
+void task_run_posted();
+
 /** 
  * Make current task ready to run, or unready to run
  * 
@@ -26,6 +26,76 @@
 #define UART_IS_FRAME_ERROR()  (UART_REG_UCSRA & _BV(UART_BIT_FE))
 #define UART_IS_OVERRUN_ERROR() (UART_REG_UCSRA & _BV(UART_BIT_DOR))
 
+#ifdef UART_RX_STATS
+//! rx statistics
+volatile uart_stats_t uart_stats;
+//! increment the named counter, saturating at its maximum
+#define UART_STATS_INC(field) if(uart_stats.field != 0xffff) uart_stats.field++
+#else
+#define UART_STATS_INC(field)
+#endif
+
+#ifdef UART_RX_FLOW
+//! set by RX ISR when it has asked host to stop sending, cleared by consumer when it asks host to resume.
+static volatile uint8_t uart_rx_stopped;
+
+#if UART_RX_FLOW == UART_FLOW_RTS
+#define UART_FLOW_STOP() UART_RTS_ON()
+#define UART_FLOW_GO()   UART_RTS_OFF()
+#else
+//! XON/XOFF is sent by the UDRE ISR ahead of anything in the tx buffer
+#define UART_FLOW_STOP() uart_tx.xchar=UART_XOFF; UART_TXINT_ENABLE()
+#define UART_FLOW_GO()   uart_tx.xchar=UART_XON; UART_TXINT_ENABLE()
+#endif
+
+//! Called by consumer after moving rxbuf_head: have host resume if there is room.
+static inline void uart_rx_flow_check(uint8_t head)
+{
+    if(uart_rx_stopped && (uint8_t)(UART.rxbuf_mask + 1 - (uint8_t)(UART.rxbuf_tail - head)) > 2*UART_FLOW_HEADROOM){
+	// signal before clearing the flag, so that the ISR can't have asked for a stop that we then override.
+	UART_FLOW_GO();
+	uart_rx_stopped = 0;
+    }
+}
+
+void uart_rx_release(uint8_t head)
+{
+    UART.rxbuf_head = head;
+    uart_rx_flow_check(head);
+}
+#else
+#define uart_rx_flow_check(head)
+#endif
+
+// uart_read() only touches the rx buffer, so is defined here for both app and bootloader-app.
+#if defined(BOOT) || defined(BOOT_APP)
+uint8_t uart_read(char* buf, uint8_t n)
+{
+    // rxbuf_count is shared with the bootloader's ISR, so chars are popped one at a time by uart_getc()
+    uint8_t i;
+    for(i=0; i<n && UART.rxbuf_count; i++){
+	buf[i] = uart_getc();
+    }
+    return i;
+}
+#else
+uint8_t uart_read(char* buf, uint8_t n)
+{
+    uint8_t head = UART.rxbuf_head;
+    uint8_t avail = UART.rxbuf_tail - head;
+    if(n > avail){
+	n = avail;
+    }
+    for(uint8_t i=n; i; i--){
+	*buf++ = UART.rxbuf[head++ & UART.rxbuf_mask];
+    }
+    // release the chars to the ISR
+    UART.rxbuf_head = head;
+    uart_rx_flow_check(head);
+    return n;
+}
+#endif
+
 // -----------------------------------------------------------------------------------
 #ifdef BOOT_APP
 // We are running as an application that calls into the bootloaders code for uart functions.
@@ -36,12 +106,33 @@
 // We are running as bootloader or standalone application,
 // functions are defined here.
 
+#ifdef UART_TX_BUFFERED
+//! tx control structure
+volatile uart_tx_t uart_tx;
+#endif
+
 void uart_init(char* buf, uint8_t buf_size){
 
+#ifdef BOOT
     // init circbuf
     UART.rxbuf=buf;
     UART.rxbuf_size=buf_size;
     UART_FLUSH();
+#else
+    // init circbuf, size is rounded down to a power of two so index can be wrapped with a mask
+    uint8_t size=0x80;
+    while(size > buf_size){
+	size >>= 1;
+    }
+    UART.rxbuf=buf;
+    UART.rxbuf_mask=size-1;
+    UART.rxbuf_head = UART.rxbuf_tail = 0;
+#endif
+
+#if UART_RX_FLOW == UART_FLOW_RTS
+    // RTS low: host may send
+    UART_RTS_INIT_OUTPUT();
+#endif
     
     // set up baud rate
     uart_set_baud();
@@ -69,6 +160,119 @@ void uart_set_baud()
 }
 
 
+#ifdef UART_TX_BUFFERED
+//! Write the oldest char in tx buffer to UDR. Buffer must not be empty and UDR must be ready.
+static inline void uart_tx_send_next()
+{
+    uint8_t head = uart_tx.txbuf_head;
+    // clear TXC so that uart_tx_flush() can detect when the last char has gone.
+    UART_TXC_CLEAR();
+    UART_REG_UDR = uart_tx.txbuf[head & uart_tx.txbuf_mask];
+    uart_tx.txbuf_head = head+1;
+    uart_tx.flags |= UART_TX_FLAG_ACTIVE;
+}
+
+void uart_tx_init(char* buf, uint8_t buf_size)
+{
+    // round size down to a power of two so index can be wrapped with a mask
+    uint8_t size=0x80;
+    while(size > buf_size){
+	size >>= 1;
+    }
+    uart_tx.txbuf=buf;
+    uart_tx.txbuf_mask=size-1;
+    uart_tx.txbuf_head=uart_tx.txbuf_tail=0;
+    uart_tx.flags=0;
+    uart_tx.dropped=0;
+    uart_tx.xchar=0;
+}
+
+uint8_t uart_tx_free()
+{
+    return uart_tx.txbuf_mask+1 - (uint8_t)(uart_tx.txbuf_tail - uart_tx.txbuf_head);
+}
+
+void uart_tx_flush()
+{
+    // wait for buffer to empty
+    while(uart_tx.txbuf_head != uart_tx.txbuf_tail){
+	if(!(SREG & _BV(SREG_I)) && UART_TX_READY()){
+	    // interrupts are off, ISR won't run: send it ourselves.
+	    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		uart_tx_send_next();
+	    }
+	}
+    }
+    // and for the shift register to empty, TXC is only ever set if something has been sent
+    if(uart_tx.flags & UART_TX_FLAG_ACTIVE){
+	while(!UART_TX_COMPLETE()){}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+	    uart_tx.flags &=~ UART_TX_FLAG_ACTIVE;
+	}
+    }
+}
+
+uint8_t uart_tx_overflow()
+{
+    uint8_t r;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+	r = uart_tx.flags & UART_TX_FLAG_OVERFLOW;
+	uart_tx.flags &=~ UART_TX_FLAG_OVERFLOW;
+    }
+    return r;
+}
+
+void uart_putc(const char c)
+{
+    uint8_t tail = uart_tx.txbuf_tail;
+    // buffer is full when there are mask+1 characters between head and tail
+    while( (uint8_t)(tail - uart_tx.txbuf_head) > uart_tx.txbuf_mask ){
+#if UART_TX_FULL_POLICY == UART_TX_FULL_BLOCK
+	if(!(SREG & _BV(SREG_I)) && UART_TX_READY()){
+	    // interrupts are off, ISR won't run: make room by sending oldest char ourselves
+	    uart_tx_send_next();
+	}
+#else
+	uart_tx.dropped++;
+#if UART_TX_FULL_POLICY == UART_TX_FULL_ERROR
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+	    uart_tx.flags |= UART_TX_FLAG_OVERFLOW;
+	}
+#endif
+	return;
+#endif
+    }
+    uart_tx.txbuf[tail & uart_tx.txbuf_mask]=c;
+    uart_tx.txbuf_tail = tail+1;
+    // have UDRE ISR send it
+    UART_TXINT_ENABLE();
+}
+
+//! UDR is empty, send next char from tx buffer
+ISR(UART_TX_ISR)
+{
+#if UART_RX_FLOW == UART_FLOW_XONXOFF
+    if(uart_tx.xchar){
+	// flow control char goes first
+	UART_TXC_CLEAR();
+	UART_REG_UDR = uart_tx.xchar;
+	uart_tx.xchar = 0;
+	uart_tx.flags |= UART_TX_FLAG_ACTIVE;
+	if(uart_tx.txbuf_head == uart_tx.txbuf_tail){
+	    UART_TXINT_DISABLE();
+	}
+	return;
+    }
+#endif
+    if(uart_tx.txbuf_head != uart_tx.txbuf_tail){
+	uart_tx_send_next();
+    }
+    if(uart_tx.txbuf_head == uart_tx.txbuf_tail){
+	// nothing left to send
+	UART_TXINT_DISABLE();
+    }
+}
+#else
 void uart_putc(const char c)
 {
     // wait for UDR is ready
@@ -76,6 +280,7 @@ void uart_putc(const char c)
     // send char
     UART_REG_UDR=c;
 }
+#endif
 
 void uart_putb(const uint8_t b)
 {
@@ -105,6 +310,7 @@ void uart_write(char* buf, unsigned int size)
     }
 }
 
+#ifdef BOOT
 char uart_getc()
 {
     char c;
@@ -127,8 +333,36 @@ char uart_getc()
     }
     return c;
 }
+#else
+char uart_getc()
+{
+    uint8_t head = UART.rxbuf_head;
+    if(head == UART.rxbuf_tail){
+	// buffer is empty
+	return '\x0';
+    }
+    // pop char for rx buffer
+    char c=UART.rxbuf[head & UART.rxbuf_mask];
+    UART.rxbuf_head = ++head;
+    uart_rx_flow_check(head);
+    return c;
+}
+#endif
+
+#ifdef UART_RX_STATS
+void uart_stats_read(uart_stats_t *stats, uint8_t reset)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+	*stats = uart_stats;
+	if(reset){
+	    uart_stats = (uart_stats_t){0};
+	}
+    }
+}
+#endif
 
 //! For BOOTLOADER or standalone we define the UART RX ISR here.
+#ifdef BOOT
 ISR(UART_RX_ISR)
 {
     // check for errors - if so, set error flags
@@ -150,6 +384,48 @@ ISR(UART_RX_ISR)
 	}
     }
 }
+#else
+ISR(UART_RX_ISR)
+{
+    // error flags must be read before UDR, UDR is always read so that RXC is cleared.
+    uint8_t err = UART_REG_UCSRA & (_BV(UART_BIT_FE) | _BV(UART_BIT_DOR));
+    char c=UART_REG_UDR;
+    if(err & _BV(UART_BIT_DOR)){
+	// chars were lost before this one, this one is good.
+	UART_STATS_INC(overrun);
+    }
+    if(err & _BV(UART_BIT_FE)){
+	// char is corrupt, discard it.
+	UART_STATS_INC(frame_err);
+	return;
+    }
+    uint8_t tail = UART.rxbuf_tail;
+    uint8_t count = tail - UART.rxbuf_head;
+    // push received char to rx buffer
+    if(count <= UART.rxbuf_mask){
+	// there is space in buffer
+	UART.rxbuf[tail & UART.rxbuf_mask] = c;
+	UART.rxbuf_tail = tail+1;
+	count++;
+#ifdef UART_RX_STATS
+	if(count > uart_stats.rx_high_water){
+	    uart_stats.rx_high_water = count;
+	}
+#endif
+#ifdef UART_RX_FLOW
+	if(!uart_rx_stopped && (uint8_t)(UART.rxbuf_mask + 1 - count) <= UART_FLOW_HEADROOM){
+	    // nearly full, have host stop
+	    UART_FLOW_STOP();
+	    uart_rx_stopped = 1;
+	    UART_STATS_INC(flow_stops);
+	}
+#endif
+    }else{
+	// buffer is full, discard received char
+	UART_STATS_INC(rx_full);
+    }
+}
+#endif
 #endif // ifdef BOOT_APP
 
 
@@ -20,13 +20,15 @@
  * @author Stephen Stebbing 
  * @date   Mon Dec 21 15:16:26 2015
  * 
- * @brief  UART library. Uses interrupted driven RX and polled TX. RX uses circular buffer.
+ * @brief  UART library. Uses interrupted driven RX and, if UART_TXBUF_SIZE is defined,
+ * interrupt driven TX, otherwise polled TX. RX and TX use circular buffers.
  * 
  */
 
 #include <stdint.h>
 #include <avr/io.h>
 
+#include "config.h"
 #include "../boot/boot.h"
 
 // processor specific include
@@ -48,6 +50,9 @@
 #endif
 
 //! uart control structure.
+#if defined(BOOT) || defined(BOOT_APP)
+//! Shared between bootloader and app at a fixed address, see ../boot/globals.h. The app uses the bootloader's
+//! RX ISR and uart_getc(), so this layout and its meaning must stay as they are in bootloaders already in the field.
 typedef struct {
     //! rx circular buffer
     char*  rxbuf;
@@ -56,7 +61,103 @@ typedef struct {
     uint8_t rxbuf_tail;  //! index into buf of tail of queue.
     uint8_t rxbuf_count; //! number of characters currently in queue.
 } uart_t;
+#else
+//! The rx circular buffer is single-producer (RX ISR) single-consumer (main loop): the ISR only writes
+//! rxbuf_tail and the consumer only writes rxbuf_head, so neither side needs to disable interrupts.
+//! head and tail are free running counts, the buffer index being the count masked with rxbuf_mask.
+typedef struct {
+    //! rx circular buffer
+    char*  rxbuf;
+    uint8_t rxbuf_mask;  //! size of queue minus one, size is a power of two.
+    uint8_t rxbuf_head;  //! count of characters popped from queue, written only by consumer.
+    uint8_t rxbuf_tail;  //! count of characters pushed to queue, written only by RX ISR.
+} uart_t;
+#endif
+
+
+//! Policies for what uart_putc() does when the TX buffer is full.
+//! Wait until the UDRE ISR has made room. If global interrupts are disabled, the
+//! oldest queued character is transmitted by polling instead.
+#define UART_TX_FULL_BLOCK 0
+//! Discard the character, increment uart_tx.dropped.
+#define UART_TX_FULL_DROP  1
+//! Discard the character, increment uart_tx.dropped and set the UART_TX_FLAG_OVERFLOW flag
+//! which can be tested and cleared by calling uart_tx_overflow()
+#define UART_TX_FULL_ERROR 2
+
+//! Interrupt driven TX is used by standalone app when UART_TXBUF_SIZE is defined, eg in config.h
+//! Bootloader, and app that uses bootloader's uart functions, use polled TX.
+#if defined(UART_TXBUF_SIZE) && !defined(BOOT) && !defined(BOOT_APP)
+#define UART_TX_BUFFERED
+#ifndef UART_TX_FULL_POLICY
+#define UART_TX_FULL_POLICY UART_TX_FULL_BLOCK
+#endif
+#endif
+
+//! uart_tx_t.flags bits
+//! set when character was discarded due to the TX buffer being full, and UART_TX_FULL_ERROR policy is in use.
+#define UART_TX_FLAG_OVERFLOW 0x1
+//! set when a character has been written to UDR, cleared by uart_tx_flush() once transmission has completed.
+#define UART_TX_FLAG_ACTIVE   0x2
+
+//! uart TX control structure. Used when UART_TX_BUFFERED is defined.
+typedef struct {
+    //! tx circular buffer
+    char* txbuf;
+    uint8_t txbuf_mask;          //! size of buffer minus one, size is a power of two
+    volatile uint8_t txbuf_head; //! free running count of characters sent, only the UDRE ISR writes this.
+    volatile uint8_t txbuf_tail; //! free running count of characters queued, only uart_putc() writes this.
+    volatile uint8_t flags;      //! UART_TX_FLAG_XXX bits
+    uint16_t dropped;            //! number of characters discarded because buffer was full.
+    volatile uint8_t xchar;      //! XON/XOFF flow control char to be sent ahead of the buffer, 0 if none.
+} uart_tx_t;
+
+#ifdef UART_TX_BUFFERED
+extern volatile uart_tx_t uart_tx;
+#endif
+
+//! RX flow control methods for UART_FLOW_CONTROL, eg in config.h. When the rx buffer has only UART_FLOW_HEADROOM
+//! chars free the host is asked to stop sending, it is asked to resume once more than twice that are free again.
+//! Drive the UART_RTS pin high to stop, low to resume. Connect it to the host's CTS input. The pin is
+//! defined in config.def, eg .pin_def(UART_RTS, D, 2)
+#define UART_FLOW_RTS     1
+//! Send XOFF to stop, XON to resume. Requires UART_TX_BUFFERED. Note that a host that does XON/XOFF in its
+//! serial driver will then discard any 0x11 and 0x13 we send, so binary MMP replies must not contain these.
+#define UART_FLOW_XONXOFF 2
+
+#define UART_XON  0x11
+#define UART_XOFF 0x13
+
+//! Flow control and rx statistics are done by the RX ISR, so are not available to an app that uses the bootloader's ISR.
+#if defined(UART_FLOW_CONTROL) && !defined(BOOT) && !defined(BOOT_APP)
+#define UART_RX_FLOW UART_FLOW_CONTROL
+#ifndef UART_FLOW_HEADROOM
+#define UART_FLOW_HEADROOM 16
+#endif
+#if UART_RX_FLOW == UART_FLOW_XONXOFF && !defined(UART_TX_BUFFERED)
+#error "UART_FLOW_XONXOFF requires UART_TXBUF_SIZE to be defined"
+#endif
+#if UART_RX_FLOW == UART_FLOW_RTS && !defined(UART_RTS_DEFS)
+#error "UART_FLOW_RTS requires the UART_RTS pin to be defined, eg .pin_def(UART_RTS, D, 2) in config.def"
+#endif
+#endif
 
+#if defined(UART_STATS) && !defined(BOOT) && !defined(BOOT_APP)
+#define UART_RX_STATS
+#endif
+
+//! rx error counters, maintained by the RX ISR when UART_RX_STATS is defined. Counts saturate at 0xffff.
+typedef struct {
+    uint16_t frame_err;    //! chars discarded because they had a framing error
+    uint16_t overrun;      //! hardware overruns, ie chars lost because the ISR didn't run in time
+    uint16_t rx_full;      //! chars discarded because the rx buffer was full
+    uint16_t flow_stops;   //! number of times that the host was asked to stop sending
+    uint8_t rx_high_water; //! the most chars that have been in the rx buffer
+} uart_stats_t;
+
+#ifdef UART_RX_STATS
+extern volatile uart_stats_t uart_stats;
+#endif
 
 //! Initialise the global variable 'uart_t uart' 
 //! Note that this should always be accessed via the UART macro.
@@ -93,6 +194,14 @@ typedef struct {
 #define UART_RXINT_ENABLE() (UART_REG_UCSRB |= _BV(UART_BIT_RXCIE))
 //! disable RX interrupt
 #define UART_RXINT_DISABLE() (UART_REG_UCSRB &=~ _BV(UART_BIT_RXCIE))
+//! enable TX data register empty interrupt
+#define UART_TXINT_ENABLE() (UART_REG_UCSRB |= _BV(UART_BIT_UDRIE))
+//! disable TX data register empty interrupt
+#define UART_TXINT_DISABLE() (UART_REG_UCSRB &=~ _BV(UART_BIT_UDRIE))
+//! True when the last character has been shifted out of the transmitter
+#define UART_TX_COMPLETE() ( UART_REG_UCSRA & _BV( UART_BIT_TXC ) )
+//! Clear the TX complete flag by writing one to it. FE, DOR, UPE must be written as zero, U2X is kept.
+#define UART_TXC_CLEAR() (UART_REG_UCSRA = (UART_REG_UCSRA & _BV(UART_BIT_U2X)) | _BV(UART_BIT_TXC))
 
 
 
@@ -107,12 +216,38 @@ typedef struct {
 
 //! Pop received char from rx circular buffer
 #define GETC() uart_getc()
+#if defined(BOOT) || defined(BOOT_APP)
 //! Non zero if a rx char is availabe in the buffer
 #define UART_CHAR_AVAIL() (UART.rxbuf_count) 
 #define GETC_AVAIL() UART_CHAR_AVAIL()
-
+//! Number of rx chars that are in the buffer
+#define UART_RX_COUNT() (UART.rxbuf_count)
+//! Size of the rx buffer
+#define UART_RX_SIZE() (UART.rxbuf_size)
 //! Discard any received character that are in the rx circular buffer
 #define UART_FLUSH() (UART.rxbuf_head = UART.rxbuf_tail = UART.rxbuf_count = 0)
+#else
+//! Non zero if a rx char is availabe in the buffer
+#define UART_CHAR_AVAIL() (UART.rxbuf_head != UART.rxbuf_tail) 
+#define GETC_AVAIL() UART_CHAR_AVAIL()
+//! Number of rx chars that are in the buffer
+#define UART_RX_COUNT() ((uint8_t)(UART.rxbuf_tail - UART.rxbuf_head))
+//! Size of the rx buffer
+#define UART_RX_SIZE() (UART.rxbuf_mask+1)
+#endif
+
+#if defined(BOOT) || defined(BOOT_APP)
+// chars can't be parsed in place in the shared buffer, see MMP_RX_IN_PLACE
+#elif defined(UART_RX_FLOW)
+//! Release rx chars, up to free running count 'head', back to the RX ISR. 
+//! For use when chars are parsed in place in rxbuf rather than being popped.
+#define UART_RX_RELEASE(head) uart_rx_release(head)
+//! Discard any received character that are in the rx circular buffer
+#define UART_FLUSH() uart_rx_release(UART.rxbuf_tail)
+#else
+#define UART_RX_RELEASE(head) (UART.rxbuf_head = (head))
+#define UART_FLUSH() (UART.rxbuf_head = UART.rxbuf_tail)
+#endif
 
 //! set baud rate - BAUD mast be defined. eg \#define BAUD=9600, or -D BAUD=9600 in Makefile,
 //! or define in config.h, or define just prior to call to uart_set_baud()
@@ -122,12 +257,35 @@ void uart_set_baud();
  * Initialise the uart. 
  * Sets baud, frame, initilises rx circular buffer, enables uart, enables RX ISR
  * @param buf      Pointer to char array that will be used for rx circular buffer data
- * @param buf_size Number of bytes (max) in the rx buffer
+ * @param buf_size Number of bytes (max) in the rx buffer. Should be a power of two, if not then only the
+ *                 largest power of two that is less than buf_size is used.
  */
 void uart_init(char* buf, uint8_t buf_size);
 
+#ifdef UART_TX_BUFFERED
 /** 
- * Transmit passed character. Wait until ready.
+ * Initialise the tx circular buffer. Should be called after uart_init() and before any character is transmitted.
+ * @param buf      Pointer to char array that will be used for tx circular buffer data
+ * @param buf_size Number of bytes in the tx buffer. Should be a power of two, if not then only the largest
+ *                 power of two that is less than buf_size is used.
+ */
+void uart_tx_init(char* buf, uint8_t buf_size);
+
+//! Return the number of characters that can be queued without the TX buffer becoming full.
+uint8_t uart_tx_free();
+
+//! Wait until all queued characters have been transmitted, including the final stop bit.
+void uart_tx_flush();
+
+//! Return non-zero if a character has been discarded since prior call, clears the flag.
+//! Only used with UART_TX_FULL_ERROR policy.
+uint8_t uart_tx_overflow();
+#endif
+
+/** 
+ * Transmit passed character. 
+ * With UART_TX_BUFFERED, character is queued in the tx buffer and function returns immediately,
+ * if buffer is full then UART_TX_FULL_POLICY applies. Otherwise wait until ready.
  * @param c The character to be transmitted
  */
 void uart_putc(const char c);
@@ -160,5 +318,27 @@ void uart_write(char* buf, unsigned int size);
  */
 char uart_getc();
 
+/** 
+ * Pop up to n received characters from the rx buffer. 
+ * @param buf Buffer into which the characters are copied.
+ * @param n Maximum number of characters to be copied.
+ * @return The number of characters that were copied, 0 if the rx buffer was empty.
+ */
+uint8_t uart_read(char* buf, uint8_t n);
+
+#ifdef UART_RX_FLOW
+//! Set rxbuf_head to the passed free running count and have the host resume sending if there is now room.
+//! Use UART_RX_RELEASE() rather than calling this directly.
+void uart_rx_release(uint8_t head);
+#endif
+
+#ifdef UART_RX_STATS
+/** 
+ * Copy the rx statistics.
+ * @param stats Where the statistics are copied to.
+ * @param reset If non-zero, counters and high water mark are zeroed after being copied.
+ */
+void uart_stats_read(uart_stats_t *stats, uint8_t reset);
+#endif
 
 #endif
@@ -35,6 +35,7 @@
 #define UART_BIT_UDRE UDRE0
 #define UART_BIT_UDRIE UDRIE0
 #define UART_BIT_RXC RXC0
+#define UART_BIT_TXC TXC0
 #define UART_BIT_RXCIE RXCIE0
 #define UART_BIT_FE FE0
 #define UART_BIT_DOR DOR0
@@ -43,6 +44,8 @@
 
 // RX ISR name
 #define UART_RX_ISR USART_RX_vect 
+// TX data register empty ISR name
+#define UART_TX_ISR USART_UDRE_vect
 
 // macro sets frame to async, 8N1
 #define UART_SET_FRAME_8N1()  UCSR0B &=~ _BV(UCSZ02);\
@@ -36,6 +36,7 @@
 #define UART_BIT_UDRE UDRE
 #define UART_BIT_UDRIE UDRIE
 #define UART_BIT_RXC RXC
+#define UART_BIT_TXC TXC
 #define UART_BIT_RXCIE RXCIE
 #define UART_BIT_FE FE
 #define UART_BIT_DOR DOR
@@ -44,4 +45,6 @@
 
 //  RX ISR name
 #define UART_RX_ISR USART_RXC_vect
+//  TX data register empty ISR name
+#define UART_TX_ISR USART_UDRE_vect
 #endif
@@ -2,37 +2,37 @@
 // Copyright Stephen Stebbing 2023. http://telecnatron.com/
 // -----------------------------------------------------------------------------
 #include <string.h>
+#include <avr/interrupt.h>
 #include "config.h"
 #include "load_switch.h"
 #include "./lib/adc.h"
 #include "./lib/mmp/mmp_cmd.h"
+#include "./lib/mmp/mmp_txq.h"
 #include "./lib/task.h"
 #include "./lib/uart/uart.h"
 
 // global variables.
 // 1: load is connected, 0 load is disconnected, -1 is uninitalised
 int8_t load_switch_status=-1;
+// non-zero while a conversion that task_load_switch() started is in progress
+static uint8_t load_switch_converting;
 
 
 // -------------------------------------------------------------------
 void load_switch_init(uint8_t adc_channel)
 {
     adc_init_avcc(0);
-#if 0    
     ADC_CHANNEL_SELECT(0);
     ADC_INTERRUPT_ENABLE();
-    ADC_START_CONVERSION();
-#endif    
 }
 
 // -------------------------------------------------------------------
-#if 0
-// handler for ADC interrrupt
+// handler for ADC interrrupt: conversion is complete, have the task read it.
+// task_num_ready() isn't safe here, post the task instead
 ISR(ADC_vect)
 {
-    task_num_ready(TASK_LOAD_SWITCH, 1);
+    task_num_post(TASK_LOAD_SWITCH);
 }
-#endif
 
 // -------------------------------------------------------------------
 // mmp command handler: read status of load switch
@@ -43,10 +43,19 @@ void cmd_load_switch(void *handle, uint8_t cmd, uint8_t data_len, uint8_t data_m
 }
 
 // -------------------------------------------------------------------
-//! monitor state of load switch, signal when changed
+//! monitor state of load switch, signal when changed.
+//! Task starts a conversion and waits to be posted by the ADC ISR, rather than polling for the result.
 void task_load_switch()
 {
-    uint16_t ls=adc_read_poll(0);
+    if(!load_switch_converting){
+	// it's time to look again
+	ADC_START_CONVERSION();
+	load_switch_converting=1;
+	task_ready(0);
+	return;
+    }
+    load_switch_converting=0;
+    uint16_t ls=ADCW;
     if(ls>0x0120){
 	// it's on
 	ls=1;
@@ -60,7 +69,7 @@ void task_load_switch()
 	//LOG_INFO_FP("load: 0x%02x, 0x%02x", ls, load_switch_status);	
 	// send them async message of two bytes, being {5, load_switch_status}
 	uint8_t d[2]={5, load_switch_status};
-	mmp_async_send(d, 2, uart_putc);
+	mmp_txq_send(MMP_TXQ_PRIO_HIGH, d, 2);
     }
     task_set_tick_timer(80);
 }
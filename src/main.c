@@ -8,10 +8,12 @@
 #include <ctype.h>
 // library includes
 #include "./lib/i2c/i2c_master.h"
+#include "./lib/idle.h"
 #include "./lib/i2c/pcf8574.h"
 #include "./lib/lcd/lcd_i2c.h"
 #include "./lib/log.h"
 #include "./lib/mmp/mmp_cmd.h"
+#include "./lib/mmp/mmp_txq.h"
 #include "./lib/rtc/clock.h"
 #include "./lib/stdout.h"
 #include "./lib/sysclk.h"
@@ -74,6 +76,13 @@ void task_led()
     }
 }
 
+// -------------------------------------
+//! send queued async messages as there is room for them, stays ready so they go as soon as possible
+void task_txq()
+{
+    mmp_txq_run();
+}
+
 // -------------------------------------
 int main()
 {
@@ -96,33 +105,87 @@ int main()
     LOG_INFO_FP(" --- RUNNING --- ", NULL);
     // -------------- main loop ---------------
     for(;;){
+#ifdef IDLE_SLEEP
+	// chars received after this are looked at on the next time round
+	uint8_t rx_tail = UART.rxbuf_tail;
+	// non-zero if there are received commands still to be run
+	uint8_t queued = 0;
+#endif
+#ifdef MMP_RX_IN_PLACE
+	// mmp_cmd parses chars in place in the uart rx buffer, then we release those no longer needed.
+	UART_RX_RELEASE(mmp_cmd_rx_ring(&mmp_cmd_ctrl, UART.rxbuf_tail));
+#else
 	// process any chars available from uart
-	while(GETC_AVAIL()){
+	char rx[16];
+	uint8_t n;
+	while( (n=uart_read(rx, sizeof(rx))) ){
 	    // and pass them to mmp_cmd
-	    mmp_cmd_rx_ch(&mmp_cmd_ctrl, GETC());
+	    mmp_cmd_rx_buf(&mmp_cmd_ctrl, (uint8_t *)rx, n);
 	}
+#endif
+#ifdef MMP_CMD_QUEUED
+	// run oldest received command of each endpoint
+#ifdef IDLE_SLEEP
+	queued =
+#endif
+	    mmp_cmd_run_all();
+#endif
 
 	if(sysclk_has_ticked()){
 	    // this block is called at ~1000Hz
-	    mmp_cmd_tick(&mmp_cmd_ctrl);
+	    mmp_cmd_tick_all();
 	    task_tick();
 	    if( sysclk_have_seconds_ticked()){
 		// this block called every second or so
 		task_seconds_tick();
 	    }
 	    task_run();
+	}else if(task_posted){
+	    // an interrupt handler has posted a task, run it now rather than at the next tick
+	    task_run_posted();
 	}
+#ifdef IDLE_SLEEP
+	// sleep until the next interrupt if there's nothing to do: tasks only run on a tick or when posted,
+	// so ready tasks don't keep us awake.
+	cli();
+	if(!queued && !task_posted && UART.rxbuf_tail == rx_tail){
+	    idle_sleep();
+	}
+	sei();
+#endif
     }
 }
 
 //! enable uart, set up stdout
+#ifdef LOG_TOKENIZED
+//! queue tokenized log message to be sent as an async mmp message
+static void log_token_send(uint8_t *msg, uint8_t len)
+{
+    mmp_txq_send(MMP_TXQ_PRIO_LOG, msg, len);
+}
+#endif
+
 void _uart_init()
 {
     // buffer for uart rx buffer
     static char rxbuf[UART_RXBUF_SIZE];
     // init uart
     uart_init(rxbuf,UART_RXBUF_SIZE);
+#ifdef UART_TX_BUFFERED
+    // buffer for uart tx buffer, emptied by the UDRE interrupt
+    static char txbuf[UART_TXBUF_SIZE];
+    uart_tx_init(txbuf, UART_TXBUF_SIZE);
+#endif
     STDOUT_INIT();
+    // async messages are queued and sent by task_txq
+#ifdef UART_TX_BUFFERED
+    mmp_txq_init(uart_tx_free);
+#else
+    mmp_txq_init(NULL);
+#endif
+#ifdef LOG_TOKENIZED
+    LOG_INIT_TOKEN_CB(log_token_send);
+#endif
 }
 
 
@@ -5,6 +5,7 @@
 #include "shtdwn.h"
 #include "lcd.h"
 #include "./lib/mmp/mmp_cmd.h"    
+#include "./lib/mmp/mmp_txq.h"
 #include "./lib/uart/uart.h"
 #include "./lib/log.h"
 #include "./lib/task.h"
@@ -40,7 +41,7 @@ uint8_t psu_shutdown(uint8_t sht)
     shtdwn=sht;
     // send async message notifying of change 
     uint8_t d[2]={7, sht};
-    mmp_async_send(d, 2, uart_putc);
+    mmp_txq_send(MMP_TXQ_PRIO_HIGH, d, 2);
     return shtdwn;
 }
 
@@ -12,6 +12,10 @@ class ENoResponse(Exception):
 class EStatus(Exception):
     pass
 
+class ETooLong(Exception):
+    """ command data is longer than the MCU can receive, see telecnatron.avr.cmd.caps """
+    pass
+
 # ==========================================================
 class Handler():
     """ """
@@ -26,6 +30,12 @@ class Handler():
     # ----------------------------------------    
     def command(self, send_bytes=b''):
         r=None
+        # MCU's limit, once its caps command has been read
+        max_len = getattr(self.mmp, 'cmd_max_len', None)
+        if max_len is not None and len(send_bytes) > max_len:
+            m=f"command {self.cmd_num} data is {len(send_bytes)} bytes, mcu can receive {max_len}"
+            logging.error(m)
+            raise ETooLong(m)
         self.rmsg=self.mmp.sendReceiveCmd(self.cmd_num,send_bytes)
 #        self.rmsg=self.mmp.sendReceiveCmd(self.cmd_num,b'0')
         if not self.rmsg == None:
@@ -51,6 +61,16 @@ class Handler():
         d.extend(data)
         return self.command(bytes(d))
     
+    # ----------------------------------------
+    def request(self, send_bytes=b''):
+        """ return the (cmd, data) tuple for a command that is to be sent in a batch, see telecnatron.avr.cmd.batch """
+        return (self.cmd_num, send_bytes)
+
+    # ----------------------------------------
+    def sub_request(self, scmd=0, data=b''):
+        """ as request() but with subcommand """
+        return self.request(pack('<B',scmd) + data)
+
     # ----------------------------------------
     def handle_no_response(self):
         m="no response from mcu"
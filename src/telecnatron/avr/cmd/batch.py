@@ -0,0 +1,33 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+import logging
+
+from telecnatron.mmp.MMP import MMP
+from telecnatron.avr.cmd.Handler import Handler
+from telecnatron.avr.cmd.Handler import ENoResponse, EStatus
+
+# -----------------------------------
+class Batch(Handler):
+    """ send several commands to the MCU in one message, and get all their replies in one message.
+    eg: (m, c) = batch.run(measurements.sub_request(Measurements.SC_READ), clk.sub_request(Clock.SC_READ))
+    then measurements.decode(m), clk.decode(c)
+    """
+
+    # -------------------------------
+    def run(self, *requests):
+        """ requests are (cmd, data) tuples as returned by Handler.request() and Handler.sub_request().
+        Return list of sub-reply messages, in the same order. Raises EStatus if any sub-command failed."""
+        replies=self.mmp.sendReceiveBatch(self.cmd_num, requests)
+        if replies == None:
+            self.handle_no_response()
+        if len(replies) != len(requests):
+            m=f"batch: {len(requests)} commands sent, {len(replies)} replies received"
+            logging.info(m)
+            raise EStatus(m)
+        for (r, (cmd, data)) in zip(replies, requests):
+            if r.cmd != cmd or r.status != 0:
+                m=f"batch: got error response: status: {r.status} msg: {r}"
+                logging.info(m)
+                raise EStatus(m)
+        return replies
@@ -0,0 +1,32 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+import logging
+from struct import unpack, pack ;
+
+from telecnatron.mmp.MMP import MMP
+from telecnatron.avr.cmd.Handler import Handler
+from telecnatron.avr.cmd.Handler import ENoResponse, EStatus
+
+# -----------------------------------
+class Baud(Handler):
+    """ read and negotiate the MCU's baud rate """
+
+    # subcommands
+    SC_READ    = 0
+    SC_PROPOSE = 1
+    SC_CONFIRM = 2
+
+    # rates that can be generated with U2X at 16MHz
+    RATES = (115200, 250000, 500000, 1000000)
+
+    # -------------------------------
+    def read(self):
+        """ return the MCU's current baud rate """
+        rmsg=self.sub_command(self.SC_READ)
+        return unpack('<I', rmsg.data)[0]
+
+    # -------------------------------
+    def set(self, baud, confirm_timeout_ms=500):
+        """ switch MCU and host to the passed baud rate, return True on success, False if old rate is still in use """
+        return self.mmp.negotiateBaud(self.cmd_num, baud, confirm_timeout_ms)
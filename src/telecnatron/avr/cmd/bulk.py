@@ -0,0 +1,33 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+import logging
+from struct import pack
+
+from telecnatron.avr.cmd.Handler import Handler
+
+# -----------------------------------
+class Bulk(Handler):
+    """ bulk transfers of more data than fits in a reply, see lib/mmp/mmp_bulk.h
+    eg: data=bulk.read_mem(0x0000, 1024, flash=True)
+    """
+
+    # subcommand that reads memory
+    SC_MEM = 3
+    # memory spaces
+    MEM_RAM   = 0
+    MEM_FLASH = 1
+
+    # -------------------------------
+    def read(self, cmd, send_bytes=b'', timeoutSec=0.5):
+        """ send command cmd, whose handler starts a bulk transfer, return the transferred data """
+        data=self.mmp.sendReceiveBulk(cmd, send_bytes, self.cmd_num, timeoutSec)
+        if data == None:
+            self.handle_no_response()
+        return data
+
+    # -------------------------------
+    def read_mem(self, addr, length, flash=False):
+        """ return length bytes of the MCU's RAM, or flash, starting at addr """
+        space = self.MEM_FLASH if flash else self.MEM_RAM
+        return self.read(self.cmd_num, pack('<BBHH', self.SC_MEM, space, addr, length))
@@ -0,0 +1,57 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+import logging
+from struct import unpack, pack ;
+
+from telecnatron.mmp.MMP import MMP
+from telecnatron.avr.cmd.Handler import Handler
+from telecnatron.avr.cmd.Handler import ENoResponse, EStatus
+
+# -----------------------------------
+class Caps(Handler):
+    """ query the MCU's mmp protocol version and capabilities, and make use of them """
+
+    # capability bits
+    CAP_CRC16 = 0x01
+    CAP_COBS  = 0x02
+    CAP_TAG   = 0x04
+
+    # -------------------------------
+    def read(self):
+        """ return dict with protocol version, capability bits, max reply data length, command queue length and
+        max command data length. Handlers then refuse to send commands longer than that, see Handler.command() """
+        rmsg=self.command()
+        d = dict(zip(('version', 'caps', 'max_len'), rmsg.data[:3]))
+        # older firmware has no queue, and doesn't say how long commands can be
+        d['queue_len'] = rmsg.data[3] if rmsg.len >= 4 else 1
+        d['cmd_max_len'] = rmsg.data[4] if rmsg.len >= 5 else None
+        if d['cmd_max_len'] is not None:
+            self.mmp.cmd_max_len = d['cmd_max_len']
+        return d
+
+    # -------------------------------
+    def enable_crc(self):
+        """ have host send v2 (CRC-16) frames if MCU supports them. Return True if it does. """
+        caps=self.read()
+        self.mmp.crc = bool(caps['caps'] & self.CAP_CRC16)
+        logging.info(f"mmp protocol version: {caps['version']}, crc: {self.mmp.crc}")
+        return self.mmp.crc
+
+    # -------------------------------
+    def enable_cobs(self):
+        """ have host send COBS framed messages if MCU supports them. Return True if it does. """
+        caps=self.read()
+        self.mmp.cobs = bool(caps['caps'] & self.CAP_COBS)
+        logging.info(f"mmp protocol version: {caps['version']}, cobs: {self.mmp.cobs}")
+        return self.mmp.cobs
+
+    # -------------------------------
+    def enable_tags(self):
+        """ have host send tagged commands if MCU supports them, so that commands from several threads can be in flight
+        at once. Return True if it does. """
+        caps=self.read()
+        if caps['caps'] & self.CAP_TAG:
+            self.mmp.enableTags(caps['queue_len'])
+        logging.info(f"mmp protocol version: {caps['version']}, tagged: {self.mmp.tagged}, queue: {caps['queue_len']}")
+        return self.mmp.tagged
@@ -20,8 +20,12 @@ class Clock(Handler):
     # -------------------------------------------
     def read(self):
         """ read the MCU clock and return it's data as a dict: eg {'H': 1, 'M': 3, 'S': 12, 'ticks': 870, 'seconds': 3791, 'seconds_count': 3791, 'tick_freq': 1000}"""
+        return self.decode(self.sub_command(Clock.SC_READ))
+
+    # -------------------------------------------
+    def decode(self, rmsg):
+        """ return dict of clock data from read reply """
         fields=('S', 'M', 'H', 'ticks', 'seconds', 'seconds_count', 'tick_freq')
-        rmsg=self.sub_command(Clock.SC_READ)
         return self.rmsg_to_dict("<BBBHLLH", fields, rmsg)
     
     # -------------------------------------------
@@ -0,0 +1,146 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+import logging
+import math
+import time
+from struct import unpack, pack ;
+
+from telecnatron.mmp.MMP import MMP
+from telecnatron.avr.cmd.Handler import Handler
+from telecnatron.avr.cmd.Handler import ENoResponse, EStatus
+
+# -----------------------------------
+class LinkTest(Handler):
+    """ measure the link's throughput, round trip time and error rate with the MCU's link_test command,
+    eg to qualify a cable or pick the fastest baud rate that is safe. """
+
+    # subcommands
+    SC_ECHO  = 0
+    SC_GEN   = 1
+    SC_STATS = 2
+
+    # modes: host sends payloads that MCU checks and echoes, or MCU generates them.
+    # MCU echoes the payload as it should have been, so MCU counts the errors on the way to it, host those on the way back.
+    MODE_ECHO = 'echo'
+    MODE_GEN  = 'gen'
+
+    FIELDS = ('frames', 'seq_gaps', 'bit_errors', 'bytes', 'cs_fail', 'timeout', 'overrun', 'framing')
+
+    # -------------------------------
+    @staticmethod
+    def payload(seq, length):
+        """ return the pseudo-random payload of message seq, as the MCU generates it """
+        x = (seq ^ 0xace1) & 0xffff or 1
+        b = bytearray(length)
+        for i in range(length):
+            x ^= (x << 7) & 0xffff
+            x ^= x >> 9
+            x ^= (x << 8) & 0xffff
+            b[i] = x & 0xff
+        return bytes(b)
+
+    # -------------------------------
+    @staticmethod
+    def bit_errors(got, expected):
+        """ return number of bits that differ, bytes missing from got count as 8 each """
+        n = sum(bin(a ^ b).count('1') for a, b in zip(got, expected))
+        return n + 8*abs(len(expected) - len(got))
+
+    # -------------------------------
+    def stats(self, reset=False):
+        """ return dict of the MCU's payload checks and its mmp receive errors on this link """
+        rmsg=self.sub_command(self.SC_STATS, pack('<B', reset))
+        return self.rmsg_to_dict('<HHIIHHHH', self.FIELDS, rmsg)
+
+    # -------------------------------
+    @staticmethod
+    def percentile(ordered, p):
+        """ return the p'th percentile, nearest rank, of the ordered list """
+        if not ordered:
+            return None
+        k = max(0, min(len(ordered)-1, math.ceil(p/100*len(ordered))-1))
+        return ordered[k]
+
+    # -------------------------------
+    def run(self, count=100, length=32, mode=MODE_ECHO, delay=0):
+        """ send count test messages with payloads of length bytes, return dict of results:
+        bytes/s and frames/s of payload moved, round trip time percentiles in ms, bit errors and bit error rate,
+        and the MCU's and host's error counters """
+        self.stats(reset=True)
+        rx_errors = self.mmp.errors_rx
+        rtt = []
+        timeouts = 0
+        failures = 0
+        bit_errors = 0
+        bits = 0
+        moved = 0
+        start = time.monotonic()
+        for seq in range(count):
+            seq &= 0xffff
+            expected = self.payload(seq, length)
+            t = time.monotonic()
+            try:
+                if mode == self.MODE_ECHO:
+                    rmsg = self.sub_command(self.SC_ECHO, pack('<H', seq) + expected)
+                else:
+                    rmsg = self.sub_command(self.SC_GEN, pack('<HB', seq, length))
+            except ENoResponse:
+                timeouts += 1
+                continue
+            except EStatus:
+                failures += 1
+                continue
+            rtt.append((time.monotonic()-t)*1000)
+            data = bytes(rmsg.data)
+            if data[:2] != pack('<H', seq):
+                failures += 1
+                continue
+            # errors on the way back, MCU's stats have those on the way there
+            bit_errors += self.bit_errors(data[2:], expected)
+            bits += 8*length
+            # payload went both ways when echoed
+            moved += 2*length if mode == self.MODE_ECHO else length
+            if delay:
+                time.sleep(delay)
+        elapsed = time.monotonic()-start
+        mcu = self.stats()
+        bit_errors += mcu['bit_errors']
+        bits += 8*mcu['bytes']
+        rtt.sort()
+        d = {
+            'sent': count,
+            'received': len(rtt),
+            'timeouts': timeouts,
+            'failures': failures,
+            'bytes_per_sec': moved/elapsed if elapsed else 0,
+            'frames_per_sec': len(rtt)/elapsed if elapsed else 0,
+            'rtt_min_ms': rtt[0] if rtt else None,
+            'rtt_p50_ms': self.percentile(rtt, 50),
+            'rtt_p90_ms': self.percentile(rtt, 90),
+            'rtt_p99_ms': self.percentile(rtt, 99),
+            'rtt_max_ms': rtt[-1] if rtt else None,
+            'bit_errors': bit_errors,
+            'ber': bit_errors/bits if bits else None,
+            # each frame that fails its checksum has at least one bit in error
+            'ber_frames': (bit_errors + mcu['cs_fail'] + self.mmp.errors_rx - rx_errors)/bits if bits else None,
+            'host_rx_errors': self.mmp.errors_rx - rx_errors,
+        }
+        d.update({'mcu_'+k: v for k, v in mcu.items()})
+        return d
+
+    # -------------------------------
+    @staticmethod
+    def report(d):
+        """ return the results of run() as text """
+        def ms(v):
+            return '-' if v is None else f"{v:.2f}"
+        def rate(v):
+            return '-' if v is None else f"{v:.2e}"
+        return (f"sent: {d['sent']}, received: {d['received']}, timeouts: {d['timeouts']}, failures: {d['failures']}\n"
+                f"throughput: {d['bytes_per_sec']:.0f} bytes/s, {d['frames_per_sec']:.1f} frames/s\n"
+                f"rtt ms: min {ms(d['rtt_min_ms'])}, p50 {ms(d['rtt_p50_ms'])}, p90 {ms(d['rtt_p90_ms'])}, "
+                f"p99 {ms(d['rtt_p99_ms'])}, max {ms(d['rtt_max_ms'])}\n"
+                f"bit errors: {d['bit_errors']}, ber: {rate(d['ber'])}, ber including failed frames: {rate(d['ber_frames'])}\n"
+                f"mcu: checksum failures {d['mcu_cs_fail']}, timeouts {d['mcu_timeout']}, overruns {d['mcu_overrun']}, "
+                f"framing {d['mcu_framing']}, sequence gaps {d['mcu_seq_gaps']}; host rx errors {d['host_rx_errors']}")
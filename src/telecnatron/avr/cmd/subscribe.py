@@ -0,0 +1,34 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+import logging
+from struct import unpack, pack ;
+
+from telecnatron.mmp.MMP import MMP
+from telecnatron.avr.cmd.Handler import Handler
+from telecnatron.avr.cmd.Handler import ENoResponse, EStatus
+
+# -----------------------------------
+class Subscribe(Handler):
+    """ read and set which async messages the MCU sends on this link. Each link (endpoint) has its own mask,
+    bit n is async messages whose first data byte is n, bit 15 is those of 15 and above. """
+
+    ALL = 0xffff
+
+    # -------------------------------
+    @staticmethod
+    def bit(async_id):
+        """ return mask bit of the passed async message id """
+        return 1 << min(async_id, 15)
+
+    # -------------------------------
+    def read(self):
+        """ return this link's mask """
+        rmsg=self.command()
+        return unpack('<H', rmsg.data[:2])[0]
+
+    # -------------------------------
+    def set(self, mask):
+        """ set this link's mask, return it """
+        rmsg=self.command(pack('<H', mask))
+        return unpack('<H', rmsg.data[:2])[0]
@@ -0,0 +1,73 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+import logging
+from struct import unpack, pack ;
+
+from telecnatron.mmp.MMP import MMP
+from telecnatron.avr.cmd.Handler import Handler
+from telecnatron.avr.cmd.Handler import ENoResponse, EStatus
+
+# -----------------------------------
+class TaskStats(Handler):
+    """ read how long each of the MCU's tasks takes to run, how late they are run, and the CPU's duty cycle.
+    The MCU measures times in sysclk timer counts, these are converted to microseconds. """
+
+    # task number that reads the summary
+    SUMMARY = 0xff
+    # times that didn't fit
+    TIME_MAX = 0xffff
+
+    FIELDS = ('runs', 'total', 'min', 'max', 'late_max')
+    FIELDS_SUMMARY = ('num_tasks', 'counts_per_tick', 'tick_freq', 'ticks', 'idle_ticks')
+
+    # -------------------------------
+    def summary(self, reset=False):
+        """ return dict of number of tasks, timer and tick rates, and duty cycle: fraction of time busy, None if the MCU
+        doesn't sleep. If reset is True the statistics of all tasks and the duty cycle are reset afterwards. """
+        rmsg=self.command(pack('<BB', self.SUMMARY, reset))
+        d=self.rmsg_to_dict('<BHHII', self.FIELDS_SUMMARY, rmsg)
+        d['us_per_count']=1e6/(d['counts_per_tick']*d['tick_freq'])
+        d['duty']=1-d['idle_ticks']/d['ticks'] if d['ticks'] else None
+        return d
+
+    # -------------------------------
+    def read(self, task_num, reset=False, us_per_count=None):
+        """ return dict of task's run count and times. Times are microseconds, if us_per_count is passed, or timer
+        counts otherwise; min, avg and max are None if task hasn't been run, times that didn't fit are inf """
+        rmsg=self.command(pack('<BB', task_num, reset))
+        d=self.rmsg_to_dict('<IIHHH', self.FIELDS, rmsg)
+        scale=us_per_count or 1
+        def t(v):
+            return float('inf') if v == self.TIME_MAX else v*scale
+        runs=d['runs']
+        return {
+            'runs': runs,
+            'min': t(d['min']) if runs else None,
+            'avg': d['total']*scale/runs if runs else None,
+            'max': t(d['max']) if runs else None,
+            'late_max': t(d['late_max']),
+        }
+
+    # -------------------------------
+    def read_all(self, reset=False):
+        """ return (summary, list of each task's statistics in microseconds) """
+        s=self.summary()
+        tasks=[self.read(n, False, s['us_per_count']) for n in range(s['num_tasks'])]
+        if reset:
+            self.summary(True)
+        return s, tasks
+
+    # -------------------------------
+    @staticmethod
+    def report(summary, tasks, names=()):
+        """ return text table of read_all()'s results, names are the tasks' names in order of task number """
+        def us(v):
+            return f"{'-':>10}" if v is None else f"{v:10.0f}"
+        lines=[f"{'task':<14} {'runs':>8} {'min us':>10} {'avg us':>10} {'max us':>10} {'late us':>10}"]
+        for (n, t) in enumerate(tasks):
+            name=names[n] if n < len(names) else str(n)
+            lines.append(f"{name:<14} {t['runs']:8} {us(t['min'])} {us(t['avg'])} {us(t['max'])} {us(t['late_max'])}")
+        if summary['duty'] is not None:
+            lines.append(f"cpu busy {100*summary['duty']:.1f}% of {summary['ticks']/summary['tick_freq']:.1f}s")
+        return '\n'.join(lines)
@@ -0,0 +1,35 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+import logging
+from struct import unpack, pack ;
+
+from telecnatron.mmp.MMP import MMP
+from telecnatron.avr.cmd.Handler import Handler
+from telecnatron.avr.cmd.Handler import ENoResponse, EStatus
+
+# -----------------------------------
+class UartStats(Handler):
+    """ read the MCU's uart error counters, rx buffer high water mark, and async message queue drop counts """
+
+    # subcommands
+    SC_READ  = 0
+    SC_RESET = 1
+
+    FIELDS = ('frame_err', 'overrun', 'rx_full', 'flow_stops', 'rx_high_water', 'rx_size', 'tx_dropped')
+    # async message queue statistics, that follow the uart's
+    FIELDS_TXQ = ('txq_dropped_high', 'txq_dropped_telemetry', 'txq_dropped_log', 'txq_coalesced', 'txq_high_water', 'txq_blocks')
+
+    # -------------------------------
+    def read(self, reset=False):
+        """ return dict of the statistics, counters are zeroed afterwards if reset is True """
+        rmsg=self.sub_command(self.SC_RESET if reset else self.SC_READ)
+        if rmsg.len < 22:
+            # MCU doesn't have an async message queue
+            return self.rmsg_to_dict('<HHHHBBH', self.FIELDS, rmsg)
+        return self.rmsg_to_dict('<HHHHBBHHHHHBB', self.FIELDS+self.FIELDS_TXQ, rmsg)
+
+    # -------------------------------
+    def reset(self):
+        """ zero the counters, return the values that they had """
+        return self.read(True)
@@ -24,6 +24,8 @@
 import logging;
 from struct import *
 import queue
+import threading
+import time
 from telecnatron.mmp.MMP import MMP
 from telecnatron.mmp import AsyncCmd
 from telecnatron.mmp.MMP import MMPMsg
@@ -36,10 +38,11 @@ class CmdResponseMsg(MMPMsg):
         MMPMsg.__init__(self)
         self.cmd = 0;
         self.status = 0;
+        self.tag = None;
 
     def __str__(self):
         """ """
-        return "cmd: {}, status: {}: {}".format(self.cmd, self.status, MMPMsg.__str__(self));
+        return "cmd: {}, tag: {}, status: {}: {}".format(self.cmd, self.tag, self.status, MMPMsg.__str__(self));
         
 
 class AsyncCmd(MMP):
@@ -50,6 +53,20 @@ class AsyncCmd(MMP):
     FLAGS_BIT_BOOT  = 0X0
     # bit 1, if set then this is a CMD message, otherwise it is a ASYNC message
     FLAGS_BIT_CMD   = 0x1
+    # bit 4, if set then first data byte of CMD message is a tag, which MCU returns in the reply
+    FLAGS_BIT_TAG   = 0x4
+
+    # reply status: MCU's command queue was full, command should be resent
+    STATUS_BUSY     = 0xff
+    # reply status: command was too long to be queued
+    STATUS_TOO_LONG = 0xfe
+
+    # first data byte of bulk transfer fragment messages, see lib/mmp/mmp_bulk.h
+    BULK_ASYNC = 10
+    # bulk command subcommands, see lib/mmp/drivers/bulk.c
+    BULK_SC_ACK    = 0
+    BULK_SC_RESEND = 1
+    BULK_SC_ABORT  = 2
 
     def set_cmd(self, flags):
         return flags| (0x1 << self.FLAGS_BIT_CMD)
@@ -63,12 +80,17 @@ class AsyncCmd(MMP):
 
     def is_boot(self, flags):
         return flags == 0x1;
+
+    def is_tagged(self, flags):
+        return flags & (0x1 << self.FLAGS_BIT_TAG )
     
     def __init__(self, transport=None):
         """ """
         MMP.__init__(self, transport);
-        # init queue for async messages
-        self.asyncq = queue.Queue(maxsize=16);
+        # init queue for async messages, big enough for a few seconds of streamed telemetry
+        self.asyncq = queue.Queue(maxsize=256);
+        # async message type (first data byte) -> function that decodes message into the object put in asyncq
+        self.async_decoders = {}
         # init queue for cmd messages
         self.cmdq = queue.Queue(maxsize=1);
         # keep track of number of messages received
@@ -78,8 +100,39 @@ class AsyncCmd(MMP):
         self.errors_unrecognised_msg = 0
         self.errors_invalid_cmd_response = 0
         self.errors_response_timeout = 0
+        self.errors_unmatched_tag = 0
+        self.errors_async_dropped = 0
+        self.num_busy = 0
         # set True to have debug messages logged
         self.debug=False
+        # tagged commands, see enableTags()
+        self.tagged = False
+        # serialises untagged commands, and the sending of messages
+        self.cmd_lock = threading.Lock()
+        self.tx_lock = threading.Lock()
+        # tag -> queue that its reply is put in, for tagged commands that are awaiting replies
+        self.pending = {}
+        self.pending_lock = threading.Lock()
+        self.next_tag = 0
+        # limits number of tagged commands in flight to the MCU's queue length
+        self.in_flight = None
+
+
+    def setAsyncDecoder(self, msg_type, decoder):
+        """ Have async messages whose first data byte is msg_type decoded by decoder(msg) before being put in asyncq. 
+        decoder should return the decoded object, None if it has dealt with the message and it shouldn't be queued,
+        or raise an exception if the message is invalid. Pass decoder as None to remove. """
+        if decoder is None:
+            self.async_decoders.pop(msg_type, None)
+        else:
+            self.async_decoders[msg_type] = decoder
+
+
+    def enableTags(self, queue_len):
+        """ Send tagged commands, so several can be outstanding. queue_len is the number of commands that the MCU can queue,
+        as reported by its caps command: commands beyond that are held here until a reply frees a slot."""
+        self.in_flight = threading.BoundedSemaphore(max(1, queue_len))
+        self.tagged = True
 
 
     def handleMsg(self, msg):
@@ -89,7 +142,33 @@ class AsyncCmd(MMP):
         if self.is_async(msg.flags):
             logging.debug("added msg to async queue");
             self.num_async += 1
-            self.asyncq.put(msg)
+            if msg.len > 0 and msg.data[0] in self.async_decoders:
+                try:
+                    msg = self.async_decoders[msg.data[0]](msg)
+                except Exception as e:
+                    logging.warn("failed to decode async msg: {}: {}".format(msg, e));
+                if msg is None:
+                    return
+            try:
+                self.asyncq.put_nowait(msg)
+            except queue.Full:
+                # nobody is reading them: drop the oldest rather than stall the reader thread
+                self.errors_async_dropped += 1
+                try:
+                    self.asyncq.get_nowait()
+                except queue.Empty:
+                    pass
+                self.asyncq.put_nowait(msg)
+        elif self.is_cmd(msg.flags) and self.is_tagged(msg.flags):
+            # reply to a tagged command, give it to whoever is waiting on the tag
+            with self.pending_lock:
+                q = self.pending.get(msg.data[0]) if msg.len > 0 else None
+            if q is None:
+                logging.warn("reply with unknown tag: {}".format(msg));
+                self.errors_unmatched_tag += 1
+            else:
+                self.num_cmd += 1
+                q.put(msg)
         elif self.is_cmd(msg.flags):
             logging.debug("added msg to cmd queue");
             self.num_cmd += 1
@@ -115,52 +194,226 @@ class AsyncCmd(MMP):
                 raise Exception(f"msg_data must be of type bytes or type string but it is {t}")
         #logging.info(f"type of msg: {type(msg_data)}")            
 
-        # flush rx queue
-        while not self.cmdq.empty():
-            self.cmdq.get_nowait();
+        if self.tagged:
+            return self.sendReceiveTagged(cmd, msg_data, timeoutSec)
 
-        # prepend the msg_data with the cmd byte,
-        #logging.info(f"type of msg: {type(msg_data)}, len: {len(msg_data)}")                    
-        msg_data = pack("<B", cmd) + msg_data
-        if self.debug:
-            logging.info(f">>> {msg_data}")
-        # send msg
-        self.sendMsg(msg_data, flags=self.set_cmd(0));
-        # wait for response
-        try:
-            # get response message
-            rmsg= self.cmdq.get(True, timeoutSec)
+        with self.cmd_lock:
+            # flush rx queue
+            while not self.cmdq.empty():
+                self.cmdq.get_nowait();
+
+            # prepend the msg_data with the cmd byte,
+            #logging.info(f"type of msg: {type(msg_data)}, len: {len(msg_data)}")                    
+            msg_data = pack("<B", cmd) + msg_data
             if self.debug:
-                logging.info(f"<<< {rmsg}")
-            # make a new cmd-response objetc
-            crmsg = CmdResponseMsg();
-            crmsg.flags = rmsg.flags;
-            # response data length must be at least two, data[0] being the cmd number, data[1] being the status byte
-            if rmsg.len  < 2:
-                logging.warn("invalid response message for cmd: {}: msg: {}".format(cmd, rmsg))
-                self.errors_invalid_cmd_response += 1
+                logging.info(f">>> {msg_data}")
+            # send msg
+            with self.tx_lock:
+                self.sendMsg(msg_data, flags=self.set_cmd(0));
+            # wait for response
+            try:
+                # get response message
+                rmsg= self.cmdq.get(True, timeoutSec)
+            except queue.Empty as e:
+                logging.warn("receive timeout");
+                self.errors_response_timeout += 1
                 return None
-            # check cmd byte from response message
-            crmsg.cmd = rmsg.data[0];
-            if not crmsg.cmd == cmd:
-                # invalid response: cmd field of received message did not match that of sent message
-                logging.warn("invalid response to cmd: {}: {}".format(cmd, rmsg));
-                self.errors_invalid_cmd_response += 1
-                return None
-            # extract status code from the data
-            crmsg.status = rmsg.data[1];
-            # valid response, remove the cmd and status bytes from data
-            crmsg.data= rmsg.data[2:]
-            crmsg.len = len(crmsg.data)
-            self.num_responses += 1
-            #logging.info(f"reply msg received: {crmsg}")
-            return crmsg;
-        except queue.Empty as e:
-            logging.warn("receive timeout");
+            return self.cmdResponse(cmd, rmsg, 0)
+
+
+    def sendReceiveTagged(self, cmd, msg_data, timeoutSec):
+        """ Send a tagged command and wait for its reply. May be called from several threads at once,
+        replies are matched to commands by tag."""
+        deadline = time.monotonic() + timeoutSec
+        if not self.in_flight.acquire(True, timeoutSec):
+            logging.warn("timeout waiting to send cmd: {}".format(cmd));
             self.errors_response_timeout += 1
             return None
+        tag = None
+        try:
+            # allocate a tag that isn't in use
+            rq = queue.Queue(maxsize=1)
+            with self.pending_lock:
+                while self.next_tag in self.pending:
+                    self.next_tag = (self.next_tag + 1) & 0xff
+                tag = self.next_tag
+                self.next_tag = (self.next_tag + 1) & 0xff
+                self.pending[tag] = rq
+            msg_data = pack("<BB", tag, cmd) + msg_data
+            flags = self.set_cmd(0) | (0x1 << self.FLAGS_BIT_TAG)
+            while True:
+                if self.debug:
+                    logging.info(f">>> {msg_data}")
+                with self.tx_lock:
+                    self.sendMsg(msg_data, flags=flags);
+                try:
+                    rmsg = rq.get(True, max(0, deadline - time.monotonic()))
+                except queue.Empty as e:
+                    logging.warn("receive timeout, tag: {}".format(tag));
+                    self.errors_response_timeout += 1
+                    return None
+                crmsg = self.cmdResponse(cmd, rmsg, 1)
+                if crmsg is None or crmsg.status != self.STATUS_BUSY or time.monotonic() >= deadline:
+                    return crmsg
+                # MCU's queue was full, eg commands from another host, try again shortly.
+                self.num_busy += 1
+                time.sleep(0.001)
+        finally:
+            with self.pending_lock:
+                self.pending.pop(tag, None)
+            self.in_flight.release()
+
+
+    def cmdResponse(self, cmd, rmsg, hdr):
+        """ Return CmdResponseMsg made from reply message rmsg to command cmd, or None if it's invalid.
+        hdr is the number of bytes ahead of the cmd byte, ie 1 if reply is tagged. """
+        if self.debug:
+            logging.info(f"<<< {rmsg}")
+        # make a new cmd-response objetc
+        crmsg = CmdResponseMsg();
+        crmsg.flags = rmsg.flags;
+        # response data length must be at least two, data[0] being the cmd number, data[1] being the status byte
+        if rmsg.len  < hdr+2:
+            logging.warn("invalid response message for cmd: {}: msg: {}".format(cmd, rmsg))
+            self.errors_invalid_cmd_response += 1
+            return None
+        if hdr:
+            crmsg.tag = rmsg.data[0]
+        # check cmd byte from response message
+        crmsg.cmd = rmsg.data[hdr];
+        if not crmsg.cmd == cmd:
+            # invalid response: cmd field of received message did not match that of sent message
+            logging.warn("invalid response to cmd: {}: {}".format(cmd, rmsg));
+            self.errors_invalid_cmd_response += 1
+            return None
+        # extract status code from the data
+        crmsg.status = rmsg.data[hdr+1];
+        # valid response, remove the cmd and status bytes from data
+        crmsg.data= rmsg.data[hdr+2:]
+        crmsg.len = len(crmsg.data)
+        self.num_responses += 1
+        #logging.info(f"reply msg received: {crmsg}")
+        return crmsg;
 
 
+    def sendReceiveBatch(self, cmd, requests, timeoutSec = 0.5):
+        """ Send several commands in one message using the MCU's batch command, cmd being its command number.
+        requests is a list of (cmd, msg_data) tuples. Returns list of CmdResponseMsg, one for each sub-reply,
+        in order, or None if there was no valid reply. A list that is shorter than requests is returned if
+        not all the sub-commands were run, see batch status. """
+        msg_data = b''
+        for (scmd, sdata) in requests:
+            if type(sdata) == str:
+                sdata=bytes(sdata, 'utf-8')
+            msg_data += pack("<BB", scmd, len(sdata)) + sdata
+        rmsg = self.sendReceiveCmd(cmd, msg_data, timeoutSec)
+        if rmsg == None:
+            return None
+        if rmsg.status != 0:
+            logging.warn(f"batch status: {rmsg.status}")
+        replies=[]
+        i=0
+        while i+3 <= rmsg.len:
+            crmsg = CmdResponseMsg()
+            crmsg.flags = rmsg.flags
+            (crmsg.cmd, crmsg.status, n) = unpack("<BBB", rmsg.data[i:i+3])
+            crmsg.data = rmsg.data[i+3:i+3+n]
+            crmsg.len = len(crmsg.data)
+            replies.append(crmsg)
+            i += 3+n
+        return replies
+
+
+    def sendReceiveBulk(self, cmd, msg_data, bulk_cmd, timeoutSec = 0.5, retries = 5):
+        """ Send a command whose handler starts a bulk transfer, and return the transferred data as bytes, or None if
+        the command failed or the transfer didn't complete. bulk_cmd is the command number of the MCU's bulk command,
+        with which fragments are acknowledged. Fragments are reassembled in order, when one goes missing those after
+        it are discarded and MCU is asked to resend from it. """
+        fragq = queue.Queue()
+        def decoder(msg):
+            fragq.put(bytes(msg.data))
+            return None
+        self.setAsyncDecoder(self.BULK_ASYNC, decoder)
+        xfer = None
+        try:
+            rmsg = self.sendReceiveCmd(cmd, msg_data, timeoutSec)
+            if rmsg == None or rmsg.status != 0 or rmsg.len < 7:
+                logging.warn(f"bulk transfer not started: {rmsg}")
+                return None
+            (xfer, length, frag_size, window) = unpack("<BIBB", rmsg.data[:7])
+            data = bytearray()
+            seq = 0
+            acked = 0
+            resent = None
+            dup_acked = None
+            tries = 0
+            while True:
+                try:
+                    frag = fragq.get(True, timeoutSec)
+                except queue.Empty:
+                    tries += 1
+                    if tries > retries:
+                        logging.warn(f"bulk transfer {xfer} timed out at fragment {seq}")
+                        self.sendReceiveCmd(bulk_cmd, pack("<BB", self.BULK_SC_ABORT, xfer), timeoutSec)
+                        return None
+                    self.sendReceiveCmd(bulk_cmd, pack("<BBH", self.BULK_SC_RESEND, xfer, seq), timeoutSec)
+                    continue
+                if len(frag) < 4:
+                    continue
+                (fxfer, fseq) = unpack("<BH", frag[1:4])
+                if fxfer != xfer:
+                    # from an earlier transfer
+                    continue
+                if fseq != seq:
+                    if (fseq - seq) & 0xffff < 0x8000:
+                        if resent != seq:
+                            # one has gone missing, have MCU go back to it. Once is enough, those already in flight will be out of order too.
+                            self.sendReceiveCmd(bulk_cmd, pack("<BBH", self.BULK_SC_RESEND, xfer, seq), timeoutSec)
+                            resent = seq
+                    elif dup_acked != seq:
+                        # one we already have: MCU missed an acknowledgement and has gone back, have it skip ahead
+                        self.sendReceiveCmd(bulk_cmd, pack("<BBH", self.BULK_SC_ACK, xfer, seq), timeoutSec)
+                        dup_acked = seq
+                    continue
+                tries = 0
+                data += frag[4:]
+                seq = (seq + 1) & 0xffff
+                if len(frag) - 4 < frag_size:
+                    # short fragment is the last
+                    self.sendReceiveCmd(bulk_cmd, pack("<BBH", self.BULK_SC_ACK, xfer, seq), timeoutSec)
+                    return bytes(data)
+                if (seq - acked) & 0xffff >= max(1, window // 2):
+                    # acknowledge before window fills, so MCU can keep sending
+                    self.sendReceiveCmd(bulk_cmd, pack("<BBH", self.BULK_SC_ACK, xfer, seq), timeoutSec)
+                    acked = seq
+        finally:
+            self.setAsyncDecoder(self.BULK_ASYNC, None)
 
 
+    def negotiateBaud(self, cmd, baud, confirmTimeoutMs=500):
+        """ Switch MCU and transport to a new baud rate using the MCU's baud command, cmd being its command number.
+        The MCU acknowledges the proposed rate at the current rate then switches, we then switch and confirm at the new rate.
+        If the MCU does not receive the confirmation within confirmTimeoutMs it reverts to the old rate, as do we.
+        Returns True if new rate is in use, False otherwise.
+        """
+        old = self.transport.getBaud()
+        # propose: subcommand 1, baud rate, timeout
+        rmsg = self.sendReceiveCmd(cmd, pack("<BIH", 1, baud, confirmTimeoutMs))
+        if rmsg == None or rmsg.status != 0:
+            logging.warn(f"MCU did not accept baud rate {baud}")
+            return False
+        self.transport.drain()
+        # MCU switches as soon as its reply has been sent, give it time to do so
+        time.sleep(0.01)
+        self.transport.setBaud(baud)
+        # confirm: subcommand 2
+        rmsg = self.sendReceiveCmd(cmd, pack("<B", 2))
+        if rmsg != None and rmsg.status == 0:
+            logging.info(f"baud rate set to {baud}, actual: {unpack('<I', rmsg.data)[0]}")
+            return True
+        # MCU will revert once the confirmation timeout has expired
+        logging.warn(f"baud rate {baud} not confirmed, reverting to {old}")
+        time.sleep(confirmTimeoutMs/1000)
+        self.transport.setBaud(old)
+        return False
 
@@ -16,6 +16,7 @@
 import sys, os, threading, time, binascii, traceback, logging
 from struct import * ;
 from telecnatron.mmp.transport import Transport
+from telecnatron.mmp.parser import make_parser, PyParser, REC_LOG
 
 
 class MMPMsg:
@@ -51,17 +52,27 @@ class MMP:
     MSG_STX=b'\2'
     MSG_ETX=b'\3'
 
-    # string used to match logger strings
-    LOGS = b'	LOG'
-    # max length of log string
-    LOGS_MAX = 255;
+    # flags bit marking a v2 frame: ETX is followed by CRC-16/CCITT of len, flags and data, low byte first,
+    # rather than by the checksum byte.
+    FLAGS_CRC = 0x04
+    CRC_INIT  = 0xffff
+    # flags bit marking a COBS framed message: the COBS encoding of flags, data and CRC-16 (as above, len being the
+    # length of the data), with a zero before and after. A zero always marks a frame boundary.
+    FLAGS_COBS = 0x08
+    COBS_DELIM = b'\0'
 
-    def __init__(self, transport=None):
+    def __init__(self, transport=None, native=True):
         """ """
         self.alive= True
         self.transport=transport
         # Default message flags byte, used if None is specified in method calls
         self.flags=1
+        # send v2 frames, set once MCU has said that it can handle them, see telecnatron.avr.cmd.caps
+        self.crc=False
+        # send COBS framed messages, likewise set once MCU has said that it can handle them
+        self.cobs=False
+        # max length of command data that MCU can receive, set by telecnatron.avr.cmd.caps. None if not known.
+        self.cmd_max_len=None
         if transport == None:
             # use default transport
             logging.warn("MMP is using default transport")
@@ -73,6 +84,8 @@ class MMP:
         # keep track of how many messages and log strings have been received
         self.num_log = 0;
         self.num_msg = 0;
+        # receiver: lib/mmp/mmp.c built for the host if it's been built and native is True, see telecnatron.mmp.parser
+        self.parser = make_parser(self.nonHandledByte, native)
         # init reader thread
         self.reader = threading.Thread(target=self.readerThread)
         self.reader.start();
@@ -88,6 +101,13 @@ class MMP:
         return self.transport.readByte();
 
 
+    def read(self):
+        """ Return all the chars that have been received, or an empty bytes if none were before the timeout """
+        if hasattr(self.transport, 'read'):
+            return self.transport.read()
+        return self.transport.readByte()
+
+
     def write(self, databytes):
         """ """
         self.transport.write(databytes);
@@ -109,6 +129,31 @@ class MMP:
         return (256 - intCS) %256
 
 
+    @classmethod
+    def calcCRC(cls, length, flags, data):
+        """ return CRC-16 of a v2 frame """
+        return binascii.crc_hqx(bytes((length, flags)) + bytes(data), cls.CRC_INIT)
+
+
+    @staticmethod
+    def cobsEncode(data):
+        """ return COBS encoding of data, without delimiters """
+        out = bytearray()
+        for run in bytes(data).split(b'\0'):
+            # each zero separated run, runs of more than 254 are split without an implied zero
+            while len(run) >= 254:
+                out.append(255)
+                out.extend(run[:254])
+                run = run[254:]
+            out.append(len(run)+1)
+            out.extend(run)
+        return bytes(out)
+
+
+    # return decoded data, or None if enc is not a valid encoding
+    cobsDecode = staticmethod(PyParser.cobsDecode)
+
+
     def handleMsg(self, msg):
         """ Called when a message is received. Expected to be overriden in subclasses. """
         logging.info(f"PCRX: len: {msg.len}, str: {str(msg.data)}");
@@ -123,7 +168,13 @@ class MMP:
         # use default flags if not specified as parameter
         if flags == None:
             flags=self.flags;
+        self.write(self.encodeMsg(msg_data, flags, self.crc, self.cobs))
 
+
+    @classmethod
+    def encodeMsg(cls, msg_data, flags, crc=False, cobs=False):
+        """ Return msg_data framed as a message: COBS framed if cobs, otherwise v2 if crc, otherwise v1.
+        Bootloader messages, flags 0x1, are always v1. """
         # check that msg is of type bytes
         if type(msg_data) != bytes:
             if type(msg_data) == str:
@@ -133,173 +184,54 @@ class MMP:
                 raise Exception(f"msg_data must be of type bytes or type string but it is {type(msg_data)}")
             
         length = len(msg_data)
+        if cobs and flags != 0x1:
+            # COBS frame, but bootloader messages are always v1
+            flags |= cls.FLAGS_COBS
+            content = bytes((flags,)) + msg_data + pack('<H', cls.calcCRC(length, flags, msg_data))
+            return cls.COBS_DELIM + cls.cobsEncode(content) + cls.COBS_DELIM
+        if crc and flags != 0x1:
+            # v2 frame, but bootloader messages are always v1
+            flags |= cls.FLAGS_CRC
         # make up  header
-        # checksum
-        cs=length+flags;
-        m=pack('<cBBc', self.MSG_SOM, length, flags, self.MSG_STX);
-        # add data
-        for ch in msg_data:
-            # XXX python3: ch is type 'string', needs to be 'bytes' for pack() to work
-            #print(f"type of ch: {type(ch)}")
-            if type(ch)==int:
-                # XXX should always be int?
-                m += pack('<c',ch.to_bytes(1,'big'));
-            else:
-                m += pack('<c',ch)
-            #cs += ord(ch)
-            cs += ch
-            cs = cs % 256
+        m=pack('<cBBc', cls.MSG_SOM, length, flags, cls.MSG_STX) + msg_data
         # pack ETX
-        m += pack('<c', self.MSG_ETX)
-        # pack CS
-#        m += pack('<B', self.calcCS(cs));
-        m += pack('<B', cs);
-        #logging.info(f"msg about to be sent: {m}, data: {msg_data}")
-        self.write(m)
+        m += pack('<c', cls.MSG_ETX)
+        if flags & cls.FLAGS_CRC:
+            # pack CRC
+            m += pack('<H', cls.calcCRC(length, flags, msg_data))
+        else:
+            # pack CS
+            m += pack('<B', (length + flags + sum(msg_data)) % 256);
+        return m
 
 
     def readerThread(self):
-        """ """
-        # states
-        SIDLE  = 0
-        SLOG   = 1
-        SSTX   = 2
-        SDATA  = 3
-        SETX   = 4
-        SLEN   = 5
-        SCS    = 6
-        SFLAGS = 7
-        
-        logi = 0;
-        state = SIDLE;
-        logstr = b'';
-        msg = MMPMsg();
-        # checksum
-        cs = 0;
+        """ Read whatever has been received and parse it, handle the messages and log strings that it completes """
         while self.alive:
             try:
-                c = self.readByte();
-                #logging.info(f"type c: {type(c)}")
-                if(c != None and len(c) != 0):
-                    # char (python string) has been received,
-                    #if ( ord(c) >= 32 and ord(c)<=127):
-                    #    a=c;
-                    #else:
-                    #    a='_'
-                    #s="~0x{:02x}={}".format(ord(c),a);
-                    #print s,
-                    
-                    # ---------------------------------
-                    if state == SIDLE:
-                        if c == self.MSG_SOM:
-                            # got start byte
-                            logi = 0
-                            state = SLEN
-                            msg = MMPMsg();
-                            logging.debug("-SOM-")
-                        else:
-                            if c == self.LOGS[logi].to_bytes(1,'big'):
-                                #logging.info(f"received ch: {c}, logi: {logi}: {self.LOGS[logi].to_bytes(1,'big')}, {len(self.LOGS)}")
-                                # got a LOGS char
-                                logi += 1
-                                if logi == len(self.LOGS):
-                                    # Yup, got all the LOGS chars, this is a LOG string
-                                    #logging.info(f"got log string!")
-                                    logstr=self.LOGS;
-                                    state = SLOG
-                                    logi=0;
-                            else:
-                                # nope, false alarm, char received was not start of message, not start of log string
-                                logi=0;
-                                self.nonHandledByte(c)
-                    # ---------------------------------
-                    elif state == SLOG:
-                        # we're receiving a log msg
-                        if c == b'\n':
-                            # this is end of log string
-                            #logging.info(f"end of log string: {c}, type: {type(logstr)}")
+                data = self.read()
+                if data:
+                    for rtype, flags, d in self.parser.feed(data):
+                        if rtype == REC_LOG:
                             self.num_log += 1
-                            # don't give them the leading \t
-                            #logging.info(f"type of logstr: {type(logstr)}, str: {logstr}")
-                            self.logStrReceived(logstr[1:])
-                            state = SIDLE
-                            logstr = b'';
-                        else:
-                            logstr = logstr + c;
-                            if len(logstr) > self.LOGS_MAX:
-                                logging.warn("log string is too long. Truncated: "+logstr.decode('utf-8')+"\n")
-                                self.errors_log += 1;
-                                self.logStrReceived(logstr)
-                                state = SIDLE
-                                logstr = b'';
-                    # ---------------------------------
-                    elif state == SLEN:
-                        # recived char is message length
-                        msg.len = ord(c)
-                        cs = msg.len 
-                        logging.debug("-LEN-")
-                        state = SFLAGS
-
-                    elif state == SFLAGS:
-                        # recived char is message flags
-                        msg.flags = ord(c)
-                        cs += ord(c) 
-                        logging.debug("-FLAGS-")
-                        state = SSTX
-
-                    elif state == SSTX:
-                        if (c == self.MSG_STX):
-                            # got STX char as expected
-                            logging.debug("-STX-")
-                            state = SDATA
-                        else:
-                            # did not get SSTX char when expected
-                            logging.debug("!STX not seen!")
-                            self.errors_rx += 1
-                            state = SIDLE
-                    elif state == SDATA:
-                        # we're receiving msg data.
-                        # XXX note: msg must contain at least one byte of data, ie no zero sized data is allowed here
-                        msg.data.extend(c);
-                        #logging.debug("d:"+c)
-                        cs += ord(c)
-                        msg.count += 1
-                        if msg.count == msg.len:
-                            # that was the last of the data
-                            state = SETX
-
-                    elif state == SETX:
-                        if( c == self.MSG_ETX ):
-                            # got ETX char as expected.
-                            logging.debug("-ETX-")
-                            state = SCS
+                            self.logStrReceived(d)
                         else:
-                            # did not get ETX char as expected
-                            self.errors_rx += 1
-                            logging.debug("!ETX not seen!")
-
-                    elif state == SCS:
-                        if ord(c) == self.calcCS(cs) :
-                            # checksum was valid, message is complete
+                            msg = MMPMsg()
+                            msg.flags = flags
+                            msg.data = bytearray(d)
+                            msg.len = msg.count = len(d)
                             self.num_msg += 1
                             self.handleMsg(msg)
-                        else:
-                            # checksum was invalid
-                            self.errors_rx += 1
-                            logging.debug("!invalid checksum, expected: 0x{:x} got 0x{:x}".format(self.calcCS(cs), ord(c)))
-                        state = SIDLE
-
                 else:
-                    # timeout: no byte received
-                    if state != SIDLE:
-                        logging.debug("timeout")
-                        self.errors_timeout += 1
-                        state = SIDLE
-                    pass
-
+                    # timeout: nothing received
+                    self.parser.timeout()
+                rx, timeout, log = self.parser.errors()
+                self.errors_rx += rx
+                self.errors_timeout += timeout
+                self.errors_log += log
             except Exception as e:
                 logging.error("Caught exception in reader thread: {}".format(e))
-                traceback.print_exc(e)
+                traceback.print_exc()
 
 
     def display_stats(self):
@@ -318,6 +250,7 @@ class MMP:
         print ("unrecognised messages:   {}".format(self.errors_unrecognised_msg))
         print ("invalid response errors: {}".format(self.errors_invalid_cmd_response))
         print ("response timeout errors: {}".format(self.errors_response_timeout))
+        print ("async messages dropped:  {}".format(self.errors_async_dropped))
         print("")
 
         
@@ -0,0 +1,429 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+""" asyncio mmp client.
+
+AioCmd is an asyncio.Protocol, so it runs on any asyncio transport: open_serial() connects it to a serial
+port with non-blocking I/O, and loop.create_connection() to eg a ser2net TCP bridge. There is no reader
+thread: received chars are parsed as they arrive, see telecnatron.mmp.parser, and each command's reply
+resolves that command's future. Once tagged commands are enabled, see enableTags() and enableCaps(), any
+number of coroutines may have commands outstanding at once, up to the MCU's queue length, and replies are
+matched to them by tag. Untagged commands are sent one at a time.
+
+Async messages are read with an async iterator:
+
+    mmp = await open_serial('/dev/ttyUSB0', 38400)
+    await mmp.enableCaps(MMPCmd.CMD_CAPS)
+    async for msg in mmp.messages():
+        ...
+
+Serial ports are POSIX only, as open_serial() uses the event loop's add_reader().
+"""
+import asyncio, os, logging, time
+from struct import pack
+
+from telecnatron.mmp.MMP import MMP, MMPMsg
+from telecnatron.mmp.AsyncCmd import AsyncCmd
+from telecnatron.mmp.parser import make_parser, REC_LOG
+
+# -----------------------------------
+class AsyncMessages:
+    """ async iterator over the async messages that AioCmd receives, see AioCmd.messages() """
+
+    def __init__(self, mmp, types, maxsize):
+        self.mmp = mmp
+        self.types = None if types is None else frozenset(types)
+        self.queue = asyncio.Queue(maxsize)
+        self.closed = False
+
+    def put(self, msg):
+        """ queue msg, dropping the oldest if nobody has been reading them """
+        if self.queue.full():
+            self.mmp.errors_async_dropped += 1
+            self.queue.get_nowait()
+        self.queue.put_nowait(msg)
+
+    def close(self):
+        """ stop receiving messages, iteration ends once those already queued have been read """
+        if not self.closed:
+            self.closed = True
+            self.mmp.subscribers.discard(self)
+            if self.queue.full():
+                self.queue.get_nowait()
+            self.queue.put_nowait(None)
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        msg = await self.queue.get()
+        if msg is None:
+            raise StopAsyncIteration
+        return msg
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, *exc):
+        self.close()
+
+
+# -----------------------------------
+class AioCmd(asyncio.Protocol):
+    """ asyncio counterpart of telecnatron.mmp.AsyncCmd """
+
+    FLAGS_BIT_CMD   = AsyncCmd.FLAGS_BIT_CMD
+    FLAGS_BIT_TAG   = AsyncCmd.FLAGS_BIT_TAG
+    STATUS_BUSY     = AsyncCmd.STATUS_BUSY
+    STATUS_TOO_LONG = AsyncCmd.STATUS_TOO_LONG
+    # caps command's capability bits, see telecnatron.avr.cmd.caps
+    CAP_CRC16 = 0x01
+    CAP_COBS  = 0x02
+    CAP_TAG   = 0x04
+
+    # flags tests and reply checks are those of AsyncCmd
+    is_cmd      = AsyncCmd.is_cmd
+    is_async    = AsyncCmd.is_async
+    is_tagged   = AsyncCmd.is_tagged
+    set_cmd     = AsyncCmd.set_cmd
+    cmdResponse = AsyncCmd.cmdResponse
+    setAsyncDecoder = AsyncCmd.setAsyncDecoder
+
+    # -------------------------------
+    def __init__(self, native=True, rx_timeout=0.008):
+        """ native: use the native parser if it's been built. rx_timeout: seconds without chars after
+        which a partly received message is abandoned. """
+        self.parser = make_parser(None, native)
+        self.rx_timeout = rx_timeout
+        self.rx_timer = None
+        self.transport = None
+        self.loop = None
+        # send v2 frames, COBS framed messages and tagged commands, once MCU has said it can handle them
+        self.crc = False
+        self.cobs = False
+        self.tagged = False
+        # max length of command data that MCU can receive, set by enableCaps(). None if not known.
+        self.cmd_max_len = None
+        # (cmd, future) of the untagged command that is awaiting its reply
+        self.untagged = None
+        self.cmd_lock = None
+        # tag -> future of tagged command that is awaiting its reply
+        self.pending = {}
+        self.next_tag = 0
+        # limits number of tagged commands in flight to the MCU's queue length
+        self.in_flight = None
+        # async message type (first data byte) -> decoder, as for AsyncCmd
+        self.async_decoders = {}
+        self.subscribers = set()
+        self.debug = False
+        self.num_msg = 0
+        self.num_log = 0
+        self.num_async = 0
+        self.num_cmd = 0
+        self.num_responses = 0
+        self.num_busy = 0
+        self.errors_rx = 0
+        self.errors_timeout = 0
+        self.errors_log = 0
+        self.errors_unrecognised_msg = 0
+        self.errors_invalid_cmd_response = 0
+        self.errors_response_timeout = 0
+        self.errors_unmatched_tag = 0
+        self.errors_async_dropped = 0
+
+    # -------------------------------
+    # asyncio.Protocol
+    def connection_made(self, transport):
+        self.transport = transport
+        self.loop = asyncio.get_running_loop()
+        self.cmd_lock = asyncio.Lock()
+
+    def data_received(self, data):
+        if self.rx_timer:
+            self.rx_timer.cancel()
+        for rtype, flags, d in self.parser.feed(data):
+            if rtype == REC_LOG:
+                self.num_log += 1
+                self.logStrReceived(d)
+            else:
+                msg = MMPMsg()
+                msg.flags = flags
+                msg.data = bytearray(d)
+                msg.len = msg.count = len(d)
+                self.num_msg += 1
+                self.handleMsg(msg)
+        self.rx_timer = self.loop.call_later(self.rx_timeout, self.rxTimeout)
+        self.countErrors()
+
+    def connection_lost(self, exc):
+        if self.rx_timer:
+            self.rx_timer.cancel()
+        err = ConnectionError(f"mmp connection lost: {exc}")
+        for fut in list(self.pending.values()) + ([self.untagged[1]] if self.untagged else []):
+            if not fut.done():
+                fut.set_exception(err)
+        for s in list(self.subscribers):
+            s.close()
+
+    # -------------------------------
+    def rxTimeout(self):
+        """ nothing has been received for rx_timeout """
+        self.rx_timer = None
+        self.parser.timeout()
+        self.countErrors()
+
+    def countErrors(self):
+        rx, timeout, log = self.parser.errors()
+        self.errors_rx += rx
+        self.errors_timeout += timeout
+        self.errors_log += log
+
+    # -------------------------------
+    def logStrReceived(self, logStr):
+        """ """
+        logging.info(f"MCU: {logStr}")
+
+    # -------------------------------
+    def sendMsg(self, msg_data, flags):
+        """ send message """
+        self.transport.write(MMP.encodeMsg(msg_data, flags, self.crc, self.cobs))
+
+    # -------------------------------
+    def handleMsg(self, msg):
+        """ give reply to the command awaiting it, or async message to those iterating over them """
+        if self.is_async(msg.flags):
+            self.num_async += 1
+            msg_type = msg.data[0] if msg.len > 0 else None
+            if msg_type in self.async_decoders:
+                try:
+                    msg = self.async_decoders[msg_type](msg)
+                except Exception as e:
+                    logging.warning("failed to decode async msg: {}: {}".format(msg, e))
+                if msg is None:
+                    return
+            for s in list(self.subscribers):
+                if s.types is None or msg_type in s.types:
+                    s.put(msg)
+        elif self.is_cmd(msg.flags) and self.is_tagged(msg.flags):
+            fut = self.pending.get(msg.data[0]) if msg.len > 0 else None
+            if fut is None or fut.done():
+                logging.warning("reply with unknown tag: {}".format(msg))
+                self.errors_unmatched_tag += 1
+            else:
+                self.num_cmd += 1
+                fut.set_result(msg)
+        elif self.is_cmd(msg.flags):
+            if self.untagged is None or self.untagged[1].done() or msg.len < 1 or msg.data[0] != self.untagged[0]:
+                # eg the late reply to a command that timed out
+                logging.warning("unexpected reply: {}".format(msg))
+                self.errors_invalid_cmd_response += 1
+            else:
+                self.num_cmd += 1
+                self.untagged[1].set_result(msg)
+        else:
+            logging.warning("Unhandled msg flags: {}".format(msg))
+            self.errors_unrecognised_msg += 1
+
+    # -------------------------------
+    def messages(self, types=None, maxsize=256):
+        """ return async iterator over the async messages that are received from now on, or just those whose
+        first data byte is in types. When more than maxsize are waiting to be read the oldest is dropped.
+        Use it as an async context manager, or close() it, to stop receiving them. """
+        s = AsyncMessages(self, types, maxsize)
+        self.subscribers.add(s)
+        return s
+
+    def __aiter__(self):
+        return self.messages()
+
+    # -------------------------------
+    def enableTags(self, queue_len):
+        """ Send tagged commands, up to queue_len at once, the number that MCU can queue. """
+        self.in_flight = asyncio.Semaphore(max(1, queue_len))
+        self.tagged = True
+
+    async def enableCaps(self, caps_cmd, crc=True, cobs=False, tags=True):
+        """ Ask MCU for its capabilities using its caps command, and use those asked for that it has.
+        Return dict of its version, capability bits, max reply length, queue length and max command data length,
+        or None. Commands longer than that are then refused by sendReceiveCmd(). """
+        rmsg = await self.sendReceiveCmd(caps_cmd)
+        if rmsg is None or rmsg.status != 0 or rmsg.len < 3:
+            return None
+        caps = dict(zip(('version', 'caps', 'max_len'), rmsg.data[:3]))
+        caps['queue_len'] = rmsg.data[3] if rmsg.len >= 4 else 1
+        caps['cmd_max_len'] = rmsg.data[4] if rmsg.len >= 5 else None
+        if caps['cmd_max_len'] is not None:
+            self.cmd_max_len = caps['cmd_max_len']
+        self.crc = crc and bool(caps['caps'] & self.CAP_CRC16)
+        self.cobs = cobs and bool(caps['caps'] & self.CAP_COBS)
+        if tags and caps['caps'] & self.CAP_TAG:
+            self.enableTags(caps['queue_len'])
+        return caps
+
+    # -------------------------------
+    async def sendReceiveCmd(self, cmd, msg_data=b'', timeoutSec=0.5):
+        """ Send command and return its reply as a CmdResponseMsg, or None if there wasn't a valid one in time. """
+        if type(msg_data) == str:
+            msg_data = bytes(msg_data, 'utf-8')
+        if self.cmd_max_len is not None and len(msg_data) > self.cmd_max_len:
+            raise ValueError(f"command {cmd} data is {len(msg_data)} bytes, mcu can receive {self.cmd_max_len}")
+        if self.tagged:
+            return await self.sendReceiveTagged(cmd, bytes(msg_data), timeoutSec)
+        async with self.cmd_lock:
+            fut = self.loop.create_future()
+            self.untagged = (cmd, fut)
+            try:
+                self.sendMsg(pack("<B", cmd) + msg_data, self.set_cmd(0))
+                rmsg = await asyncio.wait_for(fut, timeoutSec)
+            except asyncio.TimeoutError:
+                logging.warning("receive timeout, cmd: {}".format(cmd))
+                self.errors_response_timeout += 1
+                return None
+            finally:
+                self.untagged = None
+            return self.cmdResponse(cmd, rmsg, 0)
+
+    async def sendReceiveTagged(self, cmd, msg_data, timeoutSec):
+        """ Send tagged command and return its reply, or None. """
+        deadline = time.monotonic() + timeoutSec
+        try:
+            await asyncio.wait_for(self.in_flight.acquire(), timeoutSec)
+        except asyncio.TimeoutError:
+            logging.warning("timeout waiting to send cmd: {}".format(cmd))
+            self.errors_response_timeout += 1
+            return None
+        tag = None
+        try:
+            while self.next_tag in self.pending:
+                self.next_tag = (self.next_tag + 1) & 0xff
+            tag = self.next_tag
+            self.next_tag = (self.next_tag + 1) & 0xff
+            flags = self.set_cmd(0) | (0x1 << self.FLAGS_BIT_TAG)
+            while True:
+                fut = self.loop.create_future()
+                self.pending[tag] = fut
+                self.sendMsg(pack("<BB", tag, cmd) + msg_data, flags)
+                try:
+                    rmsg = await asyncio.wait_for(fut, max(0, deadline - time.monotonic()))
+                except asyncio.TimeoutError:
+                    logging.warning("receive timeout, tag: {}".format(tag))
+                    self.errors_response_timeout += 1
+                    return None
+                crmsg = self.cmdResponse(cmd, rmsg, 1)
+                if crmsg is None or crmsg.status != self.STATUS_BUSY or time.monotonic() >= deadline:
+                    return crmsg
+                # MCU's queue was full, try again shortly
+                self.num_busy += 1
+                await asyncio.sleep(0.001)
+        finally:
+            self.pending.pop(tag, None)
+            self.in_flight.release()
+
+    # -------------------------------
+    def close(self):
+        if self.transport:
+            self.transport.close()
+
+
+# -----------------------------------
+class AioSerialTransport(asyncio.Transport):
+    """ asyncio transport for a pyserial port, using non-blocking reads and writes of its file descriptor """
+
+    def __init__(self, loop, protocol, ser):
+        super().__init__()
+        self.loop = loop
+        self.protocol = protocol
+        self.serial = ser
+        self.fd = ser.fileno()
+        os.set_blocking(self.fd, False)
+        self.wbuf = bytearray()
+        self.closing = False
+        loop.add_reader(self.fd, self.readReady)
+        loop.call_soon(protocol.connection_made, self)
+
+    def readReady(self):
+        try:
+            data = os.read(self.fd, 4096)
+        except (BlockingIOError, InterruptedError):
+            return
+        except OSError as e:
+            self.abort(e)
+            return
+        if data:
+            self.protocol.data_received(data)
+
+    def write(self, data):
+        if self.closing:
+            return
+        if not self.wbuf:
+            try:
+                n = os.write(self.fd, data)
+            except (BlockingIOError, InterruptedError):
+                n = 0
+            except OSError as e:
+                self.abort(e)
+                return
+            data = data[n:]
+            if not data:
+                return
+            self.loop.add_writer(self.fd, self.writeReady)
+        self.wbuf += data
+
+    def writeReady(self):
+        try:
+            n = os.write(self.fd, self.wbuf)
+        except (BlockingIOError, InterruptedError):
+            return
+        except OSError as e:
+            self.abort(e)
+            return
+        del self.wbuf[:n]
+        if not self.wbuf:
+            self.loop.remove_writer(self.fd)
+            if self.closing:
+                self.abort()
+
+    def get_write_buffer_size(self):
+        return len(self.wbuf)
+
+    def setBaud(self, baud):
+        """ Change the baud rate, call once writes have been sent """
+        self.serial.baudrate = baud
+
+    def get_extra_info(self, name, default=None):
+        return self.serial if name == 'serial' else default
+
+    def is_closing(self):
+        return self.closing
+
+    def close(self):
+        """ close once buffered writes have been sent """
+        if self.closing:
+            return
+        self.closing = True
+        self.loop.remove_reader(self.fd)
+        if not self.wbuf:
+            self.abort()
+
+    def abort(self, exc=None):
+        if self.serial is None:
+            return
+        self.closing = True
+        self.loop.remove_reader(self.fd)
+        self.loop.remove_writer(self.fd)
+        self.serial.close()
+        self.serial = None
+        self.loop.call_soon(self.protocol.connection_lost, exc)
+
+
+# -----------------------------------
+async def open_serial(port, baud=38400, **kwargs):
+    """ open serial port and return connected AioCmd, kwargs are passed to AioCmd """
+    import serial
+    loop = asyncio.get_running_loop()
+    mmp = AioCmd(**kwargs)
+    ser = serial.Serial(port, baud, timeout=0)
+    AioSerialTransport(loop, mmp, ser)
+    # connection_made is called soon
+    await asyncio.sleep(0)
+    return mmp
@@ -0,0 +1,149 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+# Tokenized log messages. When the MCU is built with LOG_TOKENS, LOG_xxx_FP() format strings
+# stay on the host: configure.py gives each one an id and writes them to a dictionary, the MCU
+# sends the id and the raw argument bytes as an async message, and we put the text back together here.
+import re, json, struct, codecs
+
+# first data byte of async log messages, as LOG_TOKEN_ASYNC_ID in lib/log.h
+ASYNC_LOG = 9
+# dictionary written by configure.py
+DICT_FILE = 'log_tokens.json'
+
+# argument types, as LOG_ARG_xxx in lib/log.h
+ARG_INT    = 1
+ARG_LONG   = 2
+ARG_DOUBLE = 3
+ARG_STR    = 4
+# max number of arguments, as each takes a nibble of a uint32_t
+ARGS_MAX = 8
+
+LEVELS = ('DEBUG', 'INFO', 'WARN', 'ERROR')
+
+# printf conversion: flags, width, precision, length, conversion
+RE_CONV = re.compile(r'%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d*))?(hh|h|ll|l)?([a-zA-Z%])')
+
+# conversion char -> argument type
+CONV_TYPES = { 'd': ARG_INT, 'i': ARG_INT, 'u': ARG_INT, 'o': ARG_INT, 'x': ARG_INT, 'X': ARG_INT, 'c': ARG_INT, 'p': ARG_INT,
+               'f': ARG_DOUBLE, 'F': ARG_DOUBLE, 'e': ARG_DOUBLE, 'E': ARG_DOUBLE, 'g': ARG_DOUBLE, 'G': ARG_DOUBLE,
+               's': ARG_STR }
+
+# ---------------------------------------
+def c_unescape(lit):
+    """ Return the text of the C string literal body lit, eg with \\n replaced by a newline """
+    return codecs.decode(lit, 'unicode_escape')
+
+# ---------------------------------------
+def arg_types(fmt):
+    """ Return list of (type, conversion) for the arguments that the printf format fmt consumes,
+    or None if it can't be tokenized: too many arguments, or a conversion that we can't send (eg %S, %n, %ll)."""
+    args=[]
+    for m in RE_CONV.finditer(fmt):
+        (flags, width, prec, length, conv) = m.groups()
+        if conv == '%':
+            continue
+        if conv not in CONV_TYPES or length == 'll':
+            return None
+        for wp in (width, prec):
+            if wp == '*':
+                args.append((ARG_INT, 'd'))
+        t = CONV_TYPES[conv]
+        if t == ARG_INT and length == 'l':
+            t = ARG_LONG
+        args.append((t, conv))
+    if len(args) > ARGS_MAX:
+        return None
+    return args
+
+# ---------------------------------------
+def arg_types_word(args):
+    """ Pack the argument types into a uint32_t, first argument in the lowest nibble """
+    w=0
+    for i, (t, c) in enumerate(args):
+        w |= t << (4*i)
+    return w
+
+# ---------------------------------------
+def py_format(fmt):
+    """ Return the python % format equivalent of printf format fmt """
+    def conv(m):
+        (flags, width, prec, length, c) = m.groups()
+        if c == '%':
+            return '%%'
+        if c in 'iu':
+            c='d'
+        elif c == 'p':
+            c='x'
+        s='%'+flags+(width or '')
+        if prec is not None:
+            s+='.'+prec
+        return s+c
+    return RE_CONV.sub(conv, fmt)
+
+# -----------------------------------------------------------------------------
+class LogTokens:
+    """ Decodes tokenized log messages using the dictionary written by configure.py """
+
+    def __init__(self, fname=DICT_FILE):
+        with open(fname) as f:
+            d=json.load(f)
+        self.formats = d['formats']
+        # id -> (python format, argument types) of those that can be tokenized, others are logged as text by the MCU
+        self.tokens = {}
+        for (i, fmt) in enumerate(self.formats):
+            args = arg_types(fmt)
+            if args is not None:
+                self.tokens[i] = (py_format(fmt), args)
+        self.errors = 0
+
+
+    def decode(self, data):
+        """ Return (level, text) for the async log message data: [ASYNC_LOG, level, id(uint16), args ...] """
+        (level, tok) = struct.unpack_from('<BH', data, 1)
+        if tok not in self.tokens:
+            raise ValueError(f"unknown log token {tok}, is {DICT_FILE} out of date?")
+        (fmt, args) = self.tokens[tok]
+        vals=[]
+        i=4
+        for (t, c) in args:
+            if t == ARG_STR:
+                end = data.find(0, i)
+                if end < 0:
+                    # truncated by MCU
+                    end = len(data)
+                vals.append(bytes(data[i:end]).decode('latin-1'))
+                i = end+1
+                continue
+            size = 2 if t == ARG_INT else 4
+            if i+size > len(data):
+                # arguments that didn't fit were dropped by MCU
+                vals.append('?' if c == 'c' else 0)
+                continue
+            signed = c in 'di'
+            if t == ARG_INT:
+                v = struct.unpack_from('<h' if signed else '<H', data, i)[0]
+                if c == 'c':
+                    v = chr(v & 0xff)
+            elif t == ARG_LONG:
+                v = struct.unpack_from('<l' if signed else '<L', data, i)[0]
+            else:
+                v = struct.unpack_from('<f', data, i)[0]
+            i+=size
+            vals.append(v)
+        return (LEVELS[level] if level < len(LEVELS) else str(level), fmt % tuple(vals))
+
+
+    def attach(self, mmp):
+        """ Have mmp (an AsyncCmd) decode log messages and pass them to its logStrReceived() as it does text logs """
+        def decoder(msg):
+            try:
+                (level, text) = self.decode(msg.data)
+            except Exception:
+                self.errors += 1
+                raise
+            mmp.num_log += 1
+            mmp.logStrReceived(f"LOG:TOK:{level}: {text}".encode('utf-8'))
+            # consumed, don't queue it
+            return None
+        mmp.setAsyncDecoder(ASYNC_LOG, decoder)
@@ -0,0 +1,319 @@
+# -----------------------------------------------------------------------------
+# Copyright Stephen Stebbing 2023. http://telecnatron.com/
+# -----------------------------------------------------------------------------
+""" Receivers that turn the chars the MCU sends into messages and log strings, for telecnatron.mmp.MMP.
+
+NativeParser is the MCU's own parser, lib/mmp/mmp.c, built for the host as a shared library with
+'make host'. PyParser does the same in Python, and is used when the library can't be loaded.
+Both are fed whatever chars have been received, and return records of what they complete:
+    (REC_MSG, flags, data) or (REC_LOG, 0, log string without its leading tab)
+"""
+import os, ctypes, binascii, logging
+from struct import unpack
+
+# record types
+REC_MSG = 0
+REC_LOG = 1
+
+# environment variable that names the library, otherwise it's looked for where 'make host' puts it
+LIB_ENV = 'MMP_HOST_LIB'
+LIB_NAME = 'libmmp_host.so'
+LIB_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'build', 'host', LIB_NAME)
+
+# -----------------------------------
+class PyParser:
+    """ pure Python receiver """
+    SOM   = 1
+    STX   = 2
+    ETX   = 3
+    DELIM = 0
+    LOGS = b'\tLOG'
+    LOGS_MAX = 255
+    # max length of encoded COBS frame: 255 data, flags, crc and code bytes
+    COBS_MAX = 262
+    FLAGS_CRC = 0x04
+    CRC_INIT  = 0xffff
+
+    # states
+    SIDLE  = 0
+    SLOG   = 1
+    SSTX   = 2
+    SDATA  = 3
+    SETX   = 4
+    SLEN   = 5
+    SCS    = 6
+    SFLAGS = 7
+    SCRC   = 8
+    SCOBS  = 9
+
+    # -------------------------------
+    def __init__(self, unhandled=None):
+        """ unhandled, if passed, is called with each char that is neither part of a message nor of a log string """
+        self.unhandled = unhandled
+        self.state = self.SIDLE
+        self.logi = 0
+        self.buf = bytearray()
+        self.length = 0
+        self.flags = 0
+        self.cs = 0
+        self.crc = 0
+        self.errors_rx = 0
+        self.errors_timeout = 0
+        self.errors_log = 0
+
+    # -------------------------------
+    def crc16(self, length, flags, data):
+        return binascii.crc_hqx(bytes((length, flags)) + bytes(data), self.CRC_INIT)
+
+    # -------------------------------
+    @staticmethod
+    def cobsDecode(enc):
+        """ return decoded data, or None if enc is not a valid encoding """
+        out = bytearray()
+        i = 0
+        while i < len(enc):
+            code = enc[i]
+            if code == 0 or i + code > len(enc):
+                return None
+            out.extend(enc[i+1:i+code])
+            i += code
+            if code != 255 and i < len(enc):
+                out.append(0)
+        return bytes(out)
+
+    # -------------------------------
+    def cobsReceived(self, enc, recs):
+        d = self.cobsDecode(enc)
+        if d is None or len(d) < 3:
+            logging.debug("!invalid COBS frame!")
+            self.errors_rx += 1
+            return
+        data = d[1:-2]
+        if unpack('<H', d[-2:])[0] != self.crc16(len(data), d[0], data):
+            logging.debug("!invalid COBS frame crc!")
+            self.errors_rx += 1
+            return
+        recs.append((REC_MSG, d[0], data))
+
+    # -------------------------------
+    def feed(self, data):
+        """ parse received chars, return list of records """
+        recs = []
+        state = self.state
+        buf = self.buf
+        i = 0
+        n = len(data)
+        while i < n:
+            if state == self.SIDLE:
+                c = data[i]
+                i += 1
+                if c == self.SOM:
+                    self.logi = 0
+                    state = self.SLEN
+                elif c == self.DELIM:
+                    # start of COBS frame
+                    self.logi = 0
+                    buf = bytearray()
+                    state = self.SCOBS
+                elif c == self.LOGS[self.logi]:
+                    self.logi += 1
+                    if self.logi == len(self.LOGS):
+                        # this is a log string
+                        self.logi = 0
+                        buf = bytearray(self.LOGS[1:])
+                        state = self.SLOG
+                else:
+                    self.logi = 1 if c == self.LOGS[0] else 0
+                    if self.unhandled:
+                        self.unhandled(bytes((c,)))
+            elif state == self.SLOG:
+                j = data.find(b'\n', i)
+                end = n if j < 0 else j
+                buf.extend(data[i:end])
+                i = end
+                if len(buf) > self.LOGS_MAX:
+                    logging.warning("log string is too long. Truncated")
+                    self.errors_log += 1
+                    recs.append((REC_LOG, 0, bytes(buf[:self.LOGS_MAX])))
+                    state = self.SIDLE
+                elif j >= 0:
+                    i += 1
+                    recs.append((REC_LOG, 0, bytes(buf)))
+                    state = self.SIDLE
+            elif state == self.SCOBS:
+                j = data.find(b'\0', i)
+                end = n if j < 0 else j
+                buf.extend(data[i:end])
+                i = end
+                if len(buf) > self.COBS_MAX:
+                    logging.debug("!COBS frame too long!")
+                    self.errors_rx += 1
+                    state = self.SIDLE
+                elif j >= 0:
+                    i += 1
+                    if len(buf):
+                        # end of frame
+                        self.cobsReceived(buf, recs)
+                        state = self.SIDLE
+                    # else: second of two delimiters, frame starts with next char
+            elif state == self.SDATA:
+                take = min(self.length - len(buf), n - i)
+                buf.extend(data[i:i+take])
+                i += take
+                if len(buf) == self.length:
+                    state = self.SETX
+            else:
+                c = data[i]
+                i += 1
+                if state == self.SLEN:
+                    self.length = c
+                    self.cs = c
+                    state = self.SFLAGS
+                elif state == self.SFLAGS:
+                    self.flags = c
+                    self.cs += c
+                    state = self.SSTX
+                elif state == self.SSTX:
+                    if c == self.STX:
+                        buf = bytearray()
+                        state = self.SDATA if self.length else self.SETX
+                    else:
+                        logging.debug("!STX not seen!")
+                        self.errors_rx += 1
+                        state = self.SIDLE
+                elif state == self.SETX:
+                    if c == self.ETX:
+                        state = self.SCS
+                    else:
+                        logging.debug("!ETX not seen!")
+                        self.errors_rx += 1
+                        state = self.SIDLE
+                elif state == self.SCS and self.flags & self.FLAGS_CRC:
+                    # v2 frame, got crc low byte
+                    self.crc = c
+                    state = self.SCRC
+                elif state == self.SCRC:
+                    if self.crc | c << 8 == self.crc16(self.length, self.flags, buf):
+                        recs.append((REC_MSG, self.flags, bytes(buf)))
+                    else:
+                        logging.debug("!invalid crc!")
+                        self.errors_rx += 1
+                    state = self.SIDLE
+                elif state == self.SCS:
+                    if c == (256 - (self.cs + sum(buf))) % 256:
+                        recs.append((REC_MSG, self.flags, bytes(buf)))
+                    else:
+                        logging.debug("!invalid checksum!")
+                        self.errors_rx += 1
+                    state = self.SIDLE
+        self.state = state
+        self.buf = buf
+        return recs
+
+    # -------------------------------
+    def timeout(self):
+        """ nothing has been received for a while, abandon what was being received """
+        if self.state != self.SIDLE:
+            logging.debug("timeout")
+            self.errors_timeout += 1
+            self.state = self.SIDLE
+        self.logi = 0
+
+    # -------------------------------
+    def errors(self):
+        """ return (rx, timeout, log) error counts since the last call """
+        e = (self.errors_rx, self.errors_timeout, self.errors_log)
+        self.errors_rx = self.errors_timeout = self.errors_log = 0
+        return e
+
+
+# -----------------------------------
+class NativeParser:
+    """ receiver that is lib/mmp/mmp.c, see host/mmp_host.c """
+
+    # room for records that complete messages and log strings started in earlier reads
+    OUT_EXTRA = 1024
+
+    # -------------------------------
+    @classmethod
+    def load(cls, path=None):
+        """ return a NativeParser, or None if the library can't be loaded """
+        path = path or os.environ.get(LIB_ENV) or LIB_PATH
+        try:
+            lib = ctypes.CDLL(path)
+        except OSError as e:
+            logging.debug(f"mmp host parser {path} not loaded: {e}")
+            return None
+        return cls(lib)
+
+    # -------------------------------
+    def __init__(self, lib):
+        self.lib = lib
+        lib.mmp_host_new.restype = ctypes.c_void_p
+        lib.mmp_host_free.argtypes = (ctypes.c_void_p,)
+        lib.mmp_host_feed.restype = ctypes.c_uint32
+        lib.mmp_host_feed.argtypes = (ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint32, ctypes.c_void_p, ctypes.c_uint32)
+        lib.mmp_host_timeout.argtypes = (ctypes.c_void_p,)
+        lib.mmp_host_errors.argtypes = (ctypes.c_void_p, ctypes.c_void_p)
+        self.h = lib.mmp_host_new()
+        if not self.h:
+            raise MemoryError("mmp_host_new")
+        self.out = ctypes.create_string_buffer(4096)
+        self.out_size = 4096
+        self.feed_fn = lib.mmp_host_feed
+        self.err = (ctypes.c_uint32 * 3)()
+
+    # -------------------------------
+    def __del__(self):
+        if getattr(self, 'h', None):
+            self.lib.mmp_host_free(self.h)
+            self.h = None
+
+    # -------------------------------
+    def feed(self, data):
+        """ parse received chars, return list of records """
+        if type(data) is not bytes:
+            data = bytes(data)
+        size = len(data) + self.OUT_EXTRA
+        if self.out_size < size:
+            self.out = ctypes.create_string_buffer(size)
+            self.out_size = size
+        n = self.feed_fn(self.h, data, len(data), self.out, size)
+        if not n:
+            # most reads of a char or two don't complete anything
+            return []
+        # copy just the records, not the whole buffer as .raw would
+        out = ctypes.string_at(self.out, n)
+        recs = []
+        i = 0
+        while i < n:
+            length = out[i+2] | out[i+3] << 8
+            recs.append((out[i], out[i+1], out[i+4:i+4+length]))
+            i += 4 + length
+        return recs
+
+    # -------------------------------
+    def timeout(self):
+        """ nothing has been received for a while, abandon what was being received """
+        self.lib.mmp_host_timeout(self.h)
+
+    # -------------------------------
+    def errors(self):
+        """ return (rx, timeout, log) error counts since the last call """
+        self.lib.mmp_host_errors(self.h, self.err)
+        return tuple(self.err)
+
+
+# -----------------------------------
+def make_parser(unhandled=None, native=True):
+    """ return NativeParser if it can be loaded and native is True, otherwise PyParser.
+    unhandled is as for PyParser, it isn't called by NativeParser.
+    Each NativeParser.feed() is a ctypes call, so reads of a char or two are parsed about half as fast as by PyParser,
+    see 'make bench_host'. That's still some 100 times faster than chars arrive at 38400 baud, whereas reads of many chars,
+    as at high baud rates, are parsed several times faster. The parsers can't be swapped mid stream as neither can take
+    over the other's part parsed frame. """
+    if native:
+        p = NativeParser.load()
+        if p is not None:
+            return p
+    return PyParser(unhandled)
@@ -36,6 +36,11 @@ class Transport:
         return None;
 
 
+    def read(self):
+        """ Return all the chars that have been received, waiting up to the timeout for the first of them """
+        return self.readByte();
+
+
     def write(self, databytes):
         """ """
         pass;
@@ -47,6 +52,21 @@ class Transport:
         pass
 
 
+    def setBaud(self, baud):
+        """ Change the baud rate """
+        pass
+
+
+    def getBaud(self):
+        """ Return the current baud rate """
+        return None
+
+
+    def drain(self):
+        """ Wait until all written data has been transmitted """
+        pass
+
+
 # -----------------------------------------------------------
 class SerialTransport:
     """ Network-transport class for the serial port """
@@ -65,6 +85,12 @@ class SerialTransport:
         return self.serial.read(1)
 
 
+    def read(self):
+        """ Return all the chars that have been received, waiting up to the timeout for the first of them """
+        n = self.serial.in_waiting
+        return self.serial.read(n if n else 1)
+
+
     def write(self, databytes):
         """ """
         return self.serial.write(databytes);
@@ -75,6 +101,22 @@ class SerialTransport:
         pass
 
 
+    def setBaud(self, baud):
+        """ Change the baud rate, any received but unread data is discarded """
+        self.serial.reset_input_buffer()
+        self.serial.baudrate = baud
+
+
+    def getBaud(self):
+        """ Return the current baud rate """
+        return self.serial.baudrate
+
+
+    def drain(self):
+        """ Wait until all written data has been transmitted """
+        self.serial.flush()
+
+
 
 
 
@@ -14,18 +14,27 @@ from struct import *
 from telecnatron.mmp.MMP import MMP;
 from telecnatron.mmp.transport import SerialTransport
 from telecnatron.mmp.AsyncCmd import AsyncCmd
+from telecnatron.mmp.logtok import LogTokens, DICT_FILE
 #from telecnatron.mmp import *;
 from telecnatron.util import logging_config
 from telecnatron.avr.cmd.clock import Clock
 from telecnatron.avr.cmd.ping import Ping
 from telecnatron.avr.cmd.version import Version
+from telecnatron.avr.cmd.baud import Baud
+from telecnatron.avr.cmd.uart_stats import UartStats
+from telecnatron.avr.cmd.caps import Caps
+from telecnatron.avr.cmd.batch import Batch
+from telecnatron.avr.cmd.bulk import Bulk
+from telecnatron.avr.cmd.subscribe import Subscribe
+from telecnatron.avr.cmd.link_test import LinkTest
+from telecnatron.avr.cmd.task_stats import TaskStats
 #from telecnatron.avr.cmd.PCF8574 import PCF8574
 from telecnatron.avr.cmd.LCD import LCD
 from telecnatron.avr.cmd.INA219 import INA219
 from telecnatron.avr.cmd.Handler import Handler
 from telecnatron.avr.cmd.Handler import ENoResponse
 from devices import Fan, Load, Shutdown, Measurements
-from config import MMPCmd
+from config import MMPCmd, Tasks
 # -------------------------------------------
 # flag to run/stop main loop
 
@@ -58,6 +67,20 @@ if __name__ == '__main__':
     argp.add_argument('-rb','--reboot_mcu', action='store_true', help="reboot the MCU.")
     argp.add_argument('-tf','--tick_freq', default=1000, help="set the MCU ticks per second value.")
     argp.add_argument('-rj','--reset-joules', action='store_true', help="reset the count of joules to zero.")
+    argp.add_argument('-fb','--fast-baud', type=int, default=0, help="negotiate this baud rate with the MCU, eg 115200, 250000, 500000, 1000000.")
+    argp.add_argument('-crc','--crc', action='store_true', help="use CRC-16 (v2) frames if the MCU supports them.")
+    argp.add_argument('-cobs','--cobs', action='store_true', help="use COBS framing if the MCU supports it.")
+    argp.add_argument('-tag','--tagged', action='store_true', help="send tagged commands, so several can be outstanding, if the MCU supports them.")
+    argp.add_argument('-st','--stream', type=int, default=0, help="have MCU stream measurements every this many ms.")
+    argp.add_argument('-cm','--compact', type=lambda x: int(x,0), default=None, help="stream delta encoded compact records with these fields: bit 0 volts, 1 amps, 2 watts, 3 joules.")
+    argp.add_argument('-lt','--log-tokens', default=DICT_FILE, help=f"dictionary used to decode the MCU's tokenized log messages, default {DICT_FILE}.")
+    argp.add_argument('-rf','--read-flash', type=lambda x: int(x,0), default=0, help="read this many bytes of the MCU's flash with a bulk transfer, and print the transfer rate.")
+    argp.add_argument('-am','--async-mask', type=lambda x: int(x,0), default=None, help="have MCU send only the async messages in this mask on this link, bit n is message id n.")
+    argp.add_argument('-lq','--link-test', type=int, default=0, help="send this many link test messages, and print throughput, round trip times and bit error rate.")
+    argp.add_argument('-ll','--link-len', type=int, default=32, help="payload length of link test messages, default 32.")
+    argp.add_argument('-lg','--link-gen', action='store_true', help="have MCU generate link test payloads, rather than check and echo those that are sent to it.")
+    argp.add_argument('-us','--uart-stats', action='store_true', help="print the MCU's uart error counters and reset them.")
+    argp.add_argument('-ts','--task-stats', action='store_true', help="print the MCU's task run times, lateness and cpu duty cycle, and reset them.")
     args = argp.parse_args()
 
     # logger
@@ -72,6 +95,8 @@ if __name__ == '__main__':
 
     try:
         mmp = AsyncCmd(SerialTransport(args.port, args.baud, timeoutSec=0.008));
+        if os.path.isfile(args.log_tokens):
+            LogTokens(args.log_tokens).attach(mmp)
         #        mmp.rebootMCU();
         #mmp.debug=True
         
@@ -84,6 +109,38 @@ if __name__ == '__main__':
         load=Load(mmp,MMPCmd.CMD_LOAD_SWITCH)
         shtdwn=Shutdown(mmp, MMPCmd.CMD_SHTDWN)
         measurements=Measurements(mmp, MMPCmd.CMD_MEASUREMENTS)
+        caps=Caps(mmp, MMPCmd.CMD_CAPS)
+        # have handlers refuse commands that are too long for the MCU, eg link test with a long --link-len
+        caps.read()
+        batch=Batch(mmp, MMPCmd.CMD_BATCH)
+        if args.crc:
+            caps.enable_crc()
+        if args.cobs:
+            caps.enable_cobs()
+        if args.tagged:
+            caps.enable_tags()
+        baud=Baud(mmp, MMPCmd.CMD_BAUD)
+        if args.fast_baud:
+            baud.set(args.fast_baud)
+        uart_stats=UartStats(mmp, MMPCmd.CMD_UART_STATS)
+        bulk=Bulk(mmp, MMPCmd.CMD_BULK)
+        subscribe=Subscribe(mmp, MMPCmd.CMD_SUBSCRIBE)
+        if args.async_mask is not None:
+            logging.info(f"async mask: 0x{subscribe.set(args.async_mask):04x}")
+        if args.read_flash:
+            t=time.monotonic()
+            data=bulk.read_mem(0, args.read_flash, flash=True)
+            t=time.monotonic()-t
+            logging.info(f"read {len(data)} bytes of flash in {t:.3f}s, {len(data)/t:.0f} bytes/s: {binascii.hexlify(data[:32])}...")
+        link_test=LinkTest(mmp, MMPCmd.CMD_LINK_TEST)
+        if args.link_test:
+            r=link_test.run(args.link_test, args.link_len, LinkTest.MODE_GEN if args.link_gen else LinkTest.MODE_ECHO)
+            print(LinkTest.report(r))
+        if args.uart_stats:
+            logging.info(f"uart stats: {uart_stats.reset()}")
+        task_stats=TaskStats(mmp, MMPCmd.CMD_TASK_STATS)
+        if args.task_stats:
+            print(TaskStats.report(*task_stats.read_all(reset=True), names=Tasks.NAMES))
         #measurements.reset()
         #shtdwn.shutdown()
         shtdwn.restart()
@@ -109,6 +166,9 @@ if __name__ == '__main__':
 
         if args.reset_joules:
             measurements.reset()
+
+        if args.stream:
+            logging.info(f"streaming measurements every {measurements.subscribe(args.stream, mask=args.compact, delta=True)} ms")
             
         # keep track of when we set the time
         start_sec = round(time.time())
@@ -169,11 +229,16 @@ if __name__ == '__main__':
                     lcds=f"{bv:5.3f}V {sa:5.3f}A"
                     lcd.puts(lcds.ljust(32))
 
-                logging.info(measurements.read())
+                # poll status, all in one message
+                (mr, lr, sr, cr) = batch.run(measurements.sub_request(Measurements.SC_READ), load.request(),
+                                         shtdwn.sub_request(Shutdown.SC_READ), clk.sub_request(Clock.SC_READ))
+                logging.info(measurements.decode(mr))
+                load.decode(lr)
+                shtdwn.decode(sr)
                     
                 if lc % 5 == 0:
                     # check MCU time error
-                    mcu_clk=clk.read()
+                    mcu_clk=clk.decode(cr)
                     mcu_utime = mcu_clk['seconds']
                     mcu_tfreq=mcu_clk['tick_freq']
                     now = round(time.time())
@@ -190,6 +255,8 @@ if __name__ == '__main__':
                         tfcorrection= mcu_tfreq * (1+diff_r)
                         #logging.info(f"mcu is time is {s} by {abs(diff)} seconds over {sc} seconds, that is {diff_r*100:6.2f}%, {round(diff_r * 3600 * 24)} seconds per day, MCU tick_freq should be set to {round(tfcorrection, 2)} (currently: {mcu_tfreq})")
                     
+                if args.stream:
+                    measurements.keepalive()
                 lc+=1
             except ENoResponse as e:
                 print(e)